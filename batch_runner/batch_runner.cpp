@@ -0,0 +1,651 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define strcasecmp _stricmp
+#else
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#endif
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include "../src/file_reader.h"
+#include "../src/file_locality.h"
+}
+
+#include "../src/frame_policy.h"
+#include "../src/prefetch_reader.h"
+#include "../src/probe_index.h"
+#include "../src/thumbnail_engine.h"
+#include "../src/trace.h"
+
+// A file to do and where its thumbnail goes under the output directory,
+// mirroring where it was found under the input directory
+struct BatchInput {
+    std::string      path;
+    std::string      relative;
+};
+
+struct BatchFile {
+    std::string      path;
+    std::string      output;
+    FileLocality     locality;
+
+    // Opened early by the stager or on the spot by the worker, whoever is first
+    std::mutex       open_lock;
+    FileReader      *file;
+    PrefetchReader  *prefetch;
+    bool             stage_claimed;
+    bool             processed;
+};
+
+// Files on one device, in the order they should be done in
+struct DeviceQueue {
+    uint64_t                 device;
+    std::deque<BatchFile *>  files;
+    int                      active;
+};
+
+struct BatchOptions {
+    std::string      output_dir;
+    int              size_limit;
+    ThumbnailFormat  format;
+    ThumbnailPolicy  policy;
+    int              policy_value;
+    int              jobs;
+
+    // Order by on-disk position per device instead of listing order
+    bool             locality;
+
+    // Most files being worked on at once per device, 0 for no limit
+    int              per_device;
+
+    // How many upcoming files per device get their header reads started early
+    int              lookahead;
+};
+
+static BatchOptions              options;
+
+static std::mutex                queue_lock;
+static std::condition_variable   queue_cond;
+static std::vector<DeviceQueue>  devices;
+static size_t                    next_device;
+
+static std::atomic<int>          files_done;
+static std::atomic<int>          files_failed;
+static std::atomic<int64_t>      engine_us;
+static std::atomic<uint64_t>     io_bytes;
+static std::atomic<int>          index_hits;
+
+static bool is_matroska_name(const std::string &name)
+{
+    static const char *extensions[] = { ".mkv", ".webm", ".mk3d" };
+
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t length = strlen(extensions[i]);
+        if (name.size() > length && !strcasecmp(name.c_str() + name.size() - length, extensions[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static std::string base_name(const std::string &path)
+{
+    size_t slash = path.find_last_of("/\\");
+
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static void add_input(const std::string &path, const std::string &relative, std::vector<BatchInput> *inputs)
+{
+    BatchInput input;
+    input.path     = path;
+    input.relative = relative;
+    inputs->push_back(input);
+}
+
+// Adds the file, or the Matroska files under the directory, in listing order.
+// relative is where the directory is under the one given on the command line,
+// empty for that one itself.
+static void collect_files(const std::string &path, const std::string &relative,
+                          std::vector<BatchInput> *inputs)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA((path + "\\*").c_str(), &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        add_input(path, base_name(path), inputs);
+        return;
+    }
+
+    do {
+        std::string name = find_data.cFileName;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            collect_files(path + "\\" + name, relative + name + "/", inputs);
+        } else if (is_matroska_name(name)) {
+            add_input(path + "\\" + name, relative + name, inputs);
+        }
+    } while (FindNextFileA(find, &find_data));
+
+    FindClose(find);
+#else
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        add_input(path, base_name(path), inputs);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        std::string child = path + "/" + name;
+        struct stat st;
+        if (stat(child.c_str(), &st) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_files(child, relative + name + "/", inputs);
+        } else if (is_matroska_name(name)) {
+            add_input(child, relative + name, inputs);
+        }
+    }
+
+    closedir(dir);
+#endif
+}
+
+// The relative path with the thumbnail's extension. Should two inputs still
+// end up with the same name (the same file given twice, or two directories
+// with the same layout), the later ones get a hash of their full path added.
+static std::string output_path(const BatchInput &input, std::set<std::string> *used)
+{
+    std::string name = input.relative;
+
+    size_t dot   = name.rfind('.');
+    size_t slash = name.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        name.erase(dot);
+    }
+
+    std::string output = options.output_dir + "/" + name;
+    std::string ext    = std::string(".") + thumbnail_format_extension(options.format);
+
+    if (!used->insert(output + ext).second) {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < input.path.size(); i++) {
+            hash = (hash ^ (uint8_t)input.path[i]) * 16777619u;
+        }
+
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%08x", hash);
+        output += suffix;
+        used->insert(output + ext);
+    }
+
+    return output + ext;
+}
+
+// Creates the directories leading up to the file, the output directory
+// included. Failures show up when the file is opened, so they're not checked
+// here, the first few components (drive, share, root) usually exist anyway.
+static void make_parent_dirs(const std::string &path)
+{
+    for (size_t slash = path.find_first_of("/\\", 1); slash != std::string::npos;
+         slash = path.find_first_of("/\\", slash + 1)) {
+        std::string dir = path.substr(0, slash);
+#ifdef _WIN32
+        _mkdir(dir.c_str());
+#else
+        mkdir(dir.c_str(), 0777);
+#endif
+    }
+}
+
+// Called with file->open_lock held
+static int open_file(BatchFile *file)
+{
+    if (file->file) {
+        return 0;
+    }
+
+    file->file = file_reader_open(file->path.c_str());
+    if (!file->file) {
+        return -1;
+    }
+
+    file->prefetch = prefetch_reader_create(file->file, PREFETCH_BACKEND_AUTO);
+
+    return 0;
+}
+
+// Starts the header and Cues reads of a file that's coming up, so that they
+// overlap with the decoding of the current one
+static void stage_file(BatchFile *file)
+{
+    TRACE_SCOPE("stage_file");
+
+    std::lock_guard<std::mutex> lock(file->open_lock);
+
+    // A worker may have gotten to it in the meantime
+    if (file->processed || open_file(file) < 0 || !file->prefetch) {
+        return;
+    }
+
+    ThumbnailInput input;
+    memset(&input, 0, sizeof(input));
+    input.opaque   = file->prefetch;
+    input.seek     = prefetch_seek;
+    input.prefetch = prefetch_hint;
+
+    thumbnail_prefetch_header(&input);
+}
+
+// Picks the next file from a device that's under its limit, round robin over
+// the devices. Also hands out the upcoming files of that device to be staged.
+// Returns nullptr once everything has been handed out.
+static BatchFile *take_next_file(size_t *device_index, std::vector<BatchFile *> *to_stage)
+{
+    TRACE_SCOPE("take_next_file");
+
+    std::unique_lock<std::mutex> lock(queue_lock);
+
+    for (;;) {
+        bool any_left = false;
+
+        for (size_t i = 0; i < devices.size(); i++) {
+            size_t index = (next_device + i) % devices.size();
+            DeviceQueue &device = devices[index];
+
+            if (device.files.empty()) {
+                continue;
+            }
+            any_left = true;
+
+            if (options.per_device > 0 && device.active >= options.per_device) {
+                continue;
+            }
+
+            BatchFile *file = device.files.front();
+            device.files.pop_front();
+            device.active++;
+
+            for (size_t j = 0; j < device.files.size() && (int)j < options.lookahead; j++) {
+                if (!device.files[j]->stage_claimed) {
+                    device.files[j]->stage_claimed = true;
+                    to_stage->push_back(device.files[j]);
+                }
+            }
+
+            next_device   = index + 1;
+            *device_index = index;
+            return file;
+        }
+
+        if (!any_left) {
+            return nullptr;
+        }
+
+        // Every device with files left is at its limit
+        queue_cond.wait(lock);
+    }
+}
+
+static void process_file(BatchFile *file)
+{
+    TRACE_SCOPE("process_file");
+
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
+
+    request.size_limit = options.size_limit;
+    request.format     = options.format;
+
+    request.policy       = options.policy;
+    request.policy_value = options.policy_value;
+
+    ThumbnailResult result;
+    int ret = AVERROR(ENOENT);
+
+    {
+        // Shows up when the stager still has the file
+        TRACE_BEGIN("open_lock");
+        std::lock_guard<std::mutex> lock(file->open_lock);
+        TRACE_END("open_lock");
+
+        if (open_file(file) >= 0) {
+            if (file->prefetch) {
+                request.input.opaque      = file->prefetch;
+                request.input.read_packet = prefetch_read_packet;
+                request.input.seek        = prefetch_seek;
+                request.input.prefetch    = prefetch_hint;
+            } else {
+                request.input.opaque      = file->file;
+                request.input.read_packet = file_read_packet;
+                request.input.seek        = file_seek;
+            }
+
+            FileIdentity identity;
+            ProbeIndex   probe_index;
+            bool         have_identity = file_reader_identity(file->file, &identity) >= 0;
+
+            if (have_identity) {
+                TRACE_BEGIN("probe_index_load");
+                probe_index_load(&identity, &probe_index);
+                TRACE_END("probe_index_load");
+                request.probe_index = &probe_index;
+            }
+
+            ret = thumbnail_generate(&request, &result);
+            engine_us += result.stats.total_us;
+
+            if (result.used_probe_index) {
+                index_hits++;
+            }
+
+            // A loaded index is stored again if the decode found the crop for it
+            if (ret >= 0 && have_identity && (!result.used_probe_index || probe_index.dirty)) {
+                probe_index.identity = identity;
+                probe_index_store(&probe_index);
+            }
+        }
+
+        if (file->prefetch) {
+            PrefetchStats io_stats;
+            prefetch_reader_get_stats(file->prefetch, &io_stats);
+            io_bytes += io_stats.bytes;
+
+            prefetch_reader_close(file->prefetch);
+            file->prefetch = nullptr;
+        }
+
+        file_reader_close(file->file);
+        file->file      = nullptr;
+        file->processed = true;
+    }
+
+    if (ret >= 0) {
+        const std::string &output = file->output;
+        make_parent_dirs(output);
+        FILE *fp = fopen(output.c_str(), "wb");
+
+        if (!fp || fwrite(result.data, 1, result.size, fp) != (size_t)result.size) {
+            fprintf(stderr, "Failed to write %s :<\n", output.c_str());
+            ret = AVERROR(EIO);
+        }
+
+        if (fp) {
+            fclose(fp);
+        }
+
+        av_free(result.data);
+    }
+
+    if (ret < 0) {
+        char message[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+        av_strerror(ret, message, sizeof(message));
+        fprintf(stderr, "%s: %s\n", file->path.c_str(), message);
+        files_failed++;
+    } else {
+        files_done++;
+    }
+}
+
+static void worker_thread(void)
+{
+    for (;;) {
+        std::vector<BatchFile *> to_stage;
+        size_t device_index = 0;
+
+        BatchFile *file = take_next_file(&device_index, &to_stage);
+        if (!file) {
+            return;
+        }
+
+        for (size_t i = 0; i < to_stage.size(); i++) {
+            stage_file(to_stage[i]);
+        }
+
+        process_file(file);
+
+        std::lock_guard<std::mutex> lock(queue_lock);
+        devices[device_index].active--;
+        queue_cond.notify_all();
+    }
+}
+
+// Extent offsets and inode numbers don't compare, so on a device where only
+// some files had their extents read those come first in disk order, then the
+// rest in inode order
+static bool by_position(const BatchFile *a, const BatchFile *b)
+{
+    if (a->locality.device != b->locality.device) {
+        return a->locality.device < b->locality.device;
+    }
+    if (a->locality.physical != b->locality.physical) {
+        return a->locality.physical > b->locality.physical;
+    }
+    return a->locality.position < b->locality.position;
+}
+
+// Puts the files into per-device queues sorted by where they are on the device,
+// or into a single queue in listing order
+static void plan_work(const std::vector<BatchInput> &inputs, std::vector<BatchFile *> *files)
+{
+    std::set<std::string> outputs;
+    int physical = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        BatchFile *file = new BatchFile;
+        file->path          = inputs[i].path;
+        file->output        = output_path(inputs[i], &outputs);
+        file->file          = nullptr;
+        file->prefetch      = nullptr;
+        file->stage_claimed = false;
+        file->processed     = false;
+        memset(&file->locality, 0, sizeof(file->locality));
+
+        if (options.locality) {
+            FileReader *reader = file_reader_open(file->path.c_str());
+            if (reader) {
+                file_reader_locality(reader, &file->locality);
+                physical += file->locality.physical;
+                file_reader_close(reader);
+            }
+        }
+
+        files->push_back(file);
+    }
+
+    if (!options.locality) {
+        DeviceQueue queue;
+        queue.device = 0;
+        queue.active = 0;
+        queue.files.assign(files->begin(), files->end());
+        devices.push_back(queue);
+        return;
+    }
+
+    std::vector<BatchFile *> sorted(*files);
+    std::stable_sort(sorted.begin(), sorted.end(), by_position);
+
+    for (size_t i = 0; i < sorted.size(); i++) {
+        size_t d = 0;
+        while (d < devices.size() && devices[d].device != sorted[i]->locality.device) {
+            d++;
+        }
+
+        if (d == devices.size()) {
+            DeviceQueue queue;
+            queue.device = sorted[i]->locality.device;
+            queue.active = 0;
+            devices.push_back(queue);
+        }
+
+        devices[d].files.push_back(sorted[i]);
+    }
+
+    fprintf(stderr, "Ordered %u files on %u devices, %d by extent position and the rest by inode\n",
+            (unsigned)sorted.size(), (unsigned)devices.size(), physical);
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] output_dir input_file_or_dir...\n"
+            "  Thumbnails go under output_dir in the same layout as the files under the input directories.\n"
+            "  --size N           longer side of the thumbnails (256)\n"
+            "  --format jpg|png|webp\n"
+            "  --policy first|percent:N|chapter:N|tag|auto\n"
+            "                     where in the files to take the picture from (first)\n"
+            "  --jobs N           files worked on at once (4)\n"
+            "  --order listing|locality\n"
+            "                     locality groups files by device and sorts them by on-disk position\n"
+            "  --per-device N     most files worked on at once per device with --order locality (0: no limit)\n"
+            "  --lookahead N      upcoming files per device whose header reads are started early (2)\n"
+            "  --index-dir DIR    keep probe indexes in DIR so reruns skip probing\n"
+            "  --trace FILE       write a Chrome trace (opens in Perfetto) of the whole run to FILE\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    options.size_limit = 256;
+    options.format     = THUMBNAIL_FORMAT_JPEG;
+    options.policy     = THUMBNAIL_POLICY_FIRST;
+    options.jobs       = 4;
+    options.locality   = false;
+    options.per_device = 0;
+    options.lookahead  = 2;
+
+    const char *trace_path = nullptr;
+
+    int i = 1;
+    for (; i < argc && !strncmp(argv[i], "--", 2); i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        const char *value = argv[i + 1];
+
+        if (!strcmp(argv[i], "--size")) {
+            options.size_limit = atoi(value);
+        } else if (!strcmp(argv[i], "--format")) {
+            if (!strcmp(value, "jpg")) {
+                options.format = THUMBNAIL_FORMAT_JPEG;
+            } else if (!strcmp(value, "png")) {
+                options.format = THUMBNAIL_FORMAT_PNG;
+            } else if (!strcmp(value, "webp")) {
+                options.format = THUMBNAIL_FORMAT_WEBP;
+            } else {
+                fprintf(stderr, "Unknown format %s\n", value);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--policy")) {
+            if (!frame_policy_parse(value, &options.policy, &options.policy_value)) {
+                fprintf(stderr, "Unknown policy %s\n", value);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--jobs")) {
+            options.jobs = atoi(value);
+        } else if (!strcmp(argv[i], "--order")) {
+            options.locality = !strcmp(value, "locality");
+        } else if (!strcmp(argv[i], "--per-device")) {
+            options.per_device = atoi(value);
+        } else if (!strcmp(argv[i], "--lookahead")) {
+            options.lookahead = atoi(value);
+        } else if (!strcmp(argv[i], "--index-dir")) {
+            probe_index_set_dir(value);
+        } else if (!strcmp(argv[i], "--trace")) {
+            trace_path = value;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (argc - i < 2 || options.jobs < 1 || options.size_limit <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    options.output_dir = argv[i++];
+
+    if (trace_path && trace_start() < 0) {
+        return 1;
+    }
+
+    // Without locality ordering there's only the one queue
+    if (!options.locality) {
+        options.per_device = 0;
+    }
+
+    std::vector<BatchInput> inputs;
+    for (; i < argc; i++) {
+        collect_files(argv[i], "", &inputs);
+    }
+
+    std::vector<BatchFile *> files;
+    plan_work(inputs, &files);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int j = 0; j < options.jobs; j++) {
+        threads.push_back(std::thread(worker_thread));
+    }
+    for (size_t j = 0; j < threads.size(); j++) {
+        threads[j].join();
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The workers are gone, so their trace buffers can be read
+    if (trace_path && !trace_write(trace_path)) {
+        fprintf(stderr, "Trace written to %s\n", trace_path);
+    }
+
+    fprintf(stderr, "%d files done, %d failed in %.2f s: %.1f files/s, %.1f MiB read, %.2f s in the engine,"
+            " %d probe index hits\n",
+            (int)files_done, (int)files_failed, elapsed, (files_done + files_failed) / elapsed,
+            io_bytes / (1024.0 * 1024.0), engine_us / 1000000.0, (int)index_hits);
+
+    for (size_t j = 0; j < files.size(); j++) {
+        delete files[j];
+    }
+
+    return files_failed ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Usage: bench_coldstart.sh cli_test.exe input.mkv [runs]
+#
+# Measures process start to first thumbnail for the full and the trimmed
+# FFmpeg builds. Both have to be shared builds installed into their own
+# prefixes (see build_ffmpeg.sh), the same cli_test.exe is run against
+# either set of DLLs by putting its bin directory first in PATH.
+#
+# FULL_BIN and THUMB_BIN can be used to point at the prefixes' bin directories.
+# STATIC_CLI_TEST can point at a cli_test.exe built with /p:FFmpegLinking=static,
+# which is then timed as well, with no FFmpeg DLLs to load at all.
+
+CLI_TEST=$1
+INPUT=$2
+RUNS=${3:-20}
+
+FULL_BIN=${FULL_BIN:-thirdparty/build_prefix/bin}
+THUMB_BIN=${THUMB_BIN:-thirdparty/build_prefix_thumb/bin}
+
+if [ -z "$CLI_TEST" ] || [ -z "$INPUT" ]; then
+    echo "Usage: $0 cli_test.exe input.mkv [runs]" >&2
+    exit 1
+fi
+
+OUTPUT=$(mktemp -u bench_coldstart_XXXXXX).bmp
+
+# Prints min/median/mean wall clock time in milliseconds over RUNS runs
+run_profile() {
+    name=$1
+    bin_dir=$2
+    cli_test=${3:-$CLI_TEST}
+
+    if [ ! -d "$bin_dir" ]; then
+        echo "$name: $bin_dir does not exist, skipping" >&2
+        return
+    fi
+
+    times=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        PATH="$bin_dir:$PATH" "$cli_test" "$INPUT" "$OUTPUT" 256 2>/dev/null
+        ret=$?
+        end=$(date +%s%N)
+
+        if [ $ret -ne 0 ]; then
+            echo "$name: run $i failed with $ret" >&2
+            return
+        fi
+
+        times="$times $(( (end - start) / 1000 ))"
+        i=$((i + 1))
+    done
+
+    echo $times | tr ' ' '\n' | sort -n | awk -v name="$name" '
+        { t[NR] = $1; sum += $1 }
+        END {
+            median = (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "%-6s runs: %d  min: %.2f ms  median: %.2f ms  mean: %.2f ms\n",
+                   name, NR, t[1] / 1000, median / 1000, sum / NR / 1000
+        }'
+}
+
+run_profile full "$FULL_BIN"
+run_profile thumb "$THUMB_BIN"
+
+if [ -n "$STATIC_CLI_TEST" ]; then
+    run_profile static "$(dirname "$STATIC_CLI_TEST")" "$STATIC_CLI_TEST"
+fi
+
+rm -f "$OUTPUT"
@@ -1,3 +1,97 @@
-#!/bin/sh
-cd thirdparty/build_ffmpeg
-../ffmpeg/configure --enable-shared --disable-static --prefix=/cygwin/projects/matroska_thumbnailer/thirdparty/build_prefix/ --disable-doc --disable-programs --disable-postproc --disable-swresample --build-suffix=-lavfthumb
\ No newline at end of file
+#!/bin/sh
+# Usage: build_ffmpeg.sh [full|thumb] [shared|static]
+#
+# full:  everything FFmpeg has (the old default)
+# thumb: only the Matroska/WebM demuxer and the decoders/parsers we actually
+#        thumbnail. Smaller libraries load and relocate faster in every
+#        thumbnail process, and there is nothing else to probe.
+#
+# Need another codec? Add its decoder (and parser, if it has one) to the lists below.
+THUMB_DEMUXERS="matroska"
+THUMB_DECODERS="h264 hevc vp8 vp9 mpeg4 msmpeg4v3 mpeg1video mpeg2video vc1 wmv3 theora mjpeg png"
+THUMB_PARSERS="h264 hevc vp8 vp9 av1 mpeg4video mpegvideo vc1 mjpeg png"
+
+# Output formats for the encoded thumbnails (JPEG, PNG, WebP) and the
+# animated previews (APNG, animated WebP), which go through a muxer
+THUMB_ENCODERS="mjpeg png libwebp apng libwebp_anim"
+THUMB_MUXERS="apng webp"
+
+# WebP output needs libwebp, set WITH_LIBWEBP=0 to build without it
+WITH_LIBWEBP=${WITH_LIBWEBP:-1}
+
+# AV1 is decoded with dav1d, FFmpeg's own av1 decoder only does hwaccel.
+# Set WITH_LIBDAV1D=0 to build without it, AV1 files fail to open then.
+WITH_LIBDAV1D=${WITH_LIBDAV1D:-1}
+
+if [ "$WITH_LIBDAV1D" = "1" ]; then
+    THUMB_DECODERS="$THUMB_DECODERS libdav1d"
+fi
+
+PROFILE=${1:-full}
+LINKING=${2:-shared}
+
+PREFIX_ROOT=/cygwin/projects/matroska_thumbnailer/thirdparty
+
+COMMON_FLAGS="--disable-doc --disable-programs --disable-postproc --disable-swresample --build-suffix=-lavfthumb"
+
+if [ "$WITH_LIBWEBP" = "1" ]; then
+    COMMON_FLAGS="$COMMON_FLAGS --enable-libwebp"
+fi
+
+if [ "$WITH_LIBDAV1D" = "1" ]; then
+    COMMON_FLAGS="$COMMON_FLAGS --enable-libdav1d"
+fi
+
+case "$LINKING" in
+shared)
+    LINK_FLAGS="--enable-shared --disable-static"
+    ;;
+static)
+    # Linked straight into the handler DLL, so it has to be MSVC-compatible.
+    # Build the projects with /p:FFmpegLinking=static to link the static
+    # libraries from lib/ instead of the import libs (see common/common.props).
+    LINK_FLAGS="--enable-static --disable-shared --toolchain=msvc"
+    ;;
+*)
+    echo "Unknown linking mode: $LINKING" >&2
+    exit 1
+    ;;
+esac
+
+case "$PROFILE" in
+full)
+    BUILD_DIR=thirdparty/build_ffmpeg
+    PREFIX=${PREFIX:-$PREFIX_ROOT/build_prefix/}
+    PROFILE_FLAGS=""
+    ;;
+thumb)
+    BUILD_DIR=thirdparty/build_ffmpeg_thumb
+    # Kept apart from the full build for bench_coldstart.sh, pass PREFIX to
+    # install it where the project files look for FFmpeg
+    PREFIX=${PREFIX:-$PREFIX_ROOT/build_prefix_thumb/}
+    PROFILE_FLAGS="--disable-everything --disable-network --disable-avdevice --disable-avfilter"
+    for demuxer in $THUMB_DEMUXERS; do
+        PROFILE_FLAGS="$PROFILE_FLAGS --enable-demuxer=$demuxer"
+    done
+    for decoder in $THUMB_DECODERS; do
+        PROFILE_FLAGS="$PROFILE_FLAGS --enable-decoder=$decoder"
+    done
+    for parser in $THUMB_PARSERS; do
+        PROFILE_FLAGS="$PROFILE_FLAGS --enable-parser=$parser"
+    done
+    for encoder in $THUMB_ENCODERS; do
+        PROFILE_FLAGS="$PROFILE_FLAGS --enable-encoder=$encoder"
+    done
+    for muxer in $THUMB_MUXERS; do
+        PROFILE_FLAGS="$PROFILE_FLAGS --enable-muxer=$muxer"
+    done
+    ;;
+*)
+    echo "Unknown profile: $PROFILE" >&2
+    exit 1
+    ;;
+esac
+
+mkdir -p "$BUILD_DIR"
+cd "$BUILD_DIR"
+../ffmpeg/configure $LINK_FLAGS --prefix="$PREFIX" $COMMON_FLAGS $PROFILE_FLAGS
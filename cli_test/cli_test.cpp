@@ -2,8 +2,11 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
-#include <inttypes.h>
 
 // HBITMAP stuff
 #include <windows.h>
@@ -12,14 +15,56 @@
 // IStream stuff
 #include <shlwapi.h>
 
+// GetProcessMemoryInfo
+#include <psapi.h>
+
 extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
 #include <libavutil/imgutils.h>
-#include <libavformat/avformat.h>
-#include <libavcodec/avcodec.h>
-
+#include <libavutil/mem.h>
 #include <libswscale/swscale.h>
+#include "../src/istream_wrapper.h"
 }
 
+#include "../src/thumbnail_engine.h"
+#include "../src/frame_policy.h"
+#include "../src/io_recorder.h"
+#include "../src/stripe_scale.h"
+#include "../src/hdr_convert.h"
+#include "../src/pipeline_pool.h"
+#include "../src/trace.h"
+
+// Size of the synthetic frame for --stripe-check
+#define STRIPE_CHECK_WIDTH  7680
+#define STRIPE_CHECK_HEIGHT 4320
+
+// Size of the synthetic frame for --hdr-bench
+#define HDR_BENCH_WIDTH  3840
+#define HDR_BENCH_HEIGHT 2160
+
+// Side of the flat patches in the --hdr-bench color check
+#define HDR_PATCH_SIZE 16
+
+struct ColorPatch {
+    const char *name;
+
+    // Linear BT.709, SDR white at 1.0
+    double      r, g, b;
+};
+
+// Saturated ones come out saturated whatever the tone curve does to them,
+// as long as the primaries are right
+static const ColorPatch hdr_patches[] = {
+    { "red",     1.0, 0.0, 0.0 },
+    { "green",   0.0, 1.0, 0.0 },
+    { "blue",    0.0, 0.0, 1.0 },
+    { "yellow",  1.0, 1.0, 0.0 },
+    { "cyan",    0.0, 1.0, 1.0 },
+    { "magenta", 1.0, 0.0, 1.0 },
+    { "grey",    0.5, 0.5, 0.5 },
+};
+
 // Picked off the internets for quick testing
 void SaveBitmap(char *szFilename, HBITMAP hBitmap)
 {
@@ -83,368 +128,661 @@ void SaveBitmap(char *szFilename, HBITMAP hBitmap)
     if (fp)      fclose(fp);
 }
 
-static int read_packet(void *opaque, uint8_t *buf, int buf_size)
-{
-    IStream *istream = (IStream *)opaque;
+// Converts yer usual char string to MS Widechar
+// Returns a nullptr if fails, the buffer for widechar otherwise
+wchar_t* locale_to_wchar(char *input_string) {
+    const char *cs = input_string;
 
-    HRESULT hr         = E_UNEXPECTED;
-    ULONG   read_bytes = 0;
+    size_t wn = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, cs, -1, NULL, 0);
+    if (wn == size_t(-1)) {
+        return nullptr;
+    }
 
-    hr = istream->Read(buf, buf_size, &read_bytes);
-    if (FAILED(hr)) {
-        fprintf(stderr, "IStreamIO Read: Failed to read %d bytes\n", buf_size);
-        return -1;
+    wchar_t *buf = new wchar_t[wn + 1]();  // value-initialize to 0 (see below)
+    if (!buf) {
+        return nullptr;
+    }
+
+    wn = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, cs, -1, buf, wn + 1);
+    if (wn == size_t(-1)) {
+        return nullptr;
     }
 
-    fprintf(stderr, "IStreamIO Read: Succeeded at reading %lu bytes out of %d\n", read_bytes, buf_size);
-    return read_bytes;
+    return buf;
 }
 
-static int64_t seek(void *opaque, int64_t offset, int whence)
+// Allocation callback for the engine, the BMP writer wants an HBITMAP
+static int create_dib_section(void *opaque, int width, int height, uint8_t **data, int *linesize)
 {
-    IStream *istream = (IStream *)opaque;
+    HBITMAP *dst_bitmap = (HBITMAP *)opaque;
 
-    STATSTG stream_stats;
-    HRESULT hr       = E_UNEXPECTED;
-    DWORD   seekmode = STREAM_SEEK_CUR;
+    // Create a BITMAPINFO structure to create the bitmap with
+    BITMAPINFO bmi;
+    ZeroMemory(&bmi, sizeof(bmi));
 
-    // Seek positions
-    ULARGE_INTEGER pos_before_seek;
-    ULARGE_INTEGER pos_after_seek;
+    // Set the values to the header
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFO);
+    bmi.bmiHeader.biWidth  = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
 
-    LARGE_INTEGER zero;
-    zero.QuadPart = 0;
+    // Get the screen... whyyyyy
+    HDC hdc = GetDC(NULL);
 
-    // Because MS decided to use LARGE_INTEGER...
-    LARGE_INTEGER seek_offset;
-    seek_offset.QuadPart = offset;
+    // Create a Windows HBITMAP bitmap
+    *dst_bitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, (void **)data, NULL, 0);
 
-    // Grab current position
-    hr = istream->Seek(zero, STREAM_SEEK_CUR, &pos_before_seek);
-    if (FAILED(hr)) {
-        fprintf(stderr, "IStreamIO Seek: Failed to get current position :<\n");
-        return -1;
-    }
+    ReleaseDC(NULL, hdc);
 
-    switch (whence) {
-    // Try using the stat thingy to grab the stream's size
-    case AVSEEK_SIZE:
-        hr = istream->Stat(&stream_stats, STATFLAG_NONAME);
-        if (SUCCEEDED(hr)) {
-            fprintf(stderr, "IStreamIO Seek: Succeeded at getting the stream size (reported value %llu)\n", stream_stats.cbSize.QuadPart);
-            return stream_stats.cbSize.QuadPart;
-        } else {
-            fprintf(stderr, "IStreamIO Seek: Failed to get the stream size :<\n");
-            return -1;
-        }
-        break;
-    case SEEK_SET:
-        fprintf(stderr, "IStreamIO Seek: Seek mode set to SET\n");
-        seekmode = STREAM_SEEK_SET;
-        break;
-    case SEEK_CUR:
-        fprintf(stderr, "IStreamIO Seek: Seek mode set to CUR\n");
-        seekmode = STREAM_SEEK_CUR;
-        break;
-    case SEEK_END:
-        fprintf(stderr, "IStreamIO Seek: Seek mode set to END\n");
-        seekmode = STREAM_SEEK_END;
-        break;
-    default:
-        break;
-    }
-
-    // Try actually seeking
-    hr = istream->Seek(seek_offset, seekmode, &pos_after_seek);
-    if (FAILED(hr)) {
-        fprintf(stderr, "IStreamIO Seek: Actual seek failed :<\n");
-        return -1;
+    if (!*dst_bitmap || !*data) {
+        fprintf(stderr, "Failed to create the HBITMAP :<\n");
+        return AVERROR(ENOMEM);
     }
 
-    fprintf(stderr, "IStreamIO Seek: Succeeded at seeking %"PRId64" bytes (requested: %"PRId64" bytes)\n", (pos_after_seek.QuadPart - pos_before_seek.QuadPart), offset);
+    *linesize = width * 4;
 
-    // Return the difference in positions
-    return pos_after_seek.QuadPart - pos_before_seek.QuadPart;
+    return 0;
 }
 
-// Converts yer usual char string to MS Widechar
-// Returns a nullptr if fails, the buffer for widechar otherwise
-wchar_t* locale_to_wchar(char *input_string) {
-    const char *cs = input_string;
+// Picks the output format from the output file name's extension, BMP if we don't know it
+static ThumbnailFormat format_from_filename(const char *filename)
+{
+    static const ThumbnailFormat encoded_formats[] = {
+        THUMBNAIL_FORMAT_JPEG, THUMBNAIL_FORMAT_PNG, THUMBNAIL_FORMAT_WEBP
+    };
 
-    size_t wn = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, cs, -1, NULL, 0);
-    if (wn == size_t(-1)) {
-        return nullptr;
+    const char *extension = strrchr(filename, '.');
+    if (!extension) {
+        return THUMBNAIL_FORMAT_BGRA;
     }
+    extension++;
 
-    wchar_t *buf = new wchar_t[wn + 1]();  // value-initialize to 0 (see below)
-    if (!buf) {
-        return nullptr;
+    for (size_t i = 0; i < sizeof(encoded_formats) / sizeof(encoded_formats[0]); i++) {
+        if (!_stricmp(extension, thumbnail_format_extension(encoded_formats[i]))) {
+            return encoded_formats[i];
+        }
     }
 
-    wn = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, cs, -1, buf, wn + 1);
-    if (wn == size_t(-1)) {
-        return nullptr;
+    if (!_stricmp(extension, "jpeg")) {
+        return THUMBNAIL_FORMAT_JPEG;
     }
 
-    return buf;
+    return THUMBNAIL_FORMAT_BGRA;
 }
 
-#define CLI_TEST_BUFFER_SIZE 8192
+static void print_stats(const ThumbnailStats *stats)
+{
+    fprintf(stderr, "Stats: open %.2f ms, decode %.2f ms, scale %.2f ms, encode %.2f ms, total %.2f ms\n",
+            stats->open_us / 1000.0, stats->decode_us / 1000.0, stats->scale_us / 1000.0,
+            stats->encode_us / 1000.0, stats->total_us / 1000.0);
+}
 
-int main(int argc, char **argv)
+static int write_file(const char *filename, const uint8_t *data, int size)
 {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s input_file output_file max_width_or_height\n", argv[0]);
-        return 1;
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing :<\n", filename);
+        return -1;
     }
-    int size_limit = atoi(argv[3]);
 
-    HRESULT hr = E_FAIL;
+    size_t written = fwrite(data, 1, size, fp);
+    fclose(fp);
 
-    // Register all formats etc.
-    av_register_all();
+    return written == (size_t)size ? 0 : -1;
+}
 
-    // Create the lavf context
-    AVFormatContext *lavf_context = avformat_alloc_context();
-    if (!lavf_context) {
-        fprintf(stderr, "Failed to create lavf context :<\n");
-        return 1;
+static size_t process_commit(bool peak)
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    ZeroMemory(&counters, sizeof(counters));
+    counters.cb = sizeof(counters);
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
     }
 
-    fprintf(stderr, "Success: lavf context\n");
+    return peak ? counters.PeakPagefileUsage : counters.PagefileUsage;
+}
 
-    // We need a wchar version of the input file name for IStream
-    wchar_t *wide_input_file = locale_to_wchar(argv[1]);
-    if (!wide_input_file) {
-        fprintf(stderr, "Failed to convert %s to a wide string :<", argv[1]);
-        return 1;
+// Scales a synthetic 8K frame in stripes and checks that the memory needed on
+// top of the decoded frame goes with the output size and not the input size
+static int stripe_check(int size_limit)
+{
+    AVFrame *frame = av_frame_alloc();
+    uint8_t *bgra  = nullptr;
+    int ret = 1;
+
+    int dst_width  = size_limit;
+    int dst_height = (int)((int64_t)size_limit * STRIPE_CHECK_HEIGHT / STRIPE_CHECK_WIDTH);
+    if (dst_height < 1) {
+        dst_height = 1;
     }
 
-    fwprintf(stderr, L"Wide input file: %ls\n", wide_input_file);
+    uint8_t *dst_data[4]     = { nullptr };
+    int      dst_linesize[4] = { dst_width * 4 };
+    size_t   buffer_bytes    = 0;
+    size_t   base, peak, budget;
 
-    // Create an IStream that doesn't create files
-    IStream *istream = nullptr;
-    hr = SHCreateStreamOnFileEx(wide_input_file, STGM_FAILIFTHERE, FILE_ATTRIBUTE_NORMAL, FALSE, nullptr, &istream);
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to create the IStream :<\n");
-        return 1;
+    if (!frame) {
+        fprintf(stderr, "Failed to allocate the synthetic frame :<\n");
+        goto cleanup;
     }
 
-    fprintf(stderr, "Success: IStream created!\n");
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width  = STRIPE_CHECK_WIDTH;
+    frame->height = STRIPE_CHECK_HEIGHT;
 
-    // Create our buffer for custom lavf IO
-    uint8_t *lavf_iobuffer = (uint8_t *)av_malloc(CLI_TEST_BUFFER_SIZE);
-    if (!lavf_iobuffer) {
-        return E_OUTOFMEMORY;
+    bgra = (uint8_t *)av_malloc((size_t)dst_width * dst_height * 4);
+    if (!bgra || av_frame_get_buffer(frame, 32) < 0) {
+        fprintf(stderr, "Failed to allocate the synthetic frame :<\n");
+        goto cleanup;
     }
+    dst_data[0] = bgra;
 
-    // Create our custom IO context
-    lavf_context->pb = avio_alloc_context(lavf_iobuffer, CLI_TEST_BUFFER_SIZE, 0,
-                                          istream, read_packet, NULL, seek);
-    if (!lavf_context->pb) {
-        return E_OUTOFMEMORY;
+    // Gradients with a bit of texture, so that every page is actually touched
+    for (int plane = 0; plane < 3; plane++) {
+        int width  = plane ? (frame->width + 1) / 2 : frame->width;
+        int height = plane ? (frame->height + 1) / 2 : frame->height;
+
+        for (int y = 0; y < height; y++) {
+            uint8_t *line = frame->data[plane] + y * frame->linesize[plane];
+            for (int x = 0; x < width; x++) {
+                line[x] = (uint8_t)(plane ? 128 + (x - y) / 64 : (x + y) / 48 + ((x ^ y) & 15));
+            }
+        }
     }
 
-    // Try opening the input
-    int ret = avformat_open_input(&lavf_context, "fake_video_name", NULL, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to open input file :<\n");
-        return 1;
+    if (!stripe_scale_supported(frame, dst_width, dst_height)) {
+        fprintf(stderr, "A %dx%d output is too close to the input size for stripe scaling\n",
+                dst_width, dst_height);
+        goto cleanup;
     }
 
-    fprintf(stderr, "Success: lavf file opening\n");
+    // Everything allocated from here on is what scaling costs
+    base = process_commit(false);
 
-    // Try finding out what's inside the input
-    ret = avformat_find_stream_info(lavf_context, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to find out what's inside the file :<\n");
-        return 1;
+    if (stripe_scale(frame, dst_data, dst_linesize, dst_width, dst_height, AV_PIX_FMT_BGRA, &buffer_bytes) < 0) {
+        fprintf(stderr, "Failed to scale the synthetic frame :<\n");
+        goto cleanup;
     }
 
-    fprintf(stderr, "Success: lavf finding out what's inside\n");
+    peak = process_commit(true);
+    peak = peak > base ? peak - base : 0;
 
-    // Try looking for the "best" video stream in file
-    AVCodec *decoder = nullptr;
-    ret = av_find_best_stream(lavf_context, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to find the best video stream :<\n");
-        return 1;
+    // The swscale context and the stripes, for about twice the output size
+    budget = 8 * 1024 * 1024 + (size_t)dst_width * dst_height * 4 * 16;
+
+    fprintf(stderr, "Stripe check: %dx%d -> %dx%d, stripe buffers %u bytes, "
+            "peak extra memory %u KiB (budget %u KiB, the frame itself is %u KiB)\n",
+            frame->width, frame->height, dst_width, dst_height, (unsigned)buffer_bytes,
+            (unsigned)(peak / 1024), (unsigned)(budget / 1024),
+            (unsigned)(frame->linesize[0] * frame->height * 3 / 2 / 1024));
+
+    if (peak > budget) {
+        fprintf(stderr, "Scaling took more memory than the output size allows :<\n");
+        goto cleanup;
     }
 
-    // If no decoder was found, error out
-    if (!decoder) {
-        fprintf(stderr, "Failed to find a decoder for the best video stream :<\n");
-        return 1;
+    ret = 0;
+
+cleanup:
+    av_free(bgra);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+// ST 2084 inverse EOTF, nits -> 0..1
+static double nits_to_pq(double nits)
+{
+    const double m1 = 2610.0 / 16384.0;
+    const double m2 = 2523.0 / 4096.0 * 128.0;
+    const double c1 = 3424.0 / 4096.0;
+    const double c2 = 2413.0 / 4096.0 * 32.0;
+    const double c3 = 2392.0 / 4096.0 * 32.0;
+
+    double y = pow(nits / 10000.0, m1);
+
+    return pow((c1 + c2 * y) / (1.0 + c3 * y), m2);
+}
+
+// (max - min) / max of a BGRA pixel
+static double saturation(const uint8_t *pixel)
+{
+    int max = pixel[0] > pixel[1] ? pixel[0] : pixel[1];
+    int min = pixel[0] < pixel[1] ? pixel[0] : pixel[1];
+    max = pixel[2] > max ? pixel[2] : max;
+    min = pixel[2] < min ? pixel[2] : min;
+
+    return max ? (double)(max - min) / max : 0.0;
+}
+
+// Puts flat patches of known BT.709 colors at SDR white through both paths,
+// encoded as BT.2020 PQ the way an HDR master carries them. Wrong primaries
+// show up as saturated colors coming out washed out.
+static int hdr_color_check(void)
+{
+    // Linear BT.709 -> linear BT.2020 (ITU-R BT.2087)
+    static const double to_bt2020[3][3] = {
+        { 0.6274, 0.3293, 0.0433 },
+        { 0.0691, 0.9195, 0.0114 },
+        { 0.0164, 0.0880, 0.8956 },
+    };
+
+    const int count = sizeof(hdr_patches) / sizeof(hdr_patches[0]);
+
+    AVFrame    *frame   = av_frame_alloc();
+    SwsContext *context = nullptr;
+    uint8_t    *old_bgra = nullptr;
+    uint8_t    *hdr_bgra = nullptr;
+    int ret = -1;
+
+    double old_error = 0.0, hdr_error = 0.0;
+
+    if (!frame) {
+        goto cleanup;
     }
 
-    fprintf(stderr, "Success: lavf finds the best video stream and there is a decoder\n");
+    frame->format          = AV_PIX_FMT_YUV420P10;
+    frame->width           = count * HDR_PATCH_SIZE;
+    frame->height          = HDR_PATCH_SIZE;
+    frame->color_primaries = AVCOL_PRI_BT2020;
+    frame->color_trc       = AVCOL_TRC_SMPTEST2084;
+    frame->colorspace      = AVCOL_SPC_BT2020_NCL;
+    frame->color_range     = AVCOL_RANGE_MPEG;
+
+    old_bgra = (uint8_t *)av_malloc((size_t)frame->width * frame->height * 4);
+    hdr_bgra = (uint8_t *)av_malloc((size_t)frame->width * frame->height * 4);
+    if (!old_bgra || !hdr_bgra || av_frame_get_buffer(frame, 32) < 0) {
+        goto cleanup;
+    }
 
-    // Gather information on the found stream
-    int stream_index = ret;
-    AVStream *stream = lavf_context->streams[stream_index];
-    AVCodecContext *decoder_context = stream->codec;
+    for (int i = 0; i < count; i++) {
+        const double linear[3] = { hdr_patches[i].r, hdr_patches[i].g, hdr_patches[i].b };
+        double rgb[3];
 
-    // We want to try them refcounted frames!
-    AVDictionary *avdict = nullptr;
-    ret = av_dict_set(&avdict, "refcounted_frames", "1", 0);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to create an AVDict with the refcounted_frames set to 1\n");
-        return 1;
+        for (int c = 0; c < 3; c++) {
+            double v = to_bt2020[c][0] * linear[0] + to_bt2020[c][1] * linear[1] + to_bt2020[c][2] * linear[2];
+            rgb[c] = nits_to_pq(v * 100.0);
+        }
+
+        // BT.2020 non-constant luminance, studio range
+        double y  = 0.2627 * rgb[0] + 0.6780 * rgb[1] + 0.0593 * rgb[2];
+        double cb = (rgb[2] - y) / 1.8814;
+        double cr = (rgb[0] - y) / 1.4746;
+
+        const uint16_t values[3] = { (uint16_t)(64 + 876 * y + 0.5),
+                                     (uint16_t)(512 + 896 * cb + 0.5),
+                                     (uint16_t)(512 + 896 * cr + 0.5) };
+
+        for (int plane = 0; plane < 3; plane++) {
+            int size = plane ? HDR_PATCH_SIZE / 2 : HDR_PATCH_SIZE;
+
+            for (int row = 0; row < size; row++) {
+                uint16_t *line = (uint16_t *)(frame->data[plane] + row * frame->linesize[plane]);
+                for (int x = 0; x < size; x++) {
+                    line[i * size + x] = values[plane];
+                }
+            }
+        }
     }
 
-    fprintf(stderr, "Success: Refcounted frames turned on\n");
+    context = sws_getContext(frame->width, frame->height, AV_PIX_FMT_YUV420P10,
+                             frame->width, frame->height, AV_PIX_FMT_BGRA, SWS_BICUBIC,
+                             nullptr, nullptr, nullptr);
+    if (!context) {
+        goto cleanup;
+    }
 
-    // Open ze decoder!
-    ret = avcodec_open2(decoder_context, decoder, &avdict);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to open video decoder\n");
-        return 1;
+    {
+        uint8_t *dst_data[4]     = { old_bgra };
+        int      dst_linesize[4] = { frame->width * 4 };
+        sws_scale(context, frame->data, frame->linesize, 0, frame->height, dst_data, dst_linesize);
     }
+    hdr_convert_to_bgra(frame->data, frame->linesize, frame->width, frame->height, frame,
+                        hdr_bgra, frame->width * 4);
 
-    fprintf(stderr, "Success: Video decoder opened\n");
+    fprintf(stderr, "HDR color check: BT.709 colors at SDR white as BT.2020 PQ, R,G,B and saturation\n");
 
-    // Create an AVFrame
-    AVFrame *frame = nullptr;
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Failed to allocate AVFrame :<\n");
-        return 1;
+    for (int i = 0; i < count; i++) {
+        // The middle of the patch, away from the chroma upsampling at its edges
+        size_t offset = ((size_t)(HDR_PATCH_SIZE / 2) * frame->width + i * HDR_PATCH_SIZE + HDR_PATCH_SIZE / 2) * 4;
+        const uint8_t *old_pixel = old_bgra + offset;
+        const uint8_t *hdr_pixel = hdr_bgra + offset;
+
+        double expected = hdr_patches[i].r == hdr_patches[i].g && hdr_patches[i].g == hdr_patches[i].b ? 0.0 : 1.0;
+
+        fprintf(stderr, "  %-8s expected %.2f  swscale %3d,%3d,%3d %.2f  high bit depth path %3d,%3d,%3d %.2f\n",
+                hdr_patches[i].name, expected,
+                old_pixel[2], old_pixel[1], old_pixel[0], saturation(old_pixel),
+                hdr_pixel[2], hdr_pixel[1], hdr_pixel[0], saturation(hdr_pixel));
+
+        old_error += fabs(saturation(old_pixel) - expected);
+        hdr_error += fabs(saturation(hdr_pixel) - expected);
+    }
+
+    fprintf(stderr, "  mean saturation error: swscale %.3f, high bit depth path %.3f\n",
+            old_error / count, hdr_error / count);
+
+    ret = 0;
+
+cleanup:
+    sws_freeContext(context);
+    av_free(old_bgra);
+    av_free(hdr_bgra);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+// Times the old straight swscale yuv420p10 -> BGRA conversion against the high
+// bit depth path (downscale in 10-bit, then our own conversion and tone
+// mapping) on a synthetic 4K PQ frame. Contexts are made up front, as the
+// engine pools them, so only the per-picture work is timed. The colors of
+// both are checked afterwards with hdr_color_check().
+static int hdr_bench(int size_limit, int runs)
+{
+    AVFrame    *frame       = av_frame_alloc();
+    SwsContext *old_context = nullptr;
+    SwsContext *hdr_context = nullptr;
+    uint8_t    *bgra        = nullptr;
+    int ret = 1;
+
+    uint8_t *hdr_data[4]     = { nullptr };
+    int      hdr_linesize[4] = { 0 };
+
+    int dst_width  = size_limit;
+    int dst_height = (int)((int64_t)size_limit * HDR_BENCH_HEIGHT / HDR_BENCH_WIDTH);
+    if (dst_height < 1) {
+        dst_height = 1;
     }
 
-    // Create and init an AVPacket
-    AVPacket packet;
-    av_init_packet(&packet);
-    packet.data = nullptr;
-    packet.size = 0;
+    uint8_t *dst_data[4]     = { nullptr };
+    int      dst_linesize[4] = { dst_width * 4 };
+    bool     use_stripes     = false;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    double old_best = 0.0, old_total = 0.0;
+    double hdr_best = 0.0, hdr_total = 0.0;
+
+    if (!frame || runs < 1) {
+        fprintf(stderr, "Failed to allocate the synthetic frame :<\n");
+        goto cleanup;
+    }
 
-    fprintf(stderr, "Success: AVPacket created and initialized\n");
+    pipeline_global_init();
+
+    frame->format          = AV_PIX_FMT_YUV420P10;
+    frame->width           = HDR_BENCH_WIDTH;
+    frame->height          = HDR_BENCH_HEIGHT;
+    frame->color_primaries = AVCOL_PRI_BT2020;
+    frame->color_trc       = AVCOL_TRC_SMPTEST2084;
+    frame->colorspace      = AVCOL_SPC_BT2020_NCL;
+    frame->color_range     = AVCOL_RANGE_MPEG;
+
+    bgra = (uint8_t *)av_malloc((size_t)dst_width * dst_height * 4);
+    if (!bgra || av_frame_get_buffer(frame, 32) < 0 ||
+        av_image_alloc(hdr_data, hdr_linesize, dst_width, dst_height, AV_PIX_FMT_YUV420P10, 16) < 0) {
+        fprintf(stderr, "Failed to allocate the synthetic frame :<\n");
+        goto cleanup;
+    }
+    dst_data[0] = bgra;
 
-    // A marker for if we already have a decoded picture
-    int can_has_picture = 0;
+    // Studio range 10-bit gradients with a bit of texture
+    for (int plane = 0; plane < 3; plane++) {
+        int width  = plane ? (frame->width + 1) / 2 : frame->width;
+        int height = plane ? (frame->height + 1) / 2 : frame->height;
 
-    while (!can_has_picture) {
-        // Go grab a "frame" from the file!
-        ret = av_read_frame(lavf_context, &packet);
-        if (ret < 0) {
-            fprintf(stderr, "Failed to read a frame of data from the input :<\n");
-            return 1;
+        for (int y = 0; y < height; y++) {
+            uint16_t *line = (uint16_t *)(frame->data[plane] + y * frame->linesize[plane]);
+            for (int x = 0; x < width; x++) {
+                line[x] = (uint16_t)(plane ? 512 + (x - y) / 16 : 64 + (x + y) / 7 + ((x ^ y) & 31));
+            }
         }
+    }
+
+    old_context = sws_getContext(frame->width, frame->height, AV_PIX_FMT_YUV420P10,
+                                 dst_width, dst_height, AV_PIX_FMT_BGRA, SWS_BICUBIC,
+                                 nullptr, nullptr, nullptr);
+
+    // The same choice scale_frame makes in the engine
+    use_stripes = stripe_scale_supported(frame, dst_width, dst_height);
+    if (!use_stripes) {
+        hdr_context = sws_getContext(frame->width, frame->height, AV_PIX_FMT_YUV420P10,
+                                     dst_width, dst_height, AV_PIX_FMT_YUV420P10, SWS_BICUBIC,
+                                     nullptr, nullptr, nullptr);
+    }
+
+    if (!old_context || (!use_stripes && !hdr_context)) {
+        fprintf(stderr, "Failed to create the swscale contexts :<\n");
+        goto cleanup;
+    }
+
+    // One extra run first to get the pooled stripe scaler made and everything paged in
+    for (int run = -1; run < runs; run++) {
+        LARGE_INTEGER start, middle, end;
+
+        QueryPerformanceCounter(&start);
+
+        sws_scale(old_context, frame->data, frame->linesize, 0, frame->height, dst_data, dst_linesize);
 
-        fprintf(stderr, "Success: A frame of data has been read from the input\n");
+        QueryPerformanceCounter(&middle);
 
-        if (packet.stream_index == stream_index) {
-            // Video decoders always consume the whole packet, so we don't have to check for that
-            ret = avcodec_decode_video2(decoder_context, frame, &can_has_picture, &packet);
-            if (ret < 0) {
-                fprintf(stderr, "Failed to decode video :<\n");
-                return 1;
+        if (use_stripes) {
+            if (stripe_scale(frame, hdr_data, hdr_linesize, dst_width, dst_height,
+                             AV_PIX_FMT_YUV420P10, nullptr) < 0) {
+                fprintf(stderr, "Failed to scale the synthetic frame :<\n");
+                goto cleanup;
             }
+        } else {
+            sws_scale(hdr_context, frame->data, frame->linesize, 0, frame->height, hdr_data, hdr_linesize);
+        }
+        hdr_convert_to_bgra(hdr_data, hdr_linesize, dst_width, dst_height, frame, bgra, dst_linesize[0]);
+
+        QueryPerformanceCounter(&end);
 
-            fprintf(stderr, "Success: A frame of data has been decoded\n");
+        if (run < 0) {
+            continue;
         }
 
-        av_free_packet(&packet);
+        double old_ms = (middle.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        double hdr_ms = (end.QuadPart - middle.QuadPart) * 1000.0 / frequency.QuadPart;
+
+        old_best   = run && old_best < old_ms ? old_best : old_ms;
+        hdr_best   = run && hdr_best < hdr_ms ? hdr_best : hdr_ms;
+        old_total += old_ms;
+        hdr_total += hdr_ms;
+    }
+
+    fprintf(stderr, "HDR bench: %dx%d yuv420p10 PQ -> %dx%d BGRA, %d runs\n"
+            "  swscale to BGRA:     best %.2f ms, mean %.2f ms\n"
+            "  high bit depth path: best %.2f ms, mean %.2f ms (%s)\n"
+            "  speedup %.2fx\n",
+            frame->width, frame->height, dst_width, dst_height, runs,
+            old_best, old_total / runs, hdr_best, hdr_total / runs,
+            use_stripes ? "stripes" : "swscale", old_total / hdr_total);
+
+    if (hdr_color_check() < 0) {
+        fprintf(stderr, "Failed to run the color check :<\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    sws_freeContext(old_context);
+    sws_freeContext(hdr_context);
+    av_freep(&hdr_data[0]);
+    av_free(bgra);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && !strcmp(argv[1], "--stripe-check")) {
+        return stripe_check(atoi(argv[2]));
     }
 
-    fprintf(stderr, "Success: A whole picture has been decoded\n");
-    AVRational guessed_sar = av_guess_sample_aspect_ratio(lavf_context, stream, frame);
-    fprintf(stderr, "Stream SAR: %d:%d\n", frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den);
-    fprintf(stderr, "Guessed SAR: %d:%d\n", guessed_sar.num, guessed_sar.den);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "--hdr-bench")) {
+        return hdr_bench(atoi(argv[2]), argc == 4 ? atoi(argv[3]) : 20);
+    }
 
-    int dst_width = 0;
-    int dst_height = 0;
+    int         stream_prefix_mb = 0;
+    int         clip_segments    = 0;
+    const char *trace_path       = nullptr;
+    const char *io_log_path      = nullptr;
+    bool        keep_borders     = false;
+    bool        bad_args         = argc < 4;
+
+    ThumbnailPolicy policy       = THUMBNAIL_POLICY_FIRST;
+    int             policy_value = 0;
+
+    for (int i = 4; i < argc && !bad_args; i += 2) {
+        if (i + 1 >= argc) {
+            bad_args = true;
+        } else if (!strcmp(argv[i], "--stream")) {
+            stream_prefix_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--trace")) {
+            trace_path = argv[i + 1];
+        } else if (!strcmp(argv[i], "--clip")) {
+            clip_segments = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--record-io")) {
+            io_log_path = argv[i + 1];
+        } else if (!strcmp(argv[i], "--policy")) {
+            bad_args = !frame_policy_parse(argv[i + 1], &policy, &policy_value);
+        } else if (!strcmp(argv[i], "--borders")) {
+            keep_borders = !strcmp(argv[i + 1], "keep");
+            bad_args     = !keep_borders && strcmp(argv[i + 1], "crop");
+        } else {
+            bad_args = true;
+        }
+    }
 
-    if (guessed_sar.num > guessed_sar.den) {
-        dst_width = (frame->width * guessed_sar.num) / guessed_sar.den;
-        dst_height = frame->height;
+    if (bad_args) {
+        fprintf(stderr, "Usage: %s input_file output_file(.bmp|.jpg|.png|.webp) max_width_or_height"
+                " [--stream max_prefix_mb] [--clip segments] [--trace trace.json] [--record-io io_log]\n"
+                "       [--policy first|percent:N|chapter:N|tag|auto] [--borders crop|keep]\n"
+                "       %s --stripe-check max_width_or_height\n"
+                "       %s --hdr-bench max_width_or_height [runs]\n", argv[0], argv[0], argv[0]);
+        return 1;
     }
-    else {
-        dst_height = (frame->height * guessed_sar.den) / guessed_sar.num;
-        dst_width = frame->width;
+
+    if (trace_path && trace_start() < 0) {
+        return 1;
     }
+    int size_limit = atoi(argv[3]);
 
-    fprintf(stderr, "DSTWidth: %d , DSTHeight: %d\n", dst_width, dst_height);
+    HRESULT hr = E_FAIL;
 
-    // Fit the thing into size_limit
-    if (dst_width > dst_height) {
-        double ratio = (double)dst_height / (double)dst_width;
-        dst_width = size_limit;
-        dst_height = (int)((ratio * (double)size_limit) + 0.5);
+    // We need a wchar version of the input file name for IStream
+    wchar_t *wide_input_file = locale_to_wchar(argv[1]);
+    if (!wide_input_file) {
+        fprintf(stderr, "Failed to convert %s to a wide string :<", argv[1]);
+        return 1;
     }
-    else {
-        double ratio = (double)dst_width / (double)dst_height;
-        dst_height = size_limit;
-        dst_width = (int)((ratio * (double)size_limit) + 0.5);
+
+    fwprintf(stderr, L"Wide input file: %ls\n", wide_input_file);
+
+    // Create an IStream that doesn't create files
+    IStream *istream = nullptr;
+    hr = SHCreateStreamOnFileEx(wide_input_file, STGM_FAILIFTHERE, FILE_ATTRIBUTE_NORMAL, FALSE, nullptr, &istream);
+    delete[] wide_input_file;
+    if (FAILED(hr)) {
+        fprintf(stderr, "Failed to create the IStream :<\n");
+        return 1;
     }
 
-    fprintf(stderr, "DSTWidth: %d , DSTHeight: %d (post-fitting)\n", dst_width, dst_height);
+    fprintf(stderr, "Success: IStream created!\n");
+
+    HBITMAP dst_bitmap = nullptr;
 
-    uint8_t *dst_data[4] = { nullptr };
-    int      dst_linesize[4] = { 0 };
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
 
-    // The linesize is padded to the next 4 byte alignment
-    // But we have four values next to each other so we
-    // don't care
-    dst_linesize[0] = dst_width * 4;
+    request.input.opaque      = istream;
+    request.input.read_packet = istream_read_packet;
+    request.input.seek        = istream_seek;
+    request.size_limit        = size_limit;
+    request.format            = format_from_filename(argv[2]);
+    request.alloc_bgra        = create_dib_section;
+    request.alloc_opaque      = &dst_bitmap;
 
-    fprintf(stderr, "Linesize: %d\n", dst_linesize[0]);
+    if (stream_prefix_mb > 0) {
+        request.streaming        = 1;
+        request.max_prefix_bytes = (int64_t)stream_prefix_mb * 1024 * 1024;
+    }
 
-    // Create a BITMAPINFO structure to create the bitmap with
-    BITMAPINFO bmi;
-    ZeroMemory(&bmi, sizeof(bmi));
+    // Animated preview, the output has to be .png or .webp
+    request.clip_segments = clip_segments;
 
-    // Set the values to the header
-    bmi.bmiHeader.biSize = sizeof(BITMAPINFO);
-    bmi.bmiHeader.biWidth  = dst_width;
-    bmi.bmiHeader.biHeight = -dst_height;
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 32;
-    bmi.bmiHeader.biCompression = BI_RGB;
-    bmi.bmiHeader.biSizeImage = 0;
-    bmi.bmiHeader.biXPelsPerMeter = 0;
-    bmi.bmiHeader.biYPelsPerMeter = 0;
-    bmi.bmiHeader.biClrUsed = 0;
-    bmi.bmiHeader.biClrImportant = 0;
+    request.policy       = policy;
+    request.policy_value = policy_value;
+    request.keep_borders = keep_borders;
 
-    // Get the screen... whyyyyy
-    HDC hdc = GetDC(NULL);
+    // Every read and seek on the IStream, for io_replay
+    IoRecorder recorder;
+    if (io_log_path) {
+        io_recorder_init(&recorder, &request.input);
+        io_recorder_input(&recorder, &request.input);
+    }
 
-    // Create a Windows HBITMAP bitmap
-    HBITMAP dst_bitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, (void **)dst_data, NULL, 0);
-    if (!dst_bitmap || !dst_data) {
-        fprintf(stderr, "Failed to create the HBITMAP :<\n");
+    ThumbnailResult result;
+    int ret = thumbnail_generate(&request, &result);
+
+    // Failed runs are the interesting ones, so write it out either way
+    if (trace_path && !trace_write(trace_path)) {
+        fprintf(stderr, "Trace written to %s\n", trace_path);
+    }
+
+    if (io_log_path && !io_log_write(recorder.ops, io_log_path)) {
+        fprintf(stderr, "Recorded %u I/O calls to %s\n", (unsigned)recorder.ops.size(), io_log_path);
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create the thumbnail :<\n");
+        istream->Release();
         return 1;
     }
 
-    if ((long)dst_bitmap == ERROR_INVALID_PARAMETER) {
-        fprintf(stderr, "Invalid parameters with the DIBSection, ho!\n");
+    fprintf(stderr, "Success: %dx%d thumbnail created\n", result.width, result.height);
+
+    if (result.target_us != AV_NOPTS_VALUE) {
+        fprintf(stderr, "Policy: %s picked %.3f s\n", frame_policy_name(result.policy_used),
+                result.target_us / 1000000.0);
     }
 
-    fprintf(stderr, "Success: The output RGB picture has been allocated\n");
+    if (result.crop_left || result.crop_top || result.crop_right || result.crop_bottom) {
+        fprintf(stderr, "Borders: cut %d left, %d top, %d right, %d bottom\n",
+                result.crop_left, result.crop_top, result.crop_right, result.crop_bottom);
+    }
 
-    SwsContext *swscale_context = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format,
-                                                 dst_width, dst_height, AV_PIX_FMT_BGRA,
-                                                 SWS_BICUBIC, NULL, NULL, NULL);
-    if (!swscale_context) {
-        fprintf(stderr, "Failed to create the swscale context for the YCbCr->RGB conversion\n");
-        return 1;
+    if (result.clip_frames) {
+        fprintf(stderr, "Preview: %d frames\n", result.clip_frames);
     }
 
-    // Convert!
-    ret = sws_scale(swscale_context, frame->data, frame->linesize, 0,
-                    frame->height, dst_data, dst_linesize);
-    if (ret != dst_height) {
-        fprintf(stderr, "Failed to gain as much height as with the input when scaling\n");
-        return 1;
+    if (result.streamed) {
+        fprintf(stderr, "Streamed: picked the best of %d keyframes in the first %lld bytes\n",
+                result.keyframes_seen, (long long)result.bytes_read);
     }
 
-    fprintf(stderr, "Success: Picture has been scaled\n");
+    if (request.format == THUMBNAIL_FORMAT_BGRA) {
+        SaveBitmap(argv[2], dst_bitmap);
+        DeleteObject(dst_bitmap);
+    } else {
+        ret = write_file(argv[2], result.data, result.size);
+        fprintf(stderr, "Encoded size: %d bytes\n", result.size);
+        av_free(result.data);
+    }
 
-    SaveBitmap(argv[2], dst_bitmap);
+    print_stats(&result.stats);
 
-    // We don't need the stinking screen
-    ReleaseDC(NULL, hdc);
+    istream->Release();
 
-    return 0;
+    return ret < 0 ? 1 : 0;
 }
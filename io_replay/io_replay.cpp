@@ -0,0 +1,250 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+#include "../src/file_reader.h"
+}
+
+#include "../src/io_recorder.h"
+#include "../src/storage_sim.h"
+#include "../src/thumbnail_engine.h"
+
+// Recording, running against a storage model and replaying recorded
+// I/O against one, so slow shares can be looked into on a local disk
+
+struct ReplayOptions {
+    StorageModel     model;
+    int              size_limit;
+    ThumbnailFormat  format;
+    int              io_buffer_size;
+    int64_t          stream_prefix;
+};
+
+static ReplayOptions options;
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] record input_file io_log\n"
+            "       %s [options] run input_file\n"
+            "       %s [options] replay io_log\n"
+            "\n"
+            "record runs the pipeline on a local file and writes every read and seek to io_log.\n"
+            "run does the same through the storage model, replay puts a recorded log through it.\n"
+            "\n"
+            "Storage model:\n"
+            "  --seek-ms X        extra for every request that isn't sequential (5)\n"
+            "  --request-ms X     for every request (0.5)\n"
+            "  --bandwidth X      MiB/s, 0 for unlimited (100)\n"
+            "  --block KiB        requests are rounded out to this, 0 for exact sizes (64)\n"
+            "  --cache N          recently fetched blocks kept by the client (16)\n"
+            "  --sleep 0|1        really wait out the time with run\n"
+            "Pipeline:\n"
+            "  --size N           longer side of the thumbnail (256)\n"
+            "  --format jpg|png|webp\n"
+            "  --io-buffer KiB    size of lavf's reads (8)\n"
+            "  --stream MB        forward-only mode reading at most this much\n",
+            name, name, name);
+}
+
+static void print_storage_stats(const StorageStats *stats)
+{
+    fprintf(stderr, "Storage: %lld reads of %.1f KiB in total, %lld requests (%lld seeks) fetching %.1f KiB,"
+            " %.2f ms simulated\n",
+            (long long)stats->reads, stats->bytes_read / 1024.0,
+            (long long)stats->requests, (long long)stats->seeks, stats->bytes_fetched / 1024.0,
+            stats->simulated_us / 1000.0);
+}
+
+static int run_pipeline(const ThumbnailInput *input)
+{
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
+
+    request.input          = *input;
+    request.size_limit     = options.size_limit;
+    request.format         = options.format;
+    request.io_buffer_size = options.io_buffer_size;
+
+    if (options.stream_prefix > 0) {
+        request.streaming        = 1;
+        request.max_prefix_bytes = options.stream_prefix;
+    }
+
+    ThumbnailResult result;
+    int ret = thumbnail_generate(&request, &result);
+    if (ret < 0) {
+        char message[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+        av_strerror(ret, message, sizeof(message));
+        fprintf(stderr, "Failed to create the thumbnail: %s\n", message);
+        return ret;
+    }
+
+    fprintf(stderr, "Thumbnail: %dx%d, %d bytes, %.2f ms in the engine\n",
+            result.width, result.height, result.size, result.stats.total_us / 1000.0);
+
+    av_free(result.data);
+
+    return 0;
+}
+
+static int record(const char *input_path, const char *log_path)
+{
+    FileReader *file = file_reader_open(input_path);
+    if (!file) {
+        fprintf(stderr, "Failed to open %s :<\n", input_path);
+        return 1;
+    }
+
+    ThumbnailInput file_input;
+    memset(&file_input, 0, sizeof(file_input));
+    file_input.opaque      = file;
+    file_input.read_packet = file_read_packet;
+    file_input.seek        = file_seek;
+
+    IoRecorder recorder;
+    io_recorder_init(&recorder, &file_input);
+
+    ThumbnailInput input;
+    io_recorder_input(&recorder, &input);
+
+    int ret = run_pipeline(&input);
+    file_reader_close(file);
+
+    if (io_log_write(recorder.ops, log_path) < 0) {
+        return 1;
+    }
+
+    fprintf(stderr, "Recorded %u calls to %s\n", (unsigned)recorder.ops.size(), log_path);
+
+    return ret < 0 ? 1 : 0;
+}
+
+static int run(const char *input_path)
+{
+    FileReader *file = file_reader_open(input_path);
+    if (!file) {
+        fprintf(stderr, "Failed to open %s :<\n", input_path);
+        return 1;
+    }
+
+    ThumbnailInput file_input;
+    memset(&file_input, 0, sizeof(file_input));
+    file_input.opaque      = file;
+    file_input.read_packet = file_read_packet;
+    file_input.seek        = file_seek;
+
+    StorageSim sim;
+    storage_sim_init(&sim, &options.model, &file_input);
+
+    ThumbnailInput input;
+    storage_sim_input(&sim, &input);
+
+    int ret = run_pipeline(&input);
+    file_reader_close(file);
+
+    print_storage_stats(&sim.stats);
+
+    return ret < 0 ? 1 : 0;
+}
+
+static int replay(const char *log_path)
+{
+    std::vector<IoOp> ops;
+    if (io_log_read(log_path, &ops) < 0) {
+        return 1;
+    }
+
+    ThumbnailInput no_input;
+    memset(&no_input, 0, sizeof(no_input));
+
+    // Only what was actually read costs anything, seeks just move on and
+    // prefetch hints aren't part of the model
+    StorageSim sim;
+    storage_sim_init(&sim, &options.model, &no_input);
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i].type == 'R' && ops[i].result > 0) {
+            storage_sim_access(&sim, ops[i].offset, ops[i].result);
+        }
+    }
+
+    print_storage_stats(&sim.stats);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    storage_model_init(&options.model);
+    options.size_limit     = 256;
+    options.format         = THUMBNAIL_FORMAT_JPEG;
+    options.io_buffer_size = 0;
+    options.stream_prefix  = 0;
+
+    int i = 1;
+    for (; i < argc && !strncmp(argv[i], "--", 2); i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        const char *value = argv[i + 1];
+
+        if (!strcmp(argv[i], "--seek-ms")) {
+            options.model.seek_ms = atof(value);
+        } else if (!strcmp(argv[i], "--request-ms")) {
+            options.model.request_ms = atof(value);
+        } else if (!strcmp(argv[i], "--bandwidth")) {
+            options.model.bandwidth_mib_s = atof(value);
+        } else if (!strcmp(argv[i], "--block")) {
+            options.model.block_size = atoi(value) * 1024;
+        } else if (!strcmp(argv[i], "--cache")) {
+            options.model.cache_blocks = atoi(value);
+        } else if (!strcmp(argv[i], "--sleep")) {
+            options.model.sleep = atoi(value) != 0;
+        } else if (!strcmp(argv[i], "--size")) {
+            options.size_limit = atoi(value);
+        } else if (!strcmp(argv[i], "--format")) {
+            if (!strcmp(value, "jpg")) {
+                options.format = THUMBNAIL_FORMAT_JPEG;
+            } else if (!strcmp(value, "png")) {
+                options.format = THUMBNAIL_FORMAT_PNG;
+            } else if (!strcmp(value, "webp")) {
+                options.format = THUMBNAIL_FORMAT_WEBP;
+            } else {
+                fprintf(stderr, "Unknown format %s\n", value);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--io-buffer")) {
+            options.io_buffer_size = atoi(value) * 1024;
+        } else if (!strcmp(argv[i], "--stream")) {
+            options.stream_prefix = (int64_t)atoi(value) * 1024 * 1024;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (argc - i == 3 && !strcmp(argv[i], "record")) {
+        return record(argv[i + 1], argv[i + 2]);
+    } else if (argc - i == 2 && !strcmp(argv[i], "run")) {
+        return run(argv[i + 1]);
+    } else if (argc - i == 2 && !strcmp(argv[i], "replay")) {
+        return replay(argv[i + 1]);
+    }
+
+    print_usage(argv[0]);
+
+    return 1;
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "block_cache.h"
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#define BLOCK_CACHE_DEFAULT_LIMIT (32 * 1024 * 1024)
+
+struct BlockKey {
+    uint64_t device;
+    uint64_t inode;
+    int64_t  size;
+    int64_t  mtime;
+    int64_t  index;
+
+    bool operator<(const BlockKey &other) const
+    {
+        if (device != other.device) return device < other.device;
+        if (inode  != other.inode)  return inode  < other.inode;
+        if (size   != other.size)   return size   < other.size;
+        if (mtime  != other.mtime)  return mtime  < other.mtime;
+        return index < other.index;
+    }
+};
+
+typedef std::list<BlockKey> BlockList;
+
+struct Block {
+    // Only touched by the loading reader until loading is cleared, read-only after
+    std::string          data;
+    bool                 loading;
+
+    // Where it is in block_lru once loaded
+    BlockList::iterator  lru;
+};
+
+typedef std::shared_ptr<Block> BlockPtr;
+
+// Blocks being loaded are in the map but not in the LRU list, so they can't
+// be evicted from under the reader loading them. Evicted blocks stay alive
+// for as long as a reader is still copying out of them.
+static std::mutex                   cache_lock;
+static std::condition_variable      load_cond;
+static std::map<BlockKey, BlockPtr> cache_blocks;
+static BlockList                    block_lru;
+static size_t                       cache_bytes;
+static size_t                       cache_limit = BLOCK_CACHE_DEFAULT_LIMIT;
+static BlockCacheStats              cache_stats;
+
+// Must be called with cache_lock held
+static void evict_to_limit(void)
+{
+    while (cache_bytes > cache_limit && !block_lru.empty()) {
+        std::map<BlockKey, BlockPtr>::iterator it = cache_blocks.find(block_lru.back());
+        cache_bytes -= it->second->data.size();
+        cache_blocks.erase(it);
+        block_lru.pop_back();
+    }
+}
+
+void block_cache_set_limit(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(cache_lock);
+    cache_limit = max_bytes;
+    evict_to_limit();
+}
+
+void block_cache_get_stats(BlockCacheStats *stats)
+{
+    std::lock_guard<std::mutex> lock(cache_lock);
+    *stats = cache_stats;
+    stats->entries = block_lru.size();
+    stats->bytes   = cache_bytes;
+}
+
+// Reads a whole block (or what's left of the file) from the inner input
+static int load_block(BlockCacheReader *reader, int64_t index, std::string *data)
+{
+    int64_t offset = index * BLOCK_CACHE_BLOCK_SIZE;
+    int64_t size   = reader->identity.size - offset;
+    if (size > BLOCK_CACHE_BLOCK_SIZE) {
+        size = BLOCK_CACHE_BLOCK_SIZE;
+    }
+
+    try {
+        data->resize((size_t)size);
+    } catch (const std::bad_alloc &) {
+        return AVERROR(ENOMEM);
+    }
+
+    if (reader->inner_pos != offset) {
+        int64_t ret = reader->inner.seek(reader->inner.opaque, offset, SEEK_SET);
+        if (ret < 0) {
+            reader->inner_pos = -1;
+            return (int)ret;
+        }
+        reader->inner_pos = offset;
+    }
+
+    int64_t filled = 0;
+    while (filled < size) {
+        int ret = reader->inner.read_packet(reader->inner.opaque, (uint8_t *)&(*data)[(size_t)filled],
+                                            (int)(size - filled));
+        if (ret == AVERROR_EOF || ret == 0) {
+            // The file got shorter since it was opened, keep what there is
+            break;
+        }
+        if (ret < 0) {
+            reader->inner_pos = -1;
+            return ret;
+        }
+
+        filled            += ret;
+        reader->inner_pos += ret;
+    }
+
+    data->resize((size_t)filled);
+
+    return 0;
+}
+
+// Finds the block in the cache, waits for it if another reader is loading
+// it or loads it if nobody is
+static int get_block(BlockCacheReader *reader, int64_t index, BlockPtr *block)
+{
+    BlockKey key;
+    key.device = reader->identity.device;
+    key.inode  = reader->identity.inode;
+    key.size   = reader->identity.size;
+    key.mtime  = reader->identity.mtime;
+    key.index  = index;
+
+    std::unique_lock<std::mutex> lock(cache_lock);
+    cache_stats.lookups++;
+
+    for (;;) {
+        std::map<BlockKey, BlockPtr>::iterator it = cache_blocks.find(key);
+        if (it == cache_blocks.end()) {
+            break;
+        }
+
+        BlockPtr found = it->second;
+        if (!found->loading) {
+            block_lru.splice(block_lru.begin(), block_lru, found->lru);
+            cache_stats.hits++;
+            *block = found;
+            return 0;
+        }
+
+        // Once it's done it's either there or gone, in which case we try ourselves
+        cache_stats.waits++;
+        while (found->loading) {
+            load_cond.wait(lock);
+        }
+    }
+
+    BlockPtr loading;
+    try {
+        loading = std::make_shared<Block>();
+        loading->loading = true;
+        cache_blocks[key] = loading;
+    } catch (const std::bad_alloc &) {
+        return AVERROR(ENOMEM);
+    }
+
+    lock.unlock();
+    int ret = load_block(reader, index, &loading->data);
+    lock.lock();
+
+    loading->loading = false;
+    load_cond.notify_all();
+
+    if (ret < 0) {
+        cache_blocks.erase(key);
+        return ret;
+    }
+
+    try {
+        block_lru.push_front(key);
+    } catch (const std::bad_alloc &) {
+        // Still good for this read, just not kept
+        cache_blocks.erase(key);
+        *block = loading;
+        return 0;
+    }
+
+    loading->lru = block_lru.begin();
+    cache_bytes += loading->data.size();
+    cache_stats.loads++;
+    cache_stats.load_bytes += loading->data.size();
+    evict_to_limit();
+
+    *block = loading;
+
+    return 0;
+}
+
+static int block_cache_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    BlockCacheReader *reader = (BlockCacheReader *)opaque;
+
+    if (reader->pos >= reader->identity.size) {
+        return AVERROR_EOF;
+    }
+
+    int64_t index  = reader->pos / BLOCK_CACHE_BLOCK_SIZE;
+    int64_t offset = reader->pos % BLOCK_CACHE_BLOCK_SIZE;
+
+    BlockPtr block;
+    int ret = get_block(reader, index, &block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Short reads are fine with lavf, the next one goes on from the next block
+    int64_t available = (int64_t)block->data.size() - offset;
+    if (available <= 0) {
+        return AVERROR_EOF;
+    }
+
+    if (buf_size > available) {
+        buf_size = (int)available;
+    }
+
+    memcpy(buf, block->data.data() + offset, buf_size);
+    reader->pos += buf_size;
+
+    return buf_size;
+}
+
+// Nothing is read here, the inner input only moves when a block gets loaded
+static int64_t block_cache_seek(void *opaque, int64_t offset, int whence)
+{
+    BlockCacheReader *reader = (BlockCacheReader *)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return reader->identity.size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += reader->pos;
+        break;
+    case SEEK_END:
+        offset += reader->identity.size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    reader->pos = offset;
+
+    return offset;
+}
+
+static void block_cache_prefetch(void *opaque, int64_t offset, int64_t size)
+{
+    BlockCacheReader *reader = (BlockCacheReader *)opaque;
+
+    reader->inner.prefetch(reader->inner.opaque, offset, size);
+}
+
+void block_cache_reader_init(BlockCacheReader *reader, const ThumbnailInput *inner,
+                             const FileIdentity *identity)
+{
+    reader->inner     = *inner;
+    reader->identity  = *identity;
+    reader->pos       = 0;
+    reader->inner_pos = -1;
+}
+
+void block_cache_reader_input(BlockCacheReader *reader, ThumbnailInput *input)
+{
+    input->opaque      = reader;
+    input->read_packet = block_cache_read_packet;
+    input->seek        = block_cache_seek;
+    input->prefetch    = reader->inner.prefetch ? block_cache_prefetch : nullptr;
+}
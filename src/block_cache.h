@@ -0,0 +1,57 @@
+#ifndef MT_BLOCK_CACHE_H
+#define MT_BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern "C" {
+#include "file_reader.h"
+}
+
+#include "thumbnail_engine.h"
+
+// Blocks are this big and start at multiples of it
+#define BLOCK_CACHE_BLOCK_SIZE (64 * 1024)
+
+// Sits between the engine and the real input callbacks and serves reads out
+// of a process-wide cache of file blocks, keyed by the file's identity and
+// the block's offset. Requests for the same file running at the same time
+// read the header, SeekHead and Cues once between them: a block that's being
+// loaded by one reader is waited for by the others instead of being read
+// again. Least recently used blocks are dropped once the cache goes over its
+// limit.
+//
+// A reader must only be used by one thread at a time, like the input under it.
+struct BlockCacheReader {
+    ThumbnailInput  inner;
+    FileIdentity    identity;
+
+    // Where the next read starts, and where the inner input is (-1 if not known)
+    int64_t         pos;
+    int64_t         inner_pos;
+};
+
+struct BlockCacheStats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t waits;      // lookups that waited for another reader's load
+    uint64_t loads;
+    uint64_t load_bytes;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+// The identity has to be the inner input's, the size in it is taken as the file's size
+void block_cache_reader_init(BlockCacheReader *reader, const ThumbnailInput *inner,
+                             const FileIdentity *identity);
+
+// Fills in an input whose calls go through the cache to the inner one. The
+// inner input has to be seekable.
+void block_cache_reader_input(BlockCacheReader *reader, ThumbnailInput *input);
+
+// Thread-safe, like everything below
+void block_cache_set_limit(size_t max_bytes);
+
+void block_cache_get_stats(BlockCacheStats *stats);
+
+#endif /* MT_BLOCK_CACHE_H */
@@ -0,0 +1,281 @@
+#include <string.h>
+
+#include <vector>
+
+#include "border_detect.h"
+
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS 1
+#endif
+
+// How far above black (in 8-bit steps) a line can go and still count as
+// black, compression noise in the bars gets there easily
+#define BORDER_BLACK_MARGIN 24
+
+// No side gets cut by more than width or height / this. A 2.39:1 film in a
+// 4:3 frame still fits, anything more is more likely a dark scene.
+#define BORDER_MAX_FRACTION 4
+
+// Columns are checked on every this many rows
+#define BORDER_COLUMN_ROW_STEP 4
+
+// Only 8-bit lines go through SSE2, the rest is done here. Goes on from
+// start with the max found so far.
+static int line_max_c(const uint8_t *line, int start, int width, int bytes, int max)
+{
+    for (int x = start; x < width; x++) {
+        int value = bytes == 2 ? ((const uint16_t *)line)[x] : line[x];
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    return max;
+}
+
+static void columns_max_c(const uint8_t *line, int start, int width, int bytes, uint16_t *col_max)
+{
+    for (int x = start; x < width; x++) {
+        int value = bytes == 2 ? ((const uint16_t *)line)[x] : line[x];
+        if (value > col_max[x]) {
+            col_max[x] = (uint16_t)value;
+        }
+    }
+}
+
+#if HAVE_SSE2_INTRINSICS
+// Sixteen samples at a time. Returns the first sample that wasn't looked at.
+static int line_max_sse2(const uint8_t *line, int width, int *max)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        acc = _mm_max_epu8(acc, _mm_loadu_si128((const __m128i *)(line + x)));
+    }
+
+    // Fold the lanes down to one
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 1));
+
+    *max = _mm_cvtsi128_si32(acc) & 0xff;
+
+    return x;
+}
+
+// Keeps the running per-column max in bytes while it's 8-bit, widened at the end
+static int columns_max_sse2(const uint8_t *line, int width, uint8_t *col_max)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i acc = _mm_loadu_si128((const __m128i *)(col_max + x));
+        acc = _mm_max_epu8(acc, _mm_loadu_si128((const __m128i *)(line + x)));
+        _mm_storeu_si128((__m128i *)(col_max + x), acc);
+    }
+
+    return x;
+}
+#endif
+
+struct LumaPlane {
+    const uint8_t *data;
+    int            linesize;
+    int            width;
+    int            height;
+    int            bytes;
+    bool           use_sse2;
+};
+
+static int row_max(const LumaPlane *plane, int y)
+{
+    const uint8_t *line = plane->data + (ptrdiff_t)y * plane->linesize;
+
+    int max  = 0;
+    int done = 0;
+#if HAVE_SSE2_INTRINSICS
+    if (plane->use_sse2) {
+        done = line_max_sse2(line, plane->width, &max);
+    }
+#endif
+
+    return line_max_c(line, done, plane->width, plane->bytes, max);
+}
+
+// Per-column max over every few rows between top and bottom
+static void column_max(const LumaPlane *plane, int top, int bottom, std::vector<uint16_t> *col_max)
+{
+    col_max->assign(plane->width, 0);
+
+#if HAVE_SSE2_INTRINSICS
+    if (plane->use_sse2) {
+        std::vector<uint8_t> col_max8(plane->width, 0);
+
+        for (int y = top; y < bottom; y += BORDER_COLUMN_ROW_STEP) {
+            const uint8_t *line = plane->data + (ptrdiff_t)y * plane->linesize;
+
+            int done = columns_max_sse2(line, plane->width, &col_max8[0]);
+            for (int x = done; x < plane->width; x++) {
+                if (line[x] > col_max8[x]) {
+                    col_max8[x] = line[x];
+                }
+            }
+        }
+
+        col_max->assign(col_max8.begin(), col_max8.end());
+        return;
+    }
+#endif
+
+    for (int y = top; y < bottom; y += BORDER_COLUMN_ROW_STEP) {
+        columns_max_c(plane->data + (ptrdiff_t)y * plane->linesize, 0, plane->width, plane->bytes,
+                      &(*col_max)[0]);
+    }
+}
+
+static bool get_luma_plane(const AVFrame *frame, LumaPlane *plane)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL |
+                        AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].plane != 0 || desc->comp[0].depth_minus1 >= 16) {
+        return false;
+    }
+
+    plane->data     = frame->data[0];
+    plane->linesize = frame->linesize[0];
+    plane->width    = frame->width;
+    plane->height   = frame->height;
+    plane->bytes    = desc->comp[0].depth_minus1 >= 8 ? 2 : 1;
+    plane->use_sse2 = false;
+
+#if HAVE_SSE2_INTRINSICS
+    plane->use_sse2 = plane->bytes == 1 && (av_get_cpu_flags() & AV_CPU_FLAG_SSE2);
+#endif
+
+    return plane->data && plane->width > 0 && plane->height > 0;
+}
+
+bool border_detect(const AVFrame *frame, BorderCrop *crop)
+{
+    memset(crop, 0, sizeof(*crop));
+
+    LumaPlane plane;
+    if (!get_luma_plane(frame, &plane)) {
+        return false;
+    }
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    int shift = desc->comp[0].depth_minus1 + 1 - 8;
+
+    // Full range black is 0, studio range 16
+    int black     = frame->color_range == AVCOL_RANGE_JPEG ? 0 : 16;
+    int threshold = (black + BORDER_BLACK_MARGIN) << shift;
+
+    int max_rows = plane.height / BORDER_MAX_FRACTION;
+    int max_cols = plane.width / BORDER_MAX_FRACTION;
+
+    int top = 0;
+    while (top < max_rows && row_max(&plane, top) <= threshold) {
+        top++;
+    }
+
+    int bottom = 0;
+    while (bottom < max_rows && row_max(&plane, plane.height - 1 - bottom) <= threshold) {
+        bottom++;
+    }
+
+    // Black all the way in, a fade or a night scene rather than bars
+    if (top >= max_rows || bottom >= max_rows) {
+        return false;
+    }
+
+    std::vector<uint16_t> col_max;
+    column_max(&plane, top, plane.height - bottom, &col_max);
+
+    int left = 0;
+    while (left < max_cols && col_max[left] <= threshold) {
+        left++;
+    }
+
+    int right = 0;
+    while (right < max_cols && col_max[plane.width - 1 - right] <= threshold) {
+        right++;
+    }
+
+    if (left >= max_cols || right >= max_cols) {
+        return false;
+    }
+
+    // Burnt-in subtitles in the lower bar or a dark sky above the picture
+    // only leave the smaller side as surely black
+    crop->top  = crop->bottom = top < bottom ? top : bottom;
+    crop->left = crop->right  = left < right ? left : right;
+
+    return true;
+}
+
+void border_crop_intersect(BorderCrop *crop, const BorderCrop *other)
+{
+    if (other->left < crop->left) {
+        crop->left = other->left;
+    }
+    if (other->top < crop->top) {
+        crop->top = other->top;
+    }
+    if (other->right < crop->right) {
+        crop->right = other->right;
+    }
+    if (other->bottom < crop->bottom) {
+        crop->bottom = other->bottom;
+    }
+}
+
+bool border_crop_apply(AVFrame *frame, BorderCrop *crop)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+        return false;
+    }
+
+    // Chroma planes move by whole samples, so the luma has to as well
+    int left = crop->left & ~((1 << desc->log2_chroma_w) - 1);
+    int top  = crop->top  & ~((1 << desc->log2_chroma_h) - 1);
+
+    if (left < 0 || top < 0 || crop->right < 0 || crop->bottom < 0 ||
+        left + crop->right >= frame->width || top + crop->bottom >= frame->height) {
+        return false;
+    }
+
+    crop->left = left;
+    crop->top  = top;
+
+    if (!left && !top && !crop->right && !crop->bottom) {
+        return true;
+    }
+
+    int bytes = desc->comp[0].depth_minus1 >= 8 ? 2 : 1;
+
+    for (int i = 0; i < 4 && frame->data[i]; i++) {
+        // Planes 1 and 2 are the subsampled chroma ones, alpha is full size
+        bool chroma = i == 1 || i == 2;
+        int  x = chroma ? left >> desc->log2_chroma_w : left;
+        int  y = chroma ? top  >> desc->log2_chroma_h : top;
+
+        frame->data[i] += (ptrdiff_t)y * frame->linesize[i] + x * bytes;
+    }
+
+    frame->width  -= left + crop->right;
+    frame->height -= top + crop->bottom;
+
+    return true;
+}
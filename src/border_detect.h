@@ -0,0 +1,32 @@
+#ifndef MT_BORDER_DETECT_H
+#define MT_BORDER_DETECT_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Black bars (letterbox and pillarbox) around a decoded picture, in luma samples
+struct BorderCrop {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+// Scans the luma plane for black lines going in from the edges. The bars are
+// taken to be symmetrical, so each side gets the smaller of the two found,
+// and no side is cut by more than a quarter. Returns false if the picture
+// can't tell (mostly dark, or not planar YUV).
+bool border_detect(const AVFrame *frame, BorderCrop *crop);
+
+// Keeps only what is black in both, for several pictures of the same video
+void border_crop_intersect(BorderCrop *crop, const BorderCrop *other);
+
+// Cuts the borders off by moving the plane pointers and shrinking the frame,
+// nothing is copied. The left and top are rounded down to whole chroma
+// samples in crop. Returns false and leaves the frame alone if it doesn't fit.
+bool border_crop_apply(AVFrame *frame, BorderCrop *crop);
+
+#endif /* MT_BORDER_DETECT_H */
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "content_fingerprint.h"
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/murmur3.h>
+#include <libavformat/avio.h>
+}
+
+// The start of the file is where the demuxer starts reading, and the end is
+// where it finds the Cues and the Tags of most files. Both are whole blocks of
+// the block cache, so requests that go through it share the reads with the
+// decode.
+#define FINGERPRINT_HEAD_SIZE   (64 * 1024)
+#define FINGERPRINT_TAIL_SIZE   (64 * 1024)
+
+// Reads up to size bytes from offset, returns how many were read
+static int read_at(const ThumbnailInput *input, int64_t offset, uint8_t *buf, int size)
+{
+    if (input->seek(input->opaque, offset, SEEK_SET) < 0) {
+        return AVERROR(EIO);
+    }
+
+    int total = 0;
+    while (total < size) {
+        int ret = input->read_packet(input->opaque, buf + total, size - total);
+        if (ret == AVERROR_EOF || ret == 0) {
+            break;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        total += ret;
+    }
+
+    return total;
+}
+
+int content_fingerprint_compute(const ThumbnailInput *input, ContentFingerprint *fingerprint)
+{
+    struct AVMurMur3 *murmur = nullptr;
+    uint8_t *buffer = nullptr;
+    uint8_t size_bytes[8];
+    int64_t tail;
+    int ret = 0;
+
+    memset(fingerprint, 0, sizeof(*fingerprint));
+
+    if (!input->seek) {
+        return AVERROR(ENOSYS);
+    }
+
+    int64_t size = input->seek(input->opaque, 0, AVSEEK_SIZE);
+    if (size < 0) {
+        return AVERROR(ENOSYS);
+    }
+
+    murmur = av_murmur3_alloc();
+    buffer = (uint8_t *)av_malloc(FINGERPRINT_HEAD_SIZE);
+    if (!murmur || !buffer) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    av_murmur3_init(murmur);
+
+    for (int i = 0; i < 8; i++) {
+        size_bytes[i] = (uint8_t)(size >> (8 * i));
+    }
+    av_murmur3_update(murmur, size_bytes, sizeof(size_bytes));
+
+    // Small files are covered by the head already. The tail starts on a block
+    // boundary, so it's the last one or two blocks the demuxer reads.
+    tail = size - FINGERPRINT_TAIL_SIZE;
+    tail -= tail % FINGERPRINT_TAIL_SIZE;
+    if (tail < FINGERPRINT_HEAD_SIZE) {
+        tail = FINGERPRINT_HEAD_SIZE;
+    }
+
+    // Both at once rather than one after the other
+    if (input->prefetch) {
+        input->prefetch(input->opaque, 0, FINGERPRINT_HEAD_SIZE);
+        if (tail < size) {
+            input->prefetch(input->opaque, tail, size - tail);
+        }
+    }
+
+    ret = read_at(input, 0, buffer, FINGERPRINT_HEAD_SIZE);
+    if (ret < 0) {
+        goto cleanup;
+    }
+    av_murmur3_update(murmur, buffer, ret);
+    fingerprint->bytes_read += ret;
+
+    for (int64_t offset = tail; offset < size; offset += FINGERPRINT_TAIL_SIZE) {
+        ret = read_at(input, offset, buffer, FINGERPRINT_TAIL_SIZE);
+        if (ret < 0) {
+            goto cleanup;
+        }
+        av_murmur3_update(murmur, buffer, ret);
+        fingerprint->bytes_read += ret;
+    }
+
+    av_murmur3_final(murmur, fingerprint->hash);
+    fingerprint->size = size;
+    ret = 0;
+
+cleanup:
+    av_free(buffer);
+    av_free(murmur);
+
+    // Leave the input where the demuxer expects it, whatever happened above
+    if (input->seek(input->opaque, 0, SEEK_SET) < 0 && ret >= 0) {
+        ret = AVERROR(EIO);
+    }
+
+    return ret;
+}
+
+std::string content_fingerprint_key(const ContentFingerprint *fingerprint)
+{
+    char key[64];
+    int  pos = 0;
+
+    for (int i = 0; i < 16; i++) {
+        pos += snprintf(key + pos, sizeof(key) - pos, "%02x", fingerprint->hash[i]);
+    }
+    snprintf(key + pos, sizeof(key) - pos, ":%lld", (long long)fingerprint->size);
+
+    return key;
+}
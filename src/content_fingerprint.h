@@ -0,0 +1,32 @@
+#ifndef MT_CONTENT_FINGERPRINT_H
+#define MT_CONTENT_FINGERPRINT_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "thumbnail_engine.h"
+
+// A cheap hash of what's in a file, so that copies under other names can be
+// recognized without decoding anything. Covers the size, the start of the
+// file (EBML header, SeekHead and Segment Info with the SegmentUID, usually
+// the Tracks as well) and its end, where the Cues and Tags usually are. Both
+// are read by the demuxer when it opens the file, so read through the same
+// prefetching or caching input as the decode, the hash costs no extra I/O.
+struct ContentFingerprint {
+    uint8_t hash[16];
+    int64_t size;
+
+    // How much of the input had to be read for it
+    int     bytes_read;
+};
+
+// Reads through the input's callbacks and leaves it positioned at the start
+// again, also when it fails. Needs a seekable input. Returns 0 or a negative
+// AVERROR code.
+int content_fingerprint_compute(const ThumbnailInput *input, ContentFingerprint *fingerprint);
+
+// The hash and size as a string usable as a cache key
+std::string content_fingerprint_key(const ContentFingerprint *fingerprint);
+
+#endif /* MT_CONTENT_FINGERPRINT_H */
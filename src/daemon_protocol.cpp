@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daemon_protocol.h"
+
+#ifdef _WIN32
+#define daemon_unlink _unlink
+#include <io.h>
+#else
+#include <unistd.h>
+#define daemon_unlink unlink
+#endif
+
+// Don't get killed by SIGPIPE when a client goes away mid-response
+#ifdef MSG_NOSIGNAL
+#define DAEMON_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define DAEMON_SEND_FLAGS 0
+#endif
+
+#define MAX_REQUEST_LINE 8192
+
+static const struct {
+    ThumbnailFormat  format;
+    const char      *name;
+} format_names[] = {
+    { THUMBNAIL_FORMAT_BGRA, "bgra" },
+    { THUMBNAIL_FORMAT_JPEG, "jpg" },
+    { THUMBNAIL_FORMAT_PNG,  "png" },
+    { THUMBNAIL_FORMAT_WEBP, "webp" },
+};
+
+void daemon_request_init(DaemonRequest *request)
+{
+    request->size_limit = 256;
+    request->format     = THUMBNAIL_FORMAT_JPEG;
+    request->policy     = "first";
+    request->path.clear();
+    request->stream_prefix = 0;
+    request->shm        = false;
+    request->has_fd     = false;
+    request->fd         = -1;
+    request->stats      = false;
+}
+
+const char *daemon_format_name(ThumbnailFormat format)
+{
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (format_names[i].format == format) {
+            return format_names[i].name;
+        }
+    }
+
+    return "unknown";
+}
+
+bool daemon_parse_format(const std::string &name, ThumbnailFormat *format)
+{
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (name == format_names[i].name) {
+            *format = format_names[i].format;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool daemon_parse_request(const std::string &line, DaemonRequest *request, std::string *error)
+{
+    daemon_request_init(request);
+
+    if (line == "stats") {
+        request->stats = true;
+        return true;
+    }
+
+    size_t pos = 0;
+    while (pos < line.size()) {
+        if (line[pos] == ' ') {
+            pos++;
+            continue;
+        }
+
+        size_t equals = line.find('=', pos);
+        if (equals == std::string::npos) {
+            *error = "expected key=value";
+            return false;
+        }
+
+        std::string key = line.substr(pos, equals - pos);
+
+        // The path takes the rest of the line, spaces and all
+        if (key == "path") {
+            request->path = line.substr(equals + 1);
+            break;
+        }
+
+        size_t end = line.find(' ', equals);
+        if (end == std::string::npos) {
+            end = line.size();
+        }
+
+        std::string value = line.substr(equals + 1, end - equals - 1);
+        pos = end;
+
+        if (key == "size") {
+            request->size_limit = atoi(value.c_str());
+            if (request->size_limit <= 0 || request->size_limit > 4096) {
+                *error = "invalid size";
+                return false;
+            }
+        } else if (key == "format") {
+            if (!daemon_parse_format(value, &request->format)) {
+                *error = "unknown format";
+                return false;
+            }
+        } else if (key == "policy") {
+            request->policy = value;
+        } else if (key == "stream") {
+            request->stream_prefix = strtoll(value.c_str(), nullptr, 10);
+            if (request->stream_prefix <= 0) {
+                *error = "invalid stream prefix";
+                return false;
+            }
+        } else if (key == "shm") {
+            request->shm = value == "1";
+        } else if (key == "fd") {
+            request->has_fd = value == "1";
+        } else {
+            *error = "unknown key " + key;
+            return false;
+        }
+    }
+
+    if (request->path.empty() && !request->has_fd) {
+        *error = "no input given";
+        return false;
+    }
+
+    if (request->shm && request->format != THUMBNAIL_FORMAT_BGRA) {
+        *error = "shm needs format=bgra";
+        return false;
+    }
+
+    return true;
+}
+
+std::string daemon_format_request(const DaemonRequest &request)
+{
+    if (request.stats) {
+        return "stats";
+    }
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "size=%d format=%s policy=%s",
+             request.size_limit, daemon_format_name(request.format), request.policy.c_str());
+
+    std::string line = buf;
+    if (request.stream_prefix > 0) {
+        snprintf(buf, sizeof(buf), " stream=%lld", (long long)request.stream_prefix);
+        line += buf;
+    }
+
+    if (request.shm) {
+        line += " shm=1";
+    }
+
+    if (request.has_fd) {
+        line += " fd=1";
+    } else {
+        line += " path=" + request.path;
+    }
+
+    return line;
+}
+
+int daemon_socket_startup(void)
+{
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+        fprintf(stderr, "Failed to initialize Winsock :<\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int fill_address(const char *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long :<\n", path);
+        return -1;
+    }
+
+    strcpy(address->sun_path, path);
+
+    return 0;
+}
+
+daemon_socket daemon_socket_listen(const char *path, int backlog)
+{
+    struct sockaddr_un address;
+    if (fill_address(path, &address) < 0) {
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    daemon_socket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == DAEMON_INVALID_SOCKET) {
+        fprintf(stderr, "Failed to create the listening socket :<\n");
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    // A stale socket from an earlier run would make bind fail
+    daemon_unlink(path);
+
+    if (bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(sock, backlog) < 0) {
+        fprintf(stderr, "Failed to listen on %s :<\n", path);
+        daemon_socket_close(sock);
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+daemon_socket daemon_socket_connect(const char *path)
+{
+    struct sockaddr_un address;
+    if (fill_address(path, &address) < 0) {
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    daemon_socket sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == DAEMON_INVALID_SOCKET) {
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        daemon_socket_close(sock);
+        return DAEMON_INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+void daemon_socket_close(daemon_socket sock)
+{
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+int daemon_socket_send_all(daemon_socket sock, const void *data, size_t size)
+{
+    const char *ptr = (const char *)data;
+
+    while (size > 0) {
+        int chunk = size > 65536 ? 65536 : (int)size;
+        int sent = send(sock, ptr, chunk, DAEMON_SEND_FLAGS);
+        if (sent <= 0) {
+            return -1;
+        }
+
+        ptr  += sent;
+        size -= sent;
+    }
+
+    return 0;
+}
+
+int daemon_socket_send_fd(daemon_socket sock, const std::string &line, int fd)
+{
+#ifdef _WIN32
+    (void)sock;
+    (void)line;
+    (void)fd;
+    return -1;
+#else
+    std::string data = line + "\n";
+
+    struct iovec iov;
+    iov.iov_base = (void *)data.data();
+    iov.iov_len  = data.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t sent = sendmsg(sock, &msg, DAEMON_SEND_FLAGS);
+    if (sent < 0) {
+        return -1;
+    }
+
+    // The descriptor went with the first byte, the rest is plain data
+    if ((size_t)sent < data.size()) {
+        return daemon_socket_send_all(sock, data.data() + sent, data.size() - sent);
+    }
+
+    return 0;
+#endif
+}
+
+void daemon_reader_init(DaemonReader *reader, daemon_socket sock)
+{
+    reader->sock      = sock;
+    reader->pos       = 0;
+    reader->len       = 0;
+    reader->passed_fd = -1;
+}
+
+static int reader_fill(DaemonReader *reader)
+{
+    reader->pos = 0;
+    reader->len = 0;
+
+#ifdef _WIN32
+    int received = recv(reader->sock, reader->buffer, sizeof(reader->buffer), 0);
+#else
+    struct iovec iov;
+    iov.iov_base = reader->buffer;
+    iov.iov_len  = sizeof(reader->buffer);
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(reader->sock, &msg, 0);
+
+    if (received > 0) {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                // Only one descriptor per request, close anything left unclaimed
+                if (reader->passed_fd >= 0) {
+                    close(reader->passed_fd);
+                }
+                memcpy(&reader->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+    }
+#endif
+
+    if (received <= 0) {
+        return -1;
+    }
+
+    reader->len = received;
+
+    return 0;
+}
+
+int daemon_reader_line(DaemonReader *reader, std::string *line)
+{
+    line->clear();
+
+    for (;;) {
+        if (reader->pos == reader->len && reader_fill(reader) < 0) {
+            return -1;
+        }
+
+        char *start = reader->buffer + reader->pos;
+        char *newline = (char *)memchr(start, '\n', reader->len - reader->pos);
+        if (newline) {
+            line->append(start, newline - start);
+            reader->pos += newline - start + 1;
+            return 0;
+        }
+
+        line->append(start, reader->len - reader->pos);
+        reader->pos = reader->len;
+
+        if (line->size() > MAX_REQUEST_LINE) {
+            return -1;
+        }
+    }
+}
+
+int daemon_reader_exact(DaemonReader *reader, void *data, size_t size)
+{
+    char *ptr = (char *)data;
+
+    while (size > 0) {
+        if (reader->pos == reader->len && reader_fill(reader) < 0) {
+            return -1;
+        }
+
+        size_t chunk = reader->len - reader->pos;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        memcpy(ptr, reader->buffer + reader->pos, chunk);
+        reader->pos += chunk;
+        ptr         += chunk;
+        size        -= chunk;
+    }
+
+    return 0;
+}
+
+int daemon_reader_take_fd(DaemonReader *reader)
+{
+    int fd = reader->passed_fd;
+    reader->passed_fd = -1;
+    return fd;
+}
@@ -0,0 +1,107 @@
+#ifndef MT_DAEMON_PROTOCOL_H
+#define MT_DAEMON_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#ifdef _WIN32
+// AF_UNIX needs Windows 10 1803 or newer
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET daemon_socket;
+#define DAEMON_INVALID_SOCKET INVALID_SOCKET
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+typedef int daemon_socket;
+#define DAEMON_INVALID_SOCKET (-1)
+#endif
+
+#include "thumbnail_engine.h"
+
+// Requests are single lines of space separated key=value pairs. path has to
+// come last as it runs until the end of the line:
+//
+//   size=256 format=jpg policy=first path=/some/file.mkv
+//   size=256 format=jpg policy=chapter:2 path=...  (see frame_policy_parse)
+//   size=256 format=png fd=1        (descriptor passed along with SCM_RIGHTS)
+//   size=256 stream=8388608 fd=1    (forward-only, reads at most that many bytes)
+//   size=256 format=bgra shm=1 path=...  (pixels in the daemon's shared memory ring)
+//   stats
+//
+// Responses:
+//
+//   OK <width> <height> <bytes>\n followed by the thumbnail data
+//   SHM <ring> <slot> <generation> <width> <height> <stride>\n
+//                                 the pixels are in a slot of the ring, see shm_ring.h.
+//                                 shm=1 requests get OK instead if the ring is full.
+//   BUSY\n                        the queue is full, try again later
+//   ERR <code> <message>\n
+//   STATS key=value ...\n
+struct DaemonRequest {
+    int              size_limit;
+    ThumbnailFormat  format;
+    std::string      policy;
+    std::string      path;
+
+    // Streaming mode prefix limit in bytes, 0 for a normal seekable read
+    int64_t          stream_prefix;
+
+    // BGRA only, deliver through the shared memory ring if the daemon has one
+    bool             shm;
+
+    // Set when the client passed a descriptor instead of a path
+    bool             has_fd;
+    int              fd;
+
+    bool             stats;
+};
+
+void daemon_request_init(DaemonRequest *request);
+
+bool daemon_parse_request(const std::string &line, DaemonRequest *request, std::string *error);
+
+// Serializes everything but the descriptor itself
+std::string daemon_format_request(const DaemonRequest &request);
+
+// "bgra", "jpg", "png" or "webp"
+const char *daemon_format_name(ThumbnailFormat format);
+
+bool daemon_parse_format(const std::string &name, ThumbnailFormat *format);
+
+// Socket helpers, all return < 0 on failure
+int daemon_socket_startup(void);
+
+daemon_socket daemon_socket_listen(const char *path, int backlog);
+
+daemon_socket daemon_socket_connect(const char *path);
+
+void daemon_socket_close(daemon_socket sock);
+
+int daemon_socket_send_all(daemon_socket sock, const void *data, size_t size);
+
+// Sends a request line with a descriptor attached (not available on Windows)
+int daemon_socket_send_fd(daemon_socket sock, const std::string &line, int fd);
+
+// Buffered reading of lines and payloads, also picks up passed descriptors
+struct DaemonReader {
+    daemon_socket sock;
+    char          buffer[4096];
+    size_t        pos;
+    size_t        len;
+    int           passed_fd;
+};
+
+void daemon_reader_init(DaemonReader *reader, daemon_socket sock);
+
+// Reads a line without the terminating newline
+int daemon_reader_line(DaemonReader *reader, std::string *line);
+
+int daemon_reader_exact(DaemonReader *reader, void *data, size_t size);
+
+// Returns the last descriptor that came in and forgets about it, -1 if there is none
+int daemon_reader_take_fd(DaemonReader *reader);
+
+#endif /* MT_DAEMON_PROTOCOL_H */
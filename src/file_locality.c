@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include "file_locality.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#include <winioctl.h>
+#elif defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+// Returns 0 and the physical position of the first extent if we can find out
+static int first_extent(FileReader *reader, uint64_t *position)
+{
+#ifdef _WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle(file_reader_fileno(reader));
+    STARTING_VCN_INPUT_BUFFER input;
+    RETRIEVAL_POINTERS_BUFFER output;
+    DWORD returned = 0;
+
+    memset(&input, 0, sizeof(input));
+    memset(&output, 0, sizeof(output));
+
+    // Fails with ERROR_MORE_DATA for fragmented files, but the first extent is still filled in
+    if (!DeviceIoControl(handle, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input),
+                         &output, sizeof(output), &returned, NULL) &&
+        GetLastError() != ERROR_MORE_DATA) {
+        return -1;
+    }
+
+    if (!output.ExtentCount || output.Extents[0].Lcn.QuadPart < 0) {
+        return -1;
+    }
+
+    *position = (uint64_t)output.Extents[0].Lcn.QuadPart;
+
+    return 0;
+#elif defined(__linux__)
+    // struct fiemap ends in a flexible array, so give it room for one extent
+    union {
+        struct fiemap map;
+        uint8_t       space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start        = 0;
+    request.map.fm_length       = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+
+    if (ioctl(file_reader_fileno(reader), FS_IOC_FIEMAP, &request.map) < 0 ||
+        !request.map.fm_mapped_extents) {
+        return -1;
+    }
+
+    // Inline and delayed allocation extents don't have a real position yet
+    if (request.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) {
+        return -1;
+    }
+
+    *position = request.map.fm_extents[0].fe_physical;
+
+    return 0;
+#else
+    (void)reader;
+    (void)position;
+    return -1;
+#endif
+}
+
+int file_reader_locality(FileReader *reader, FileLocality *locality)
+{
+    FileIdentity identity;
+
+    if (file_reader_identity(reader, &identity) < 0) {
+        return -1;
+    }
+
+    locality->device = identity.device;
+
+    if (!first_extent(reader, &locality->position)) {
+        locality->physical = 1;
+    } else {
+        locality->position = identity.inode;
+        locality->physical = 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef MT_FILE_LOCALITY_H
+#define MT_FILE_LOCALITY_H
+
+#include <stdint.h>
+
+#include "file_reader.h"
+
+// Roughly where a file sits on its device, for ordering batch work so that
+// the disk heads sweep across instead of jumping all over the place
+typedef struct FileLocality {
+    uint64_t device;
+
+    // Physical offset of the first extent if the filesystem tells us (FIEMAP,
+    // retrieval pointers), the inode / file index otherwise, which tends to
+    // follow allocation order well enough
+    uint64_t position;
+    int      physical;
+} FileLocality;
+
+int file_reader_locality(FileReader *reader, FileLocality *locality);
+
+#endif /* MT_FILE_LOCALITY_H */
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_reader.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#define fdopen  _fdopen
+#define fileno  _fileno
+#else
+#include <unistd.h>
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+// For that one AV define
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+#include <libavformat/avio.h>
+
+struct FileReader {
+    FILE *fp;
+};
+
+static FileReader *file_reader_wrap(FILE *fp)
+{
+    FileReader *reader = NULL;
+
+    if (!fp) {
+        return NULL;
+    }
+
+    reader = (FileReader *)malloc(sizeof(*reader));
+    if (!reader) {
+        fclose(fp);
+        return NULL;
+    }
+
+    reader->fp = fp;
+
+    return reader;
+}
+
+FileReader *file_reader_open(const char *path)
+{
+    return file_reader_wrap(fopen(path, "rb"));
+}
+
+FileReader *file_reader_open_fd(int fd)
+{
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+        return NULL;
+    }
+
+    return file_reader_wrap(fp);
+}
+
+void file_reader_close(FileReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    fclose(reader->fp);
+    free(reader);
+}
+
+int file_reader_identity(FileReader *reader, FileIdentity *identity)
+{
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION info;
+    HANDLE handle = (HANDLE)_get_osfhandle(fileno(reader->fp));
+
+    if (handle == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(handle, &info)) {
+        return -1;
+    }
+
+    identity->device = info.dwVolumeSerialNumber;
+    identity->inode  = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    identity->size   = ((int64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    identity->mtime  = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+
+    if (fstat(fileno(reader->fp), &st) < 0) {
+        return -1;
+    }
+
+    identity->device = st.st_dev;
+    identity->inode  = st.st_ino;
+    identity->size   = st.st_size;
+    identity->mtime  = st.st_mtime;
+#endif
+
+    return 0;
+}
+
+int file_reader_fileno(FileReader *reader)
+{
+    return fileno(reader->fp);
+}
+
+int file_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    FileReader *reader = (FileReader *)opaque;
+    size_t read_bytes = fread(buf, 1, buf_size, reader->fp);
+
+    if (!read_bytes) {
+        return ferror(reader->fp) ? AVERROR(EIO) : AVERROR_EOF;
+    }
+
+    return (int)read_bytes;
+}
+
+int64_t file_seek(void *opaque, int64_t offset, int whence)
+{
+    FileReader *reader = (FileReader *)opaque;
+    FileIdentity identity;
+
+    if (whence == AVSEEK_SIZE) {
+        if (file_reader_identity(reader, &identity) < 0) {
+            return -1;
+        }
+        return identity.size;
+    }
+
+    // lavf may or in AVSEEK_FORCE, stdio doesn't care
+    whence &= ~AVSEEK_FORCE;
+
+    if (fseek64(reader->fp, offset, whence) < 0) {
+        return -1;
+    }
+
+    return ftell64(reader->fp);
+}
@@ -0,0 +1,34 @@
+#ifndef MT_FILE_READER_H
+#define MT_FILE_READER_H
+
+#include <stdint.h>
+
+// Plain file input for everything that isn't handed an IStream by the shell
+typedef struct FileReader FileReader;
+
+// What a file is, independent of the name it was opened with
+typedef struct FileIdentity {
+    uint64_t device;
+    uint64_t inode;
+    int64_t  size;
+    int64_t  mtime;
+} FileIdentity;
+
+FileReader *file_reader_open(const char *path);
+
+// Takes ownership of the descriptor
+FileReader *file_reader_open_fd(int fd);
+
+void file_reader_close(FileReader *reader);
+
+int file_reader_identity(FileReader *reader, FileIdentity *identity);
+
+// The underlying descriptor, for positional reads that leave the stdio position alone
+int file_reader_fileno(FileReader *reader);
+
+// avio callbacks, opaque is the FileReader
+int file_read_packet(void *opaque, uint8_t *buf, int buf_size);
+
+int64_t file_seek(void *opaque, int64_t offset, int whence);
+
+#endif /* MT_FILE_READER_H */
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <map>
+#include <new>
+
+#include "file_watcher.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#ifdef __linux__
+
+struct PendingFile {
+    int64_t arrived_us;
+    int64_t last_event_us;
+
+    // The writer closed it after its last change, which a rename into
+    // place counts as too
+    bool    closed;
+
+    // Size at the last settle check, -1 before the first
+    int64_t size;
+};
+
+struct FileWatcher {
+    int                                 fd;
+    int64_t                             settle_us;
+
+    // Watch descriptor to directory
+    std::map<int, std::string>          dirs;
+    std::map<std::string, PendingFile>  pending;
+};
+
+static bool is_matroska(const char *name)
+{
+    static const char *const extensions[] = { ".mkv", ".mk3d", ".webm" };
+
+    size_t length = strlen(name);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t ext_length = strlen(extensions[i]);
+        if (length > ext_length && !strcasecmp(name + length - ext_length, extensions[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void touch(FileWatcher *watcher, const std::string &path, bool closed, int64_t now)
+{
+    std::map<std::string, PendingFile>::iterator it = watcher->pending.find(path);
+    if (it == watcher->pending.end()) {
+        PendingFile file;
+        file.arrived_us = now;
+        file.size       = -1;
+        it = watcher->pending.insert(std::make_pair(path, file)).first;
+    }
+
+    it->second.last_event_us = now;
+    it->second.closed        = closed;
+}
+
+static void add_dir(FileWatcher *watcher, const std::string &dir, int64_t now)
+{
+    // Watch first and list after, so nothing created in between is missed
+    int wd = inotify_add_watch(watcher->fd, dir.c_str(),
+                               IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                               IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Failed to watch %s :<\n", dir.c_str());
+        return;
+    }
+    watcher->dirs[wd] = dir;
+
+    DIR *listing = opendir(dir.c_str());
+    if (!listing) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(listing))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+
+        std::string path = dir + "/" + entry->d_name;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = !stat(path.c_str(), &st) && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir) {
+            add_dir(watcher, path, now);
+        } else if (is_matroska(entry->d_name)) {
+            touch(watcher, path, true, now);
+        }
+    }
+
+    closedir(listing);
+}
+
+static bool is_under(const std::string &path, const std::string &dir)
+{
+    return path.size() > dir.size() && !path.compare(0, dir.size(), dir) && path[dir.size()] == '/';
+}
+
+// A directory left the tree, so stop watching it and everything below it.
+// Its wds would otherwise stay around with the old paths, or get events
+// from wherever it was moved to.
+static void remove_dir(FileWatcher *watcher, const std::string &dir)
+{
+    std::map<int, std::string>::iterator it = watcher->dirs.begin();
+    while (it != watcher->dirs.end()) {
+        if (it->second == dir || is_under(it->second, dir)) {
+            inotify_rm_watch(watcher->fd, it->first);
+            watcher->dirs.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    std::map<std::string, PendingFile>::iterator file = watcher->pending.begin();
+    while (file != watcher->pending.end()) {
+        if (is_under(file->first, dir)) {
+            watcher->pending.erase(file++);
+        } else {
+            ++file;
+        }
+    }
+}
+
+FileWatcher *file_watcher_create(int settle_ms)
+{
+    FileWatcher *watcher = new (std::nothrow) FileWatcher;
+    if (!watcher) {
+        return nullptr;
+    }
+
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        fprintf(stderr, "Failed to set up inotify :<\n");
+        delete watcher;
+        return nullptr;
+    }
+
+    watcher->settle_us = (int64_t)settle_ms * 1000;
+
+    return watcher;
+}
+
+void file_watcher_close(FileWatcher *watcher)
+{
+    if (!watcher) {
+        return;
+    }
+
+    close(watcher->fd);
+    delete watcher;
+}
+
+int file_watcher_add_root(FileWatcher *watcher, const std::string &dir)
+{
+    struct stat st;
+    if (stat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s isn't a directory :<\n", dir.c_str());
+        return -1;
+    }
+
+    add_dir(watcher, dir, av_gettime());
+
+    return 0;
+}
+
+static void handle_event(FileWatcher *watcher, const struct inotify_event *event, int64_t now)
+{
+    // Events got dropped, everything could have changed
+    if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Missed some file system events, rescanning\n");
+
+        std::map<int, std::string> dirs;
+        dirs.swap(watcher->dirs);
+        for (std::map<int, std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+            inotify_rm_watch(watcher->fd, it->first);
+        }
+        for (std::map<int, std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+            add_dir(watcher, it->second, now);
+        }
+        return;
+    }
+
+    if (event->mask & IN_IGNORED) {
+        watcher->dirs.erase(event->wd);
+        return;
+    }
+
+    std::map<int, std::string>::iterator dir = watcher->dirs.find(event->wd);
+    if (dir == watcher->dirs.end() || !event->len) {
+        return;
+    }
+
+    std::string path = dir->second + "/" + event->name;
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_dir(watcher, path, now);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            remove_dir(watcher, path);
+        }
+        return;
+    }
+
+    if (!is_matroska(event->name)) {
+        return;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watcher->pending.erase(path);
+    } else {
+        touch(watcher, path, (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0, now);
+    }
+}
+
+int file_watcher_poll(FileWatcher *watcher, int timeout_ms, std::vector<WatchedFile> *ready)
+{
+    struct pollfd pfd;
+    pfd.fd      = watcher->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    int64_t now = av_gettime();
+
+    if (ret > 0) {
+        // Aligned for the event structs, big enough for a good few of them
+        char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        for (;;) {
+            ssize_t length = read(watcher->fd, buf, sizeof(buf));
+            if (length <= 0) {
+                break;
+            }
+
+            for (char *pos = buf; pos < buf + length; ) {
+                const struct inotify_event *event = (const struct inotify_event *)pos;
+                handle_event(watcher, event, now);
+                pos += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+
+    std::map<std::string, PendingFile>::iterator it = watcher->pending.begin();
+    while (it != watcher->pending.end()) {
+        PendingFile &file = it->second;
+
+        if (now - file.last_event_us < watcher->settle_us) {
+            ++it;
+            continue;
+        }
+
+        struct stat st;
+        if (stat(it->first.c_str(), &st) < 0) {
+            watcher->pending.erase(it++);
+            continue;
+        }
+
+        // Quiet for a while but still open, so wait for the size to hold still
+        if (!file.closed && st.st_size != file.size) {
+            file.size          = st.st_size;
+            file.last_event_us = now;
+            ++it;
+            continue;
+        }
+
+        WatchedFile settled;
+        settled.path       = it->first;
+        settled.arrived_us = file.arrived_us;
+        ready->push_back(settled);
+
+        watcher->pending.erase(it++);
+    }
+
+    return 0;
+}
+
+size_t file_watcher_pending(const FileWatcher *watcher)
+{
+    return watcher->pending.size();
+}
+
+#else
+
+struct FileWatcher {
+    int unused;
+};
+
+FileWatcher *file_watcher_create(int settle_ms)
+{
+    fprintf(stderr, "Watching directories is only supported on Linux :<\n");
+    return nullptr;
+}
+
+void file_watcher_close(FileWatcher *watcher)
+{
+}
+
+int file_watcher_add_root(FileWatcher *watcher, const std::string &dir)
+{
+    return -1;
+}
+
+int file_watcher_poll(FileWatcher *watcher, int timeout_ms, std::vector<WatchedFile> *ready)
+{
+    return -1;
+}
+
+size_t file_watcher_pending(const FileWatcher *watcher)
+{
+    return 0;
+}
+
+#endif
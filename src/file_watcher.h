@@ -0,0 +1,38 @@
+#ifndef MT_FILE_WATCHER_H
+#define MT_FILE_WATCHER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Notices Matroska files showing up or changing under a set of directories,
+// with inotify. Files being copied in get a stream of events, so a file is
+// only reported once it has gone settle_ms without any and its size has
+// stayed the same. Linux only, creating one fails elsewhere.
+struct FileWatcher;
+
+struct WatchedFile {
+    std::string path;
+
+    // av_gettime of the first event for it, for telling how long it took
+    // to get a thumbnail ready
+    int64_t     arrived_us;
+};
+
+FileWatcher *file_watcher_create(int settle_ms);
+
+void file_watcher_close(FileWatcher *watcher);
+
+// Watches dir and everything below it, including directories created later.
+// Files already in there are reported as well. Returns < 0 on failure.
+int file_watcher_add_root(FileWatcher *watcher, const std::string &dir);
+
+// Waits up to timeout_ms for changes and appends the files that have settled
+// to ready. Returns < 0 if the watcher broke.
+int file_watcher_poll(FileWatcher *watcher, int timeout_ms, std::vector<WatchedFile> *ready);
+
+// Files seen but not settled yet
+size_t file_watcher_pending(const FileWatcher *watcher);
+
+#endif /* MT_FILE_WATCHER_H */
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_policy.h"
+
+extern "C" {
+#include <libavutil/dict.h>
+#include <libavutil/parseutils.h>
+#include <libavformat/avformat.h>
+}
+
+// What PERCENT and AUTO go for without a value
+#define FRAME_POLICY_PERCENT 10
+
+// CHAPTER's default, the first one is the intro often enough
+#define FRAME_POLICY_CHAPTER 2
+
+// How far into a chapter to go. Its very start tends to be a fade from
+// black, a tenth of it but no more than this gets past that.
+#define FRAME_POLICY_CHAPTER_SKIP_US (5 * AV_TIME_BASE)
+
+// Tag to look for in the file's and the video track's Tags
+#define FRAME_POLICY_TAG "THUMBNAIL_TIME"
+
+struct PolicyName {
+    ThumbnailPolicy  policy;
+    const char      *name;
+};
+
+static const PolicyName policy_names[] = {
+    { THUMBNAIL_POLICY_FIRST,   "first" },
+    { THUMBNAIL_POLICY_PERCENT, "percent" },
+    { THUMBNAIL_POLICY_CHAPTER, "chapter" },
+    { THUMBNAIL_POLICY_TAG,     "tag" },
+    { THUMBNAIL_POLICY_AUTO,    "auto" },
+};
+
+bool frame_policy_parse(const char *name, ThumbnailPolicy *policy, int *value)
+{
+    const char *colon  = strchr(name, ':');
+    size_t      length = colon ? (size_t)(colon - name) : strlen(name);
+
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (strlen(policy_names[i].name) != length || strncmp(policy_names[i].name, name, length)) {
+            continue;
+        }
+
+        *policy = policy_names[i].policy;
+        *value  = 0;
+
+        if (!colon) {
+            return true;
+        }
+
+        // Only the ones that have a number take one
+        if (*policy != THUMBNAIL_POLICY_PERCENT && *policy != THUMBNAIL_POLICY_CHAPTER) {
+            return false;
+        }
+
+        char *end = nullptr;
+        long  number = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end || number < 0 ||
+            (*policy == THUMBNAIL_POLICY_PERCENT && number > 100) ||
+            (*policy == THUMBNAIL_POLICY_CHAPTER && number > 9999)) {
+            return false;
+        }
+
+        *value = (int)number;
+        return true;
+    }
+
+    return false;
+}
+
+const char *frame_policy_name(ThumbnailPolicy policy)
+{
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (policy_names[i].policy == policy) {
+            return policy_names[i].name;
+        }
+    }
+
+    return "unknown";
+}
+
+static int64_t file_start(AVFormatContext *lavf_context)
+{
+    return lavf_context->start_time != AV_NOPTS_VALUE ? lavf_context->start_time : 0;
+}
+
+// Anything past the end would just make the seek fail
+static bool within_duration(AVFormatContext *lavf_context, int64_t target)
+{
+    if (target < file_start(lavf_context)) {
+        return false;
+    }
+
+    return lavf_context->duration == AV_NOPTS_VALUE || lavf_context->duration <= 0 ||
+           target < file_start(lavf_context) + lavf_context->duration;
+}
+
+static bool choose_percent(AVFormatContext *lavf_context, int value, int64_t *target)
+{
+    if (lavf_context->duration == AV_NOPTS_VALUE || lavf_context->duration <= 0) {
+        return false;
+    }
+
+    int percent = value > 0 ? value : FRAME_POLICY_PERCENT;
+
+    *target = file_start(lavf_context) + lavf_context->duration * percent / 100;
+
+    // 100 percent is the very end, take the last picture before it
+    if (*target >= file_start(lavf_context) + lavf_context->duration) {
+        *target = file_start(lavf_context) + lavf_context->duration - 1;
+    }
+
+    return true;
+}
+
+static bool choose_chapter(AVFormatContext *lavf_context, int value, int64_t *target)
+{
+    unsigned int number = value > 0 ? (unsigned int)value : FRAME_POLICY_CHAPTER;
+    if (number > lavf_context->nb_chapters) {
+        return false;
+    }
+
+    const AVChapter *chapter = lavf_context->chapters[number - 1];
+    AVRational time_base_q = { 1, AV_TIME_BASE };
+
+    int64_t start = av_rescale_q(chapter->start, chapter->time_base, time_base_q);
+    int64_t skip  = 0;
+
+    if (chapter->end > chapter->start) {
+        skip = av_rescale_q(chapter->end - chapter->start, chapter->time_base, time_base_q) / 10;
+        if (skip > FRAME_POLICY_CHAPTER_SKIP_US) {
+            skip = FRAME_POLICY_CHAPTER_SKIP_US;
+        }
+    }
+
+    *target = start + skip;
+
+    return within_duration(lavf_context, *target);
+}
+
+// Either a plain number of seconds or [HH:]MM:SS[.mmm], from the start of the file
+static bool choose_tag(AVFormatContext *lavf_context, int stream_index, int64_t *target)
+{
+    AVDictionaryEntry *tag = av_dict_get(lavf_context->streams[stream_index]->metadata,
+                                         FRAME_POLICY_TAG, nullptr, 0);
+    if (!tag) {
+        tag = av_dict_get(lavf_context->metadata, FRAME_POLICY_TAG, nullptr, 0);
+    }
+    if (!tag) {
+        return false;
+    }
+
+    int64_t offset = 0;
+    if (av_parse_time(&offset, tag->value, 1) < 0 || offset < 0) {
+        fprintf(stderr, "Ignoring a " FRAME_POLICY_TAG " tag that isn't a time: %s\n", tag->value);
+        return false;
+    }
+
+    *target = file_start(lavf_context) + offset;
+
+    return within_duration(lavf_context, *target);
+}
+
+ThumbnailPolicy frame_policy_choose(AVFormatContext *lavf_context, int stream_index,
+                                    ThumbnailPolicy policy, int value, int64_t *target_us)
+{
+    *target_us = AV_NOPTS_VALUE;
+
+    switch (policy) {
+    case THUMBNAIL_POLICY_PERCENT:
+        if (choose_percent(lavf_context, value, target_us)) {
+            return THUMBNAIL_POLICY_PERCENT;
+        }
+        break;
+    case THUMBNAIL_POLICY_CHAPTER:
+        if (choose_chapter(lavf_context, value, target_us)) {
+            return THUMBNAIL_POLICY_CHAPTER;
+        }
+        break;
+    case THUMBNAIL_POLICY_TAG:
+        if (choose_tag(lavf_context, stream_index, target_us)) {
+            return THUMBNAIL_POLICY_TAG;
+        }
+        break;
+    case THUMBNAIL_POLICY_AUTO:
+        if (choose_tag(lavf_context, stream_index, target_us)) {
+            return THUMBNAIL_POLICY_TAG;
+        }
+        if (lavf_context->nb_chapters >= 2 && choose_chapter(lavf_context, 2, target_us)) {
+            return THUMBNAIL_POLICY_CHAPTER;
+        }
+        if (choose_percent(lavf_context, FRAME_POLICY_PERCENT, target_us)) {
+            return THUMBNAIL_POLICY_PERCENT;
+        }
+        break;
+    default:
+        break;
+    }
+
+    *target_us = AV_NOPTS_VALUE;
+
+    return THUMBNAIL_POLICY_FIRST;
+}
@@ -0,0 +1,23 @@
+#ifndef MT_FRAME_POLICY_H
+#define MT_FRAME_POLICY_H
+
+#include <stdint.h>
+
+#include "thumbnail_engine.h"
+
+struct AVFormatContext;
+
+// Parses "first", "percent:N", "chapter:N", "tag" or "auto", the :N parts
+// being optional. Returns false for anything else.
+bool frame_policy_parse(const char *name, ThumbnailPolicy *policy, int *value);
+
+// The name frame_policy_parse takes for a policy, without a value
+const char *frame_policy_name(ThumbnailPolicy policy);
+
+// Picks the time to take the picture from, in AV_TIME_BASE units, going only
+// by what avformat_open_input read. Returns the policy that picked it, or
+// FIRST with *target_us set to AV_NOPTS_VALUE when nothing applied.
+ThumbnailPolicy frame_policy_choose(AVFormatContext *lavf_context, int stream_index,
+                                    ThumbnailPolicy policy, int value, int64_t *target_us);
+
+#endif /* MT_FRAME_POLICY_H */
@@ -0,0 +1,430 @@
+#include <math.h>
+#include <string.h>
+
+#include "hdr_convert.h"
+
+extern "C" {
+#include <libavutil/cpu.h>
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS 1
+#endif
+
+// Fixed point precision of the YCbCr->RGB matrix
+#define MATRIX_BITS 13
+
+// Brightness that maps to SDR reference white, and the HDR peak we
+// roll off towards
+#define SDR_WHITE_NITS 100.0
+#define HDR_PEAK_NITS  1000.0
+
+enum TransferIndex {
+    TRANSFER_SDR,
+    TRANSFER_PQ,
+    TRANSFER_HLG,
+    TRANSFER_COUNT
+};
+
+// Entries of the tables going from linear light back to 8-bit. They're
+// indexed by the square root of the value, which spends them on the darks.
+#define OUTPUT_LUT_SIZE 4096
+
+// 10-bit non-linear R'G'B' -> 8-bit SDR, one table per transfer. Used as is
+// when the source has BT.709 primaries.
+static uint8_t transfer_luts[TRANSFER_COUNT][1024];
+
+// The same split in two, for BT.2020 sources whose primaries have to be
+// converted in linear light in between: 10-bit R'G'B' -> linear light with
+// SDR white at 1.0, and linear light up to linear_max -> 8-bit SDR
+static float   linear_luts[TRANSFER_COUNT][1024];
+static uint8_t output_luts[TRANSFER_COUNT][OUTPUT_LUT_SIZE];
+static double  linear_max[TRANSFER_COUNT];
+
+// Linear BT.2020 RGB -> linear BT.709 RGB (ITU-R BT.2087)
+static const float bt2020_to_bt709[3][3] = {
+    {  1.6605f, -0.5876f, -0.0728f },
+    { -0.1246f,  1.1329f, -0.0083f },
+    { -0.0182f, -0.1006f,  1.1187f },
+};
+
+// What a row of R'G'B' goes through to become BGRA
+struct OutputMapping {
+    const uint8_t *lut;
+
+    // Set for BT.2020 primaries, lut isn't used then
+    const float   *linear;
+    const uint8_t *output;
+    float          output_scale;
+};
+
+struct MatrixCoefficients {
+    int16_t y;
+    int16_t r_cr;
+    int16_t g_cb;
+    int16_t g_cr;
+    int16_t b_cb;
+    int16_t y_offset;
+};
+
+// ST 2084 EOTF, returns nits
+static double pq_to_nits(double e)
+{
+    const double m1 = 2610.0 / 16384.0;
+    const double m2 = 2523.0 / 4096.0 * 128.0;
+    const double c1 = 3424.0 / 4096.0;
+    const double c2 = 2413.0 / 4096.0 * 32.0;
+    const double c3 = 2392.0 / 4096.0 * 32.0;
+
+    double p = pow(e, 1.0 / m2);
+    double num = p - c1;
+    if (num < 0.0) {
+        num = 0.0;
+    }
+
+    return 10000.0 * pow(num / (c2 - c3 * p), 1.0 / m1);
+}
+
+// ARIB STD-B67 inverse OETF plus the nominal OOTF for a 1000 nit display, returns nits
+static double hlg_to_nits(double e)
+{
+    const double a = 0.17883277;
+    const double b = 0.28466892;
+    const double c = 0.55991073;
+
+    double scene = (e <= 0.5) ? (e * e / 3.0) : ((exp((e - c) / a) + b) / 12.0);
+
+    return HDR_PEAK_NITS * pow(scene, 1.2);
+}
+
+// BT.1886 inverse, linear light with white at 1.0 -> 8-bit
+static uint8_t sdr_encode(double y)
+{
+    if (y > 1.0) {
+        y = 1.0;
+    }
+
+    return (uint8_t)(pow(y, 1.0 / 2.4) * 255.0 + 0.5);
+}
+
+// Extended Reinhard on relative luminance, then the BT.1886 inverse
+static uint8_t tone_map(double nits)
+{
+    const double white = HDR_PEAK_NITS / SDR_WHITE_NITS;
+
+    double x = nits / SDR_WHITE_NITS;
+
+    return sdr_encode(x * (1.0 + x / (white * white)) / (1.0 + x));
+}
+
+void hdr_convert_init(void)
+{
+    for (int i = 0; i < 1024; i++) {
+        double e = i / 1023.0;
+
+        transfer_luts[TRANSFER_SDR][i] = (uint8_t)((i * 255 + 511) / 1023);
+        transfer_luts[TRANSFER_PQ][i]  = tone_map(pq_to_nits(e));
+        transfer_luts[TRANSFER_HLG][i] = tone_map(hlg_to_nits(e));
+
+        linear_luts[TRANSFER_SDR][i] = (float)pow(e, 2.4);
+        linear_luts[TRANSFER_PQ][i]  = (float)(pq_to_nits(e) / SDR_WHITE_NITS);
+        linear_luts[TRANSFER_HLG][i] = (float)(hlg_to_nits(e) / SDR_WHITE_NITS);
+    }
+
+    linear_max[TRANSFER_SDR] = 1.0;
+    linear_max[TRANSFER_PQ]  = pq_to_nits(1.0) / SDR_WHITE_NITS;
+    linear_max[TRANSFER_HLG] = hlg_to_nits(1.0) / SDR_WHITE_NITS;
+
+    for (int i = 0; i < OUTPUT_LUT_SIZE; i++) {
+        double t = i / (double)(OUTPUT_LUT_SIZE - 1);
+
+        for (int transfer = 0; transfer < TRANSFER_COUNT; transfer++) {
+            double y = t * t * linear_max[transfer];
+
+            output_luts[transfer][i] = transfer == TRANSFER_SDR ? sdr_encode(y)
+                                                                : tone_map(y * SDR_WHITE_NITS);
+        }
+    }
+}
+
+int hdr_convert_supported(const AVFrame *frame)
+{
+    return frame->format == AV_PIX_FMT_YUV420P10;
+}
+
+static enum TransferIndex get_transfer(const AVFrame *source)
+{
+    switch (source->color_trc) {
+    case AVCOL_TRC_SMPTEST2084:
+        return TRANSFER_PQ;
+    case AVCOL_TRC_ARIB_STD_B67:
+        return TRANSFER_HLG;
+    default:
+        return TRANSFER_SDR;
+    }
+}
+
+static void get_mapping(const AVFrame *source, enum TransferIndex transfer, OutputMapping *mapping)
+{
+    bool bt2020 = source->color_primaries == AVCOL_PRI_BT2020;
+
+    // HDR content without the flag is practically always BT.2020, same as
+    // for the matrix
+    if (source->color_primaries == AVCOL_PRI_UNSPECIFIED && transfer != TRANSFER_SDR) {
+        bt2020 = true;
+    }
+
+    mapping->lut          = transfer_luts[transfer];
+    mapping->linear       = bt2020 ? linear_luts[transfer] : nullptr;
+    mapping->output       = output_luts[transfer];
+    mapping->output_scale = (float)(1.0 / linear_max[transfer]);
+}
+
+static void get_matrix(const AVFrame *source, enum TransferIndex transfer, MatrixCoefficients *m)
+{
+    double kr = 0.2126;
+    double kb = 0.0722;
+
+    switch (source->colorspace) {
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:
+        kr = 0.2627;
+        kb = 0.0593;
+        break;
+    case AVCOL_SPC_BT709:
+        break;
+    case AVCOL_SPC_UNSPECIFIED:
+        // HDR content without the flag is practically always BT.2020
+        if (transfer != TRANSFER_SDR) {
+            kr = 0.2627;
+            kb = 0.0593;
+        }
+        break;
+    default:
+        // BT.601 and friends
+        kr = 0.299;
+        kb = 0.114;
+        break;
+    }
+
+    double kg = 1.0 - kr - kb;
+
+    // Limited range stretches 64-940 (luma) and 64-960 (chroma) to full 10-bit
+    double y_scale = 1.0;
+    double c_scale = 1.0;
+    m->y_offset = 0;
+    if (source->color_range != AVCOL_RANGE_JPEG) {
+        y_scale = 1023.0 / 876.0;
+        c_scale = 1023.0 / 896.0;
+        m->y_offset = 64;
+    }
+
+    const double one = (double)(1 << MATRIX_BITS);
+
+    m->y    = (int16_t)(y_scale * one + 0.5);
+    m->r_cr = (int16_t)(2.0 * (1.0 - kr) * c_scale * one + 0.5);
+    m->g_cb = (int16_t)(-2.0 * kb * (1.0 - kb) / kg * c_scale * one - 0.5);
+    m->g_cr = (int16_t)(-2.0 * kr * (1.0 - kr) / kg * c_scale * one - 0.5);
+    m->b_cb = (int16_t)(2.0 * (1.0 - kb) * c_scale * one + 0.5);
+}
+
+static inline int clip_10bit(int v)
+{
+    return v < 0 ? 0 : (v > 1023 ? 1023 : v);
+}
+
+static inline uint8_t output_linear(const OutputMapping *mapping, float v)
+{
+    // Out of the BT.709 gamut, clipped
+    if (v <= 0.0f) {
+        return mapping->output[0];
+    }
+
+    int i = (int)(sqrtf(v * mapping->output_scale) * (OUTPUT_LUT_SIZE - 1) + 0.5f);
+
+    return mapping->output[i < OUTPUT_LUT_SIZE ? i : OUTPUT_LUT_SIZE - 1];
+}
+
+// One pixel of 10-bit R'G'B' to BGRA
+static inline void store_pixel(const OutputMapping *mapping, int r, int g, int b, uint8_t *dst)
+{
+    if (mapping->linear) {
+        const float (*m)[3] = bt2020_to_bt709;
+
+        float lr = mapping->linear[r];
+        float lg = mapping->linear[g];
+        float lb = mapping->linear[b];
+
+        dst[0] = output_linear(mapping, m[2][0] * lr + m[2][1] * lg + m[2][2] * lb);
+        dst[1] = output_linear(mapping, m[1][0] * lr + m[1][1] * lg + m[1][2] * lb);
+        dst[2] = output_linear(mapping, m[0][0] * lr + m[0][1] * lg + m[0][2] * lb);
+    } else {
+        dst[0] = mapping->lut[b];
+        dst[1] = mapping->lut[g];
+        dst[2] = mapping->lut[r];
+    }
+    dst[3] = 255;
+}
+
+static void convert_row_c(const uint16_t *src_y, const uint16_t *src_u, const uint16_t *src_v,
+                          int start, int width, const MatrixCoefficients *m,
+                          const OutputMapping *mapping, uint8_t *dst)
+{
+    const int round = 1 << (MATRIX_BITS - 1);
+
+    for (int x = start; x < width; x++) {
+        int y  = (src_y[x] - m->y_offset) * m->y;
+        int cb = src_u[x >> 1] - 512;
+        int cr = src_v[x >> 1] - 512;
+
+        int r = clip_10bit((y + m->r_cr * cr + round) >> MATRIX_BITS);
+        int g = clip_10bit((y + m->g_cb * cb + m->g_cr * cr + round) >> MATRIX_BITS);
+        int b = clip_10bit((y + m->b_cb * cb + round) >> MATRIX_BITS);
+
+        store_pixel(mapping, r, g, b, dst + 4 * x);
+    }
+}
+
+#if HAVE_SSE2_INTRINSICS
+// The BT.2020 -> BT.709 matrix and the output LUT index for four pixels,
+// only the table lookups are scalar
+static inline void store_linear_sse2(const OutputMapping *mapping, const int16_t *r, const int16_t *g,
+                                     const int16_t *b, uint8_t *dst)
+{
+    const float *linear = mapping->linear;
+    const float (*m)[3] = bt2020_to_bt709;
+
+    const __m128 zero  = _mm_setzero_ps();
+    const __m128 scale = _mm_set1_ps(mapping->output_scale);
+    const __m128 size  = _mm_set1_ps((float)(OUTPUT_LUT_SIZE - 1));
+
+    __m128 lr = _mm_set_ps(linear[r[3]], linear[r[2]], linear[r[1]], linear[r[0]]);
+    __m128 lg = _mm_set_ps(linear[g[3]], linear[g[2]], linear[g[1]], linear[g[0]]);
+    __m128 lb = _mm_set_ps(linear[b[3]], linear[b[2]], linear[b[1]], linear[b[0]]);
+
+#ifdef _MSC_VER
+    __declspec(align(16)) int32_t index[3][4];
+#else
+    int32_t index[3][4] __attribute__((aligned(16)));
+#endif
+
+    // BGRA order, so the last matrix row goes first
+    for (int c = 0; c < 3; c++) {
+        const float *row = m[2 - c];
+
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lr, _mm_set1_ps(row[0])),
+                                         _mm_mul_ps(lg, _mm_set1_ps(row[1]))),
+                              _mm_mul_ps(lb, _mm_set1_ps(row[2])));
+
+        // Same as output_linear(), out of gamut clips to 0 and the top of the LUT
+        v = _mm_mul_ps(_mm_sqrt_ps(_mm_mul_ps(_mm_max_ps(v, zero), scale)), size);
+        _mm_store_si128((__m128i *)index[c], _mm_cvtps_epi32(_mm_min_ps(v, size)));
+    }
+
+    for (int i = 0; i < 4; i++) {
+        dst[4 * i + 0] = mapping->output[index[0][i]];
+        dst[4 * i + 1] = mapping->output[index[1][i]];
+        dst[4 * i + 2] = mapping->output[index[2][i]];
+        dst[4 * i + 3] = 255;
+    }
+}
+
+// Does the matrix eight pixels at a time, the LUTs stay scalar.
+// Returns the first pixel that was not converted.
+static int convert_row_sse2(const uint16_t *src_y, const uint16_t *src_u, const uint16_t *src_v,
+                            int width, const MatrixCoefficients *m,
+                            const OutputMapping *mapping, uint8_t *dst)
+{
+    const __m128i zero     = _mm_setzero_si128();
+    const __m128i round    = _mm_set1_epi32(1 << (MATRIX_BITS - 1));
+    const __m128i y_offset = _mm_set1_epi16(m->y_offset);
+    const __m128i c_offset = _mm_set1_epi16(512);
+    const __m128i max_10   = _mm_set1_epi16(1023);
+
+    // Coefficient pairs for _mm_madd_epi16
+    const __m128i y_coef   = _mm_set_epi16(0, m->y, 0, m->y, 0, m->y, 0, m->y);
+    const __m128i r_coef   = _mm_set_epi16(0, m->r_cr, 0, m->r_cr, 0, m->r_cr, 0, m->r_cr);
+    const __m128i g_coef   = _mm_set_epi16(m->g_cr, m->g_cb, m->g_cr, m->g_cb, m->g_cr, m->g_cb, m->g_cr, m->g_cb);
+    const __m128i b_coef   = _mm_set_epi16(0, m->b_cb, 0, m->b_cb, 0, m->b_cb, 0, m->b_cb);
+
+#ifdef _MSC_VER
+    __declspec(align(16)) int16_t rgb[3][8];
+#else
+    int16_t rgb[3][8] __attribute__((aligned(16)));
+#endif
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i y  = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(src_y + x)), y_offset);
+        __m128i cb = _mm_loadl_epi64((const __m128i *)(src_u + (x >> 1)));
+        __m128i cr = _mm_loadl_epi64((const __m128i *)(src_v + (x >> 1)));
+
+        // Duplicate each chroma sample for its two luma neighbours
+        cb = _mm_sub_epi16(_mm_unpacklo_epi16(cb, cb), c_offset);
+        cr = _mm_sub_epi16(_mm_unpacklo_epi16(cr, cr), c_offset);
+
+        __m128i y_lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, zero), y_coef), round);
+        __m128i y_hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, zero), y_coef), round);
+
+        __m128i r_lo = _mm_add_epi32(y_lo, _mm_madd_epi16(_mm_unpacklo_epi16(cr, zero), r_coef));
+        __m128i r_hi = _mm_add_epi32(y_hi, _mm_madd_epi16(_mm_unpackhi_epi16(cr, zero), r_coef));
+        __m128i g_lo = _mm_add_epi32(y_lo, _mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), g_coef));
+        __m128i g_hi = _mm_add_epi32(y_hi, _mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), g_coef));
+        __m128i b_lo = _mm_add_epi32(y_lo, _mm_madd_epi16(_mm_unpacklo_epi16(cb, zero), b_coef));
+        __m128i b_hi = _mm_add_epi32(y_hi, _mm_madd_epi16(_mm_unpackhi_epi16(cb, zero), b_coef));
+
+        __m128i r = _mm_packs_epi32(_mm_srai_epi32(r_lo, MATRIX_BITS), _mm_srai_epi32(r_hi, MATRIX_BITS));
+        __m128i g = _mm_packs_epi32(_mm_srai_epi32(g_lo, MATRIX_BITS), _mm_srai_epi32(g_hi, MATRIX_BITS));
+        __m128i b = _mm_packs_epi32(_mm_srai_epi32(b_lo, MATRIX_BITS), _mm_srai_epi32(b_hi, MATRIX_BITS));
+
+        _mm_store_si128((__m128i *)rgb[0], _mm_min_epi16(_mm_max_epi16(r, zero), max_10));
+        _mm_store_si128((__m128i *)rgb[1], _mm_min_epi16(_mm_max_epi16(g, zero), max_10));
+        _mm_store_si128((__m128i *)rgb[2], _mm_min_epi16(_mm_max_epi16(b, zero), max_10));
+
+        uint8_t *out = dst + 4 * x;
+        if (mapping->linear) {
+            store_linear_sse2(mapping, rgb[0], rgb[1], rgb[2], out);
+            store_linear_sse2(mapping, rgb[0] + 4, rgb[1] + 4, rgb[2] + 4, out + 16);
+        } else {
+            for (int i = 0; i < 8; i++) {
+                store_pixel(mapping, rgb[0][i], rgb[1][i], rgb[2][i], out + 4 * i);
+            }
+        }
+    }
+
+    return x;
+}
+#endif
+
+void hdr_convert_to_bgra(const uint8_t *const src_data[4], const int src_linesize[4],
+                         int width, int height, const AVFrame *source,
+                         uint8_t *dst, int dst_linesize)
+{
+    enum TransferIndex transfer = get_transfer(source);
+
+    OutputMapping mapping;
+    get_mapping(source, transfer, &mapping);
+
+    MatrixCoefficients m;
+    get_matrix(source, transfer, &m);
+
+#if HAVE_SSE2_INTRINSICS
+    int use_sse2 = !!(av_get_cpu_flags() & AV_CPU_FLAG_SSE2);
+#endif
+
+    for (int row = 0; row < height; row++) {
+        const uint16_t *src_y = (const uint16_t *)(src_data[0] + row * src_linesize[0]);
+        const uint16_t *src_u = (const uint16_t *)(src_data[1] + (row >> 1) * src_linesize[1]);
+        const uint16_t *src_v = (const uint16_t *)(src_data[2] + (row >> 1) * src_linesize[2]);
+        uint8_t *out = dst + row * dst_linesize;
+
+        int done = 0;
+#if HAVE_SSE2_INTRINSICS
+        if (use_sse2) {
+            done = convert_row_sse2(src_y, src_u, src_v, width, &m, &mapping, out);
+        }
+#endif
+        convert_row_c(src_y, src_u, src_v, done, width, &m, &mapping, out);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef MT_HDR_CONVERT_H
+#define MT_HDR_CONVERT_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Builds the transfer function LUTs, called once from pipeline_global_init
+void hdr_convert_init(void);
+
+// Whether the decoded frame should go through the high bit depth path
+int hdr_convert_supported(const AVFrame *frame);
+
+// Converts an already downscaled yuv420p10 picture to BGRA. PQ and HLG are
+// tone mapped to SDR, everything else just loses the two extra bits. BT.2020
+// primaries are converted to BT.709 in linear light on the way. The color
+// properties are taken from the decoded source frame.
+void hdr_convert_to_bgra(const uint8_t *const src_data[4], const int src_linesize[4],
+                         int width, int height, const AVFrame *source,
+                         uint8_t *dst, int dst_linesize);
+
+#endif /* MT_HDR_CONVERT_H */
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "io_recorder.h"
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#define IO_LOG_HEADER "# matroska_thumbnailer io log v1"
+
+static void add_op(IoRecorder *recorder, char type, int64_t offset, int64_t size, int64_t result)
+{
+    IoOp op;
+    op.type   = type;
+    op.offset = offset;
+    op.size   = size;
+    op.result = result;
+
+    recorder->ops.push_back(op);
+}
+
+static int recorder_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    IoRecorder *recorder = (IoRecorder *)opaque;
+
+    int ret = recorder->inner.read_packet(recorder->inner.opaque, buf, buf_size);
+    add_op(recorder, 'R', recorder->pos, buf_size, ret);
+
+    if (ret > 0) {
+        recorder->pos += ret;
+    }
+
+    return ret;
+}
+
+static int64_t recorder_seek(void *opaque, int64_t offset, int whence)
+{
+    IoRecorder *recorder = (IoRecorder *)opaque;
+
+    int64_t ret = recorder->inner.seek(recorder->inner.opaque, offset, whence);
+    add_op(recorder, 'S', offset, whence, ret);
+
+    // AVSEEK_SIZE doesn't move anything
+    if (ret >= 0 && (whence & ~AVSEEK_FORCE) != AVSEEK_SIZE) {
+        recorder->pos = ret;
+    }
+
+    return ret;
+}
+
+static void recorder_prefetch(void *opaque, int64_t offset, int64_t size)
+{
+    IoRecorder *recorder = (IoRecorder *)opaque;
+
+    recorder->inner.prefetch(recorder->inner.opaque, offset, size);
+    add_op(recorder, 'P', offset, size, 0);
+}
+
+void io_recorder_init(IoRecorder *recorder, const ThumbnailInput *inner)
+{
+    recorder->inner = *inner;
+    recorder->pos   = 0;
+    recorder->ops.clear();
+}
+
+void io_recorder_input(IoRecorder *recorder, ThumbnailInput *input)
+{
+    input->opaque      = recorder;
+    input->read_packet = recorder_read_packet;
+    input->seek        = recorder->inner.seek ? recorder_seek : nullptr;
+    input->prefetch    = recorder->inner.prefetch ? recorder_prefetch : nullptr;
+}
+
+int io_log_write(const std::vector<IoOp> &ops, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing the I/O log :<\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "%s\n", IO_LOG_HEADER);
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        fprintf(fp, "%c %lld %lld %lld\n", ops[i].type, (long long)ops[i].offset,
+                (long long)ops[i].size, (long long)ops[i].result);
+    }
+
+    bool ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+
+    return ok ? 0 : -1;
+}
+
+int io_log_read(const char *path, std::vector<IoOp> *ops)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open the I/O log %s :<\n", path);
+        return -1;
+    }
+
+    char line[256];
+    int  ret = 0;
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, IO_LOG_HEADER, strlen(IO_LOG_HEADER))) {
+        fprintf(stderr, "%s isn't an I/O log :<\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    ops->clear();
+
+    while (fgets(line, sizeof(line), fp)) {
+        char      type;
+        long long offset, size, result;
+
+        if (sscanf(line, "%c %lld %lld %lld", &type, &offset, &size, &result) != 4 ||
+            (type != 'R' && type != 'S' && type != 'P')) {
+            fprintf(stderr, "Broken line in the I/O log: %s", line);
+            ret = -1;
+            break;
+        }
+
+        IoOp op;
+        op.type   = type;
+        op.offset = offset;
+        op.size   = size;
+        op.result = result;
+        ops->push_back(op);
+    }
+
+    fclose(fp);
+
+    return ret;
+}
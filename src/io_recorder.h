@@ -0,0 +1,40 @@
+#ifndef MT_IO_RECORDER_H
+#define MT_IO_RECORDER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "thumbnail_engine.h"
+
+// One call into the input. For seeks size is the whence.
+struct IoOp {
+    char    type;       // 'R'ead, 'S'eek or 'P'refetch
+    int64_t offset;
+    int64_t size;
+    int64_t result;
+};
+
+// Sits between the engine and the real input callbacks and keeps the exact
+// sequence of calls made during a run, so it can be written out and
+// replayed against a storage model later
+struct IoRecorder {
+    ThumbnailInput    inner;
+
+    // Where the next read starts, as far as we can tell
+    int64_t           pos;
+
+    std::vector<IoOp> ops;
+};
+
+void io_recorder_init(IoRecorder *recorder, const ThumbnailInput *inner);
+
+// Fills in an input whose calls go through the recorder to the inner one
+void io_recorder_input(IoRecorder *recorder, ThumbnailInput *input);
+
+// One call per line, "R offset size result". Returns < 0 on failure.
+int io_log_write(const std::vector<IoOp> &ops, const char *path);
+
+int io_log_read(const char *path, std::vector<IoOp> *ops);
+
+#endif /* MT_IO_RECORDER_H */
@@ -0,0 +1,133 @@
+#ifndef MT_LRU_CACHE_H
+#define MT_LRU_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+
+// What the result and packet caches have in common: values by string key,
+// least recently used ones dropped once their total size goes over the
+// limit. Values are copied in and out. Thread-safe.
+template <typename Value>
+struct LruCache {
+    typedef size_t (*SizeFunction)(const Value &value);
+
+    struct Entry {
+        std::string key;
+        Value       value;
+        size_t      size;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    // Most recently used entries live at the front
+    std::mutex                                  lock;
+    EntryList                                   entries;
+    std::map<std::string, typename EntryList::iterator> index;
+    SizeFunction                                size_of;
+    size_t                                      bytes;
+    size_t                                      limit;
+    uint64_t                                    lookups;
+    uint64_t                                    hits;
+
+    LruCache(SizeFunction size_function, size_t max_bytes)
+        : size_of(size_function), bytes(0), limit(max_bytes), lookups(0), hits(0)
+    {
+    }
+
+    void set_limit(size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        limit = max_bytes;
+        evict_to_limit();
+    }
+
+    bool get(const std::string &key, Value *value)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        lookups++;
+
+        typename std::map<std::string, typename EntryList::iterator>::iterator it = index.find(key);
+        if (it == index.end()) {
+            return false;
+        }
+
+        try {
+            *value = it->second->value;
+        } catch (const std::bad_alloc &) {
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, it->second);
+        hits++;
+
+        return true;
+    }
+
+    void put(const std::string &key, const Value &value)
+    {
+        size_t size = size_of(value);
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (size > limit) {
+            return;
+        }
+
+        try {
+            typename std::map<std::string, typename EntryList::iterator>::iterator it = index.find(key);
+            if (it != index.end()) {
+                it->second->value = value;
+                bytes -= it->second->size;
+                it->second->size = size;
+                entries.splice(entries.begin(), entries, it->second);
+            } else {
+                Entry entry;
+                entry.key   = key;
+                entry.value = value;
+                entry.size  = size;
+                entries.push_front(entry);
+
+                try {
+                    index[key] = entries.begin();
+                } catch (const std::bad_alloc &) {
+                    entries.pop_front();
+                    throw;
+                }
+            }
+        } catch (const std::bad_alloc &) {
+            // Not being able to cache something is not an error
+            return;
+        }
+
+        bytes += size;
+        evict_to_limit();
+    }
+
+    void get_stats(uint64_t *lookup_count, uint64_t *hit_count, uint64_t *entry_count, uint64_t *byte_count)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        *lookup_count = lookups;
+        *hit_count    = hits;
+        *entry_count  = entries.size();
+        *byte_count   = bytes;
+    }
+
+    // Must be called with the lock held
+    void evict_to_limit(void)
+    {
+        while (bytes > limit && !entries.empty()) {
+            Entry &victim = entries.back();
+            bytes -= victim.size;
+            index.erase(victim.key);
+            entries.pop_back();
+        }
+    }
+};
+
+#endif /* MT_LRU_CACHE_H */
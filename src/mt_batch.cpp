@@ -0,0 +1,475 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mt_batch.h"
+#include "pipeline_pool.h"
+#include "thumbnail_engine.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include "file_reader.h"
+}
+
+// The structs as version 1 of the header had them. These stay put when
+// fields are added, sizeof doesn't.
+#define MT_ITEM_V1_SIZE   (offsetof(mt_item, user_data) + sizeof(void *))
+#define MT_RESULT_V1_SIZE (offsetof(mt_result, elapsed_us) + sizeof(int64_t))
+
+// Used when the number of CPUs can't be found out
+#define MT_BATCH_DEFAULT_THREADS 4
+
+struct BatchItem {
+    uint64_t              id;
+    mt_item               item;
+    std::string           path;
+
+    // How much of an mt_result the caller knows about
+    size_t                result_size;
+
+    std::atomic<bool>     cancelled;
+
+    // What the engine reads from, the path's file or the caller's input
+    ThumbnailInput        source;
+
+    // BGRA without a buffer from the caller
+    std::vector<uint8_t>  pixels;
+
+    // Set by the allocator, for telling the caller what it needs
+    int                   stride;
+    bool                  too_small;
+};
+
+typedef std::shared_ptr<BatchItem> BatchItemPtr;
+
+struct mt_batch {
+    mt_completion_cb                  callback;
+    void                             *opaque;
+
+    std::mutex                        lock;
+    std::condition_variable           queue_cond;
+    std::condition_variable           idle_cond;
+    std::deque<BatchItemPtr>          queue;
+
+    // Everything queued or running, for cancelling and waiting
+    std::map<uint64_t, BatchItemPtr>  items;
+
+    uint64_t                          next_id;
+    bool                              quit;
+
+    std::vector<std::thread>          threads;
+};
+
+static const ThumbnailFormat formats[] = {
+    THUMBNAIL_FORMAT_BGRA,      // MT_FORMAT_BGRA
+    THUMBNAIL_FORMAT_JPEG,      // MT_FORMAT_JPEG
+    THUMBNAIL_FORMAT_PNG,       // MT_FORMAT_PNG
+    THUMBNAIL_FORMAT_WEBP,      // MT_FORMAT_WEBP
+};
+
+static const ThumbnailPolicy policies[] = {
+    THUMBNAIL_POLICY_FIRST,     // MT_POLICY_FIRST
+    THUMBNAIL_POLICY_PERCENT,   // MT_POLICY_PERCENT
+    THUMBNAIL_POLICY_CHAPTER,   // MT_POLICY_CHAPTER
+    THUMBNAIL_POLICY_TAG,       // MT_POLICY_TAG
+    THUMBNAIL_POLICY_AUTO,      // MT_POLICY_AUTO
+};
+
+static mt_policy policy_to_api(ThumbnailPolicy policy)
+{
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (policies[i] == policy) {
+            return (mt_policy)i;
+        }
+    }
+
+    return MT_POLICY_FIRST;
+}
+
+int MT_API mt_api_version(void)
+{
+    return MT_API_VERSION;
+}
+
+void MT_API mt_item_init(mt_item *item)
+{
+    memset(item, 0, sizeof(*item));
+    item->struct_size = sizeof(*item);
+    item->size_limit  = 256;
+    item->format      = MT_FORMAT_JPEG;
+    item->policy      = MT_POLICY_FIRST;
+}
+
+// A cancelled item's next read fails, which gets the engine out quickly
+static int cancellable_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    BatchItem *task = (BatchItem *)opaque;
+
+    if (task->cancelled) {
+        return AVERROR_EXIT;
+    }
+
+    return task->source.read_packet(task->source.opaque, buf, buf_size);
+}
+
+static int64_t cancellable_seek(void *opaque, int64_t offset, int whence)
+{
+    BatchItem *task = (BatchItem *)opaque;
+
+    if (task->cancelled) {
+        return AVERROR_EXIT;
+    }
+
+    return task->source.seek(task->source.opaque, offset, whence);
+}
+
+static int alloc_bgra(void *opaque, int width, int height, uint8_t **data, int *linesize)
+{
+    BatchItem *task = (BatchItem *)opaque;
+
+    if (task->item.output) {
+        task->stride = task->item.output_stride > 0 ? task->item.output_stride : width * 4;
+
+        if (task->stride < width * 4 || (size_t)task->stride * height > task->item.output_size) {
+            task->too_small = true;
+            return AVERROR(ENOSPC);
+        }
+
+        *data     = task->item.output;
+        *linesize = task->stride;
+        return 0;
+    }
+
+    task->stride = width * 4;
+
+    try {
+        task->pixels.resize((size_t)task->stride * height);
+    } catch (const std::bad_alloc &) {
+        return AVERROR(ENOMEM);
+    }
+
+    *data     = &task->pixels[0];
+    *linesize = task->stride;
+
+    return 0;
+}
+
+static void run_item(mt_batch *batch, BatchItem *task)
+{
+    mt_result result;
+    memset(&result, 0, sizeof(result));
+    result.struct_size = task->result_size;
+    result.id          = task->id;
+    result.user_data   = task->item.user_data;
+    result.policy_used = MT_POLICY_FIRST;
+    result.target_us   = AV_NOPTS_VALUE;
+
+    if (task->cancelled) {
+        result.status = MT_STATUS_CANCELLED;
+        batch->callback(batch->opaque, &result);
+        return;
+    }
+
+    int64_t start_time = av_gettime();
+
+    FileReader *file = nullptr;
+    if (!task->path.empty()) {
+        file = file_reader_open(task->path.c_str());
+        if (!file) {
+            result.status     = MT_STATUS_FAILED;
+            result.error      = AVERROR(ENOENT);
+            result.elapsed_us = av_gettime() - start_time;
+            batch->callback(batch->opaque, &result);
+            return;
+        }
+
+        task->source.opaque      = file;
+        task->source.read_packet = file_read_packet;
+        task->source.seek        = file_seek;
+    } else {
+        task->source.opaque      = task->item.input.opaque;
+        task->source.read_packet = task->item.input.read;
+        task->source.seek        = task->item.input.seek;
+    }
+    task->source.prefetch = nullptr;
+
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
+
+    request.input.opaque      = task;
+    request.input.read_packet = cancellable_read_packet;
+    request.input.seek        = task->source.seek ? cancellable_seek : nullptr;
+    request.size_limit        = task->item.size_limit;
+    request.format            = formats[task->item.format];
+    request.alloc_bgra        = alloc_bgra;
+    request.alloc_opaque      = task;
+    request.policy            = policies[task->item.policy];
+    request.policy_value      = task->item.policy_value;
+
+    ThumbnailResult engine_result;
+    int ret = thumbnail_generate(&request, &engine_result);
+
+    file_reader_close(file);
+
+    result.width       = engine_result.width;
+    result.height      = engine_result.height;
+    result.policy_used = policy_to_api(engine_result.policy_used);
+    result.target_us   = engine_result.target_us;
+
+    if (ret >= 0 && request.format == THUMBNAIL_FORMAT_BGRA) {
+        result.stride = task->stride;
+        result.data   = task->item.output ? task->item.output : &task->pixels[0];
+        result.size   = (size_t)task->stride * result.height;
+    } else if (ret >= 0 && task->item.output) {
+        result.size = engine_result.size;
+
+        if ((size_t)engine_result.size > task->item.output_size) {
+            ret = AVERROR(ENOSPC);
+            task->too_small = true;
+        } else {
+            memcpy(task->item.output, engine_result.data, engine_result.size);
+            result.data = task->item.output;
+        }
+    } else if (ret >= 0) {
+        result.data = engine_result.data;
+        result.size = engine_result.size;
+    }
+
+    if (ret >= 0) {
+        result.status = MT_STATUS_OK;
+    } else if (task->cancelled) {
+        result.status = MT_STATUS_CANCELLED;
+    } else if (task->too_small) {
+        result.status = MT_STATUS_BUFFER_TOO_SMALL;
+        if (request.format == THUMBNAIL_FORMAT_BGRA) {
+            result.stride = task->stride;
+            result.size   = (size_t)task->stride * result.height;
+        }
+    } else {
+        result.status = MT_STATUS_FAILED;
+        result.error  = ret;
+    }
+
+    result.elapsed_us = av_gettime() - start_time;
+
+    batch->callback(batch->opaque, &result);
+
+    // Without a caller buffer the data was only lent for the callback
+    av_free(engine_result.data);
+    std::vector<uint8_t>().swap(task->pixels);
+}
+
+static void worker_thread(mt_batch *batch)
+{
+    for (;;) {
+        BatchItemPtr task;
+
+        {
+            std::unique_lock<std::mutex> lock(batch->lock);
+            while (batch->queue.empty() && !batch->quit) {
+                batch->queue_cond.wait(lock);
+            }
+
+            // Quitting only once everything queued has had its callback
+            if (batch->queue.empty()) {
+                return;
+            }
+
+            task = batch->queue.front();
+            batch->queue.pop_front();
+        }
+
+        run_item(batch, task.get());
+
+        std::lock_guard<std::mutex> lock(batch->lock);
+        batch->items.erase(task->id);
+        if (batch->items.empty()) {
+            batch->idle_cond.notify_all();
+        }
+    }
+}
+
+mt_batch *MT_API mt_batch_create(int threads, mt_completion_cb callback, void *opaque)
+{
+    if (!callback) {
+        return NULL;
+    }
+
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+        if (threads <= 0) {
+            threads = MT_BATCH_DEFAULT_THREADS;
+        }
+    }
+
+    mt_batch *batch = new (std::nothrow) mt_batch;
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->callback = callback;
+    batch->opaque   = opaque;
+    batch->next_id  = 1;
+    batch->quit     = false;
+
+    pipeline_global_init();
+
+    try {
+        for (int i = 0; i < threads; i++) {
+            batch->threads.push_back(std::thread(worker_thread, batch));
+        }
+    } catch (const std::exception &) {
+        mt_batch_destroy(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+// A caller whose items are from an older header doesn't know about the
+// result fields added since either
+static size_t result_size_for(size_t item_size)
+{
+    return item_size < sizeof(mt_item) ? MT_RESULT_V1_SIZE : sizeof(mt_result);
+}
+
+static bool item_valid(const mt_item *item)
+{
+    return item->struct_size >= MT_ITEM_V1_SIZE &&
+           ((item->path && *item->path) || item->input.read) &&
+           item->size_limit > 0 &&
+           item->format >= 0 && (size_t)item->format < sizeof(formats) / sizeof(formats[0]) &&
+           item->policy >= 0 && (size_t)item->policy < sizeof(policies) / sizeof(policies[0]);
+}
+
+int MT_API mt_batch_submit(mt_batch *batch, const mt_item *items, int count, uint64_t *ids)
+{
+    if (count < 0 || (count && !items)) {
+        return AVERROR(EINVAL);
+    }
+
+    // The caller's items may be bigger or smaller than ours, depending on
+    // which header they were built with, so the array goes by their size
+    size_t item_size = count ? items[0].struct_size : 0;
+    if (count && item_size < MT_ITEM_V1_SIZE) {
+        return AVERROR(EINVAL);
+    }
+
+    std::vector<BatchItemPtr> tasks;
+
+    try {
+        for (int i = 0; i < count; i++) {
+            const mt_item *item = (const mt_item *)((const uint8_t *)items + item_size * i);
+            if (item->struct_size != item_size || !item_valid(item)) {
+                return AVERROR(EINVAL);
+            }
+
+            // Fields the caller doesn't know about keep their defaults
+            BatchItemPtr task = std::make_shared<BatchItem>();
+            mt_item_init(&task->item);
+            memcpy(&task->item, item, std::min(item_size, sizeof(task->item)));
+            task->item.struct_size = sizeof(task->item);
+            task->result_size      = result_size_for(item_size);
+            task->cancelled        = false;
+            task->stride           = 0;
+            task->too_small        = false;
+
+            if (item->path) {
+                task->path = item->path;
+            }
+            task->item.path = nullptr;
+
+            tasks.push_back(task);
+        }
+
+        std::lock_guard<std::mutex> lock(batch->lock);
+
+        for (size_t i = 0; i < tasks.size(); i++) {
+            tasks[i]->id = batch->next_id++;
+            batch->items[tasks[i]->id] = tasks[i];
+            batch->queue.push_back(tasks[i]);
+
+            if (ids) {
+                ids[i] = tasks[i]->id;
+            }
+        }
+    } catch (const std::bad_alloc &) {
+        return AVERROR(ENOMEM);
+    }
+
+    batch->queue_cond.notify_all();
+
+    return 0;
+}
+
+int MT_API mt_batch_cancel(mt_batch *batch, uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(batch->lock);
+
+    std::map<uint64_t, BatchItemPtr>::iterator it = batch->items.find(id);
+    if (it == batch->items.end()) {
+        return AVERROR(ENOENT);
+    }
+
+    it->second->cancelled = true;
+
+    return 0;
+}
+
+void MT_API mt_batch_wait(mt_batch *batch)
+{
+    std::unique_lock<std::mutex> lock(batch->lock);
+    while (!batch->items.empty()) {
+        batch->idle_cond.wait(lock);
+    }
+}
+
+void MT_API mt_batch_destroy(mt_batch *batch)
+{
+    if (!batch) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(batch->lock);
+
+        for (std::map<uint64_t, BatchItemPtr>::iterator it = batch->items.begin();
+             it != batch->items.end(); ++it) {
+            it->second->cancelled = true;
+        }
+
+        batch->quit = true;
+    }
+    batch->queue_cond.notify_all();
+
+    for (size_t i = 0; i < batch->threads.size(); i++) {
+        batch->threads[i].join();
+    }
+
+    delete batch;
+}
+
+void MT_API mt_strerror(int error, char *buf, size_t buf_size)
+{
+    if (!buf || !buf_size) {
+        return;
+    }
+
+    if (av_strerror(error, buf, buf_size) < 0) {
+        snprintf(buf, buf_size, "Unknown error %d", error);
+    }
+}
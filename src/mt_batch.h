@@ -0,0 +1,158 @@
+#ifndef MT_BATCH_H
+#define MT_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A plain C interface to the thumbnailer for embedding it in services,
+// exported from the DLL (see dll.def). Items are submitted in batches and
+// worked on by a pool of threads, and every item's result comes back through
+// the completion callback as soon as it's done, in whatever order that is.
+//
+// The structs only ever grow at the end. Set them up with the _init
+// functions so the library can tell how much of them the caller knows about.
+// Results are handed back with the struct_size of the mt_result from the
+// same header as the submitted items, fields past it aren't there.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define MT_API __cdecl
+#else
+#define MT_API
+#endif
+
+#define MT_API_VERSION 1
+
+typedef struct mt_batch mt_batch;
+
+typedef enum mt_format {
+    // Raw pixels, 4 bytes each in B, G, R, A order
+    MT_FORMAT_BGRA,
+    MT_FORMAT_JPEG,
+    MT_FORMAT_PNG,
+    MT_FORMAT_WEBP,
+} mt_format;
+
+// Same meanings as ThumbnailPolicy in thumbnail_engine.h
+typedef enum mt_policy {
+    MT_POLICY_FIRST,
+    MT_POLICY_PERCENT,
+    MT_POLICY_CHAPTER,
+    MT_POLICY_TAG,
+    MT_POLICY_AUTO,
+} mt_policy;
+
+typedef enum mt_status {
+    MT_STATUS_OK,
+    MT_STATUS_FAILED,
+    MT_STATUS_CANCELLED,
+
+    // The caller's output buffer was too small, the result says how much
+    // it would have needed
+    MT_STATUS_BUFFER_TOO_SMALL,
+} mt_status;
+
+// Where an item is read from, if not from a path. Same signatures as the
+// avio callbacks: read returns the number of bytes read or a negative error
+// (AVERROR_EOF, -541478725, at the end), seek takes the whence values of
+// fseek plus 0x10000 for asking for the size.
+typedef struct mt_input {
+    void    *opaque;
+    int     (*read)(void *opaque, uint8_t *buf, int buf_size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+} mt_input;
+
+typedef struct mt_item {
+    size_t          struct_size;
+
+    // Either a path or input.read. The path is copied on submission.
+    const char     *path;
+    mt_input        input;
+
+    // The longer side of the thumbnail
+    int             size_limit;
+    mt_format       format;
+    mt_policy       policy;
+    int             policy_value;
+
+    // Optional buffer owned by the caller to put the result in. For BGRA,
+    // output_stride is the distance between rows, 0 for width * 4. Without
+    // one, the result's data is only valid during the callback.
+    uint8_t        *output;
+    size_t          output_size;
+    int             output_stride;
+
+    // Handed back in the result as is
+    void           *user_data;
+} mt_item;
+
+typedef struct mt_result {
+    size_t          struct_size;
+
+    uint64_t        id;
+    void           *user_data;
+
+    mt_status       status;
+
+    // A negative AVERROR code when status is MT_STATUS_FAILED, see mt_strerror
+    int             error;
+
+    int             width;
+    int             height;
+
+    // BGRA only
+    int             stride;
+
+    // Points into the caller's buffer if one was given. size is what's
+    // needed when status is MT_STATUS_BUFFER_TOO_SMALL.
+    const uint8_t  *data;
+    size_t          size;
+
+    // The policy that picked the picture and when it's from, in microseconds.
+    // target_us is INT64_MIN for the first picture.
+    mt_policy       policy_used;
+    int64_t         target_us;
+
+    // Wall clock time spent on the item, not counting time spent queued
+    int64_t         elapsed_us;
+} mt_result;
+
+// Called from the worker threads, once for every submitted item, cancelled
+// ones included. Must not call mt_batch_destroy or mt_batch_wait.
+typedef void (*mt_completion_cb)(void *opaque, const mt_result *result);
+
+int MT_API mt_api_version(void);
+
+// Sets up the defaults: 256 pixels, JPEG, the first picture
+void MT_API mt_item_init(mt_item *item);
+
+// threads <= 0 for one per CPU. Returns NULL on failure.
+mt_batch *MT_API mt_batch_create(int threads, mt_completion_cb callback, void *opaque);
+
+// Queues count items, all set up with mt_item_init from the same header.
+// Their ids are written to ids if it isn't NULL. Returns 0 on success or a
+// negative AVERROR code, in which case none were queued.
+int MT_API mt_batch_submit(mt_batch *batch, const mt_item *items, int count, uint64_t *ids);
+
+// Items that haven't started yet are completed as cancelled without doing
+// anything, running ones stop at their next read. Returns 0 if the item was
+// still queued or running, a negative AVERROR code if it's done or unknown.
+int MT_API mt_batch_cancel(mt_batch *batch, uint64_t id);
+
+// Blocks until every item submitted so far has been completed
+void MT_API mt_batch_wait(mt_batch *batch);
+
+// Cancels whatever is left, waits for the running items and frees the batch
+void MT_API mt_batch_destroy(mt_batch *batch);
+
+// Describes an error code from a result or a call
+void MT_API mt_strerror(int error, char *buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MT_BATCH_H */
@@ -0,0 +1,60 @@
+#include "lru_cache.h"
+#include "packet_cache.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#define PACKET_CACHE_DEFAULT_LIMIT (32 * 1024 * 1024)
+
+static LruCache<CachedPackets> cache(cached_packets_size, PACKET_CACHE_DEFAULT_LIMIT);
+
+void cached_packets_init(CachedPackets *packets)
+{
+    packets->valid       = false;
+    packets->codec_id    = 0;
+    packets->codec_tag   = 0;
+    packets->width       = 0;
+    packets->height      = 0;
+    packets->pix_fmt     = -1;
+    packets->sar_num     = 0;
+    packets->sar_den     = 1;
+    packets->policy_used = THUMBNAIL_POLICY_FIRST;
+    packets->target_us   = AV_NOPTS_VALUE;
+    packets->extradata.clear();
+    packets->packets.clear();
+}
+
+size_t cached_packets_size(const CachedPackets &packets)
+{
+    size_t size = packets.extradata.size();
+    for (size_t i = 0; i < packets.packets.size(); i++) {
+        size += packets.packets[i].data.size();
+    }
+
+    return size;
+}
+
+void packet_cache_set_limit(size_t max_bytes)
+{
+    cache.set_limit(max_bytes);
+}
+
+bool packet_cache_get(const std::string &key, CachedPackets *packets)
+{
+    return cache.get(key, packets);
+}
+
+void packet_cache_put(const std::string &key, const CachedPackets &packets)
+{
+    if (!packets.valid) {
+        return;
+    }
+
+    cache.put(key, packets);
+}
+
+void packet_cache_get_stats(PacketCacheStats *stats)
+{
+    cache.get_stats(&stats->lookups, &stats->hits, &stats->entries, &stats->bytes);
+}
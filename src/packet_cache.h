@@ -0,0 +1,68 @@
+#ifndef MT_PACKET_CACHE_H
+#define MT_PACKET_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "thumbnail_engine.h"
+
+struct CachedPacket {
+    std::string data;
+    int64_t     pts;
+    int64_t     dts;
+    int         flags;
+};
+
+// The compressed packets a still was decoded from (the keyframe and whatever
+// the decoder wanted after it before giving the picture out) along with what
+// it takes to open a decoder for them. Any size or format can be made from
+// these with one decode and without reading the file again.
+struct CachedPackets {
+    // Set once the rest has been filled in
+    bool                        valid;
+
+    int                         codec_id;
+    uint32_t                    codec_tag;
+    int                         width;
+    int                         height;
+    int                         pix_fmt;
+    std::string                 extradata;
+
+    // The sample aspect ratio the picture was shown with
+    int                         sar_num;
+    int                         sar_den;
+
+    // What picked the picture, handed back in the result as is
+    ThumbnailPolicy             policy_used;
+    int64_t                     target_us;
+
+    std::vector<CachedPacket>   packets;
+};
+
+struct PacketCacheStats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+void cached_packets_init(CachedPackets *packets);
+
+// Packet data and extradata, what counts against the limit
+size_t cached_packets_size(const CachedPackets &packets);
+
+// Kept in memory next to the result cache but with its own limit, least
+// recently used ones are dropped once the total size goes over it. The keys
+// shouldn't include the output size or format. Thread-safe.
+void packet_cache_set_limit(size_t max_bytes);
+
+bool packet_cache_get(const std::string &key, CachedPackets *packets);
+
+void packet_cache_put(const std::string &key, const CachedPackets &packets);
+
+void packet_cache_get_stats(PacketCacheStats *stats);
+
+#endif /* MT_PACKET_CACHE_H */
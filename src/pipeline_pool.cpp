@@ -0,0 +1,412 @@
+#include <new>
+#include <list>
+#include <mutex>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pipeline_pool.h"
+#include "hdr_convert.h"
+#include "trace.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// How many idle contexts we keep around before freeing the least recently used ones.
+// Decoders carry their own frame pools, so keep fewer of those.
+#define POOL_MAX_IDLE_DECODERS 4
+#define POOL_MAX_IDLE_ENCODERS 4
+#define POOL_MAX_IDLE_SCALERS  16
+
+struct DecoderKey {
+    AVCodecID     codec_id;
+    unsigned int  codec_tag;
+    int           width;
+    int           height;
+    int           pix_fmt;
+    std::string   extradata;
+
+    bool operator==(const DecoderKey &other) const
+    {
+        return codec_id == other.codec_id && codec_tag == other.codec_tag &&
+               width == other.width && height == other.height &&
+               pix_fmt == other.pix_fmt && extradata == other.extradata;
+    }
+};
+
+struct EncoderKey {
+    AVCodecID codec_id;
+    int       width;
+    int       height;
+    int       pix_fmt;
+
+    bool operator==(const EncoderKey &other) const
+    {
+        return codec_id == other.codec_id && width == other.width &&
+               height == other.height && pix_fmt == other.pix_fmt;
+    }
+};
+
+struct ScalerKey {
+    int src_width;
+    int src_height;
+    int src_format;
+    int dst_width;
+    int dst_height;
+    int dst_format;
+    int flags;
+
+    bool operator==(const ScalerKey &other) const
+    {
+        return !memcmp(this, &other, sizeof(*this));
+    }
+};
+
+template <typename Key, typename Context>
+struct PoolEntry {
+    Key      key;
+    Context *context;
+    bool     in_use;
+};
+
+typedef PoolEntry<DecoderKey, AVCodecContext> DecoderEntry;
+typedef PoolEntry<EncoderKey, AVCodecContext> EncoderEntry;
+typedef PoolEntry<ScalerKey, SwsContext>      ScalerEntry;
+
+// Most recently released entries live at the front
+static std::mutex              pool_lock;
+static std::list<DecoderEntry> decoder_pool;
+static std::list<EncoderEntry> encoder_pool;
+static std::list<ScalerEntry>  scaler_pool;
+
+static std::once_flag          global_init_flag;
+
+static int lock_manager(void **mutex, enum AVLockOp op)
+{
+    switch (op) {
+    case AV_LOCK_CREATE:
+        *mutex = new (std::nothrow) std::mutex();
+        return *mutex ? 0 : 1;
+    case AV_LOCK_OBTAIN:
+        ((std::mutex *)*mutex)->lock();
+        return 0;
+    case AV_LOCK_RELEASE:
+        ((std::mutex *)*mutex)->unlock();
+        return 0;
+    case AV_LOCK_DESTROY:
+        delete (std::mutex *)*mutex;
+        *mutex = nullptr;
+        return 0;
+    }
+
+    return 1;
+}
+
+void pipeline_global_init(void)
+{
+    std::call_once(global_init_flag, []() {
+        // Register all formats etc.
+        av_register_all();
+
+        // avcodec_open2 is not thread-safe without a lock manager
+        if (av_lockmgr_register(lock_manager) < 0) {
+            fprintf(stderr, "Failed to register the lavc lock manager :<\n");
+        }
+
+        hdr_convert_init();
+    });
+}
+
+static DecoderKey make_decoder_key(const AVCodecContext *params)
+{
+    DecoderKey key;
+    key.codec_id  = params->codec_id;
+    key.codec_tag = params->codec_tag;
+    key.width     = params->width;
+    key.height    = params->height;
+    key.pix_fmt   = params->pix_fmt;
+
+    if (params->extradata && params->extradata_size > 0) {
+        key.extradata.assign((const char *)params->extradata, params->extradata_size);
+    }
+
+    return key;
+}
+
+// Frees idle entries beyond the limit, starting from the least recently used.
+// Must be called with pool_lock held.
+template <typename Entry, typename FreeFunc>
+static void trim_pool(std::list<Entry> &pool, size_t max_idle, FreeFunc free_context)
+{
+    size_t idle = 0;
+    for (typename std::list<Entry>::iterator it = pool.begin(); it != pool.end();) {
+        if (!it->in_use && ++idle > max_idle) {
+            free_context(it->context);
+            it = pool.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// avcodec_copy_context duplicates the extradata and such, which a plain
+// avcodec_close + av_free would leak
+static void free_codec_context(AVCodecContext *codec_context)
+{
+    avcodec_free_context(&codec_context);
+}
+
+static void free_scaler(SwsContext *swscale_context)
+{
+    sws_freeContext(swscale_context);
+}
+
+AVCodecContext *decoder_pool_acquire(const AVCodecContext *params, AVCodec *decoder)
+{
+    TRACE_SCOPE("decoder_pool_acquire");
+
+    DecoderKey key = make_decoder_key(params);
+
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        for (std::list<DecoderEntry>::iterator it = decoder_pool.begin(); it != decoder_pool.end(); ++it) {
+            if (!it->in_use && it->key == key) {
+                it->in_use = true;
+                return it->context;
+            }
+        }
+    }
+
+    // Nothing idle, open a new one outside of the pool lock
+    AVCodecContext *decoder_context = avcodec_alloc_context3(decoder);
+    if (!decoder_context) {
+        fprintf(stderr, "Failed to allocate a decoder context :<\n");
+        return nullptr;
+    }
+
+    int ret = avcodec_copy_context(decoder_context, params);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to copy the decoder parameters :<\n");
+        avcodec_free_context(&decoder_context);
+        return nullptr;
+    }
+
+    // We want to try them refcounted frames!
+    AVDictionary *avdict = nullptr;
+    ret = av_dict_set(&avdict, "refcounted_frames", "1", 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create an AVDict with the refcounted_frames set to 1\n");
+        free_codec_context(decoder_context);
+        return nullptr;
+    }
+
+    // Open ze decoder!
+    ret = avcodec_open2(decoder_context, decoder, &avdict);
+    av_dict_free(&avdict);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open video decoder\n");
+        free_codec_context(decoder_context);
+        return nullptr;
+    }
+
+    DecoderEntry entry = { key, decoder_context, true };
+
+    try {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        decoder_pool.push_front(entry);
+    } catch (const std::bad_alloc &) {
+        free_codec_context(decoder_context);
+        return nullptr;
+    }
+
+    return decoder_context;
+}
+
+void decoder_pool_release(AVCodecContext *decoder_context)
+{
+    if (!decoder_context) {
+        return;
+    }
+
+    // Drop any delayed frames and references so the next user starts clean
+    avcodec_flush_buffers(decoder_context);
+
+    std::lock_guard<std::mutex> lock(pool_lock);
+    for (std::list<DecoderEntry>::iterator it = decoder_pool.begin(); it != decoder_pool.end(); ++it) {
+        if (it->context == decoder_context) {
+            it->in_use = false;
+            decoder_pool.splice(decoder_pool.begin(), decoder_pool, it);
+            break;
+        }
+    }
+
+    trim_pool(decoder_pool, POOL_MAX_IDLE_DECODERS, free_codec_context);
+}
+
+// Thumbnails are small and written once, so favour encoding speed over size
+static void set_encoder_speed_options(AVCodecContext *encoder_context, AVDictionary **options)
+{
+    switch (encoder_context->codec_id) {
+    case AV_CODEC_ID_MJPEG:
+        // Fixed quantizer and the default Huffman tables, no optimization pass
+        encoder_context->flags |= CODEC_FLAG_QSCALE;
+        encoder_context->global_quality = FF_QP2LAMBDA * 4;
+        av_dict_set(options, "huffman", "default", 0);
+        break;
+    case AV_CODEC_ID_PNG:
+        // Fastest deflate level, no per-line filter search
+        encoder_context->compression_level = 1;
+        av_dict_set(options, "pred", "none", 0);
+        break;
+    case AV_CODEC_ID_WEBP:
+        // libwebp: method 0 is the fastest one
+        encoder_context->compression_level = 0;
+        av_dict_set(options, "quality", "75", 0);
+        av_dict_set(options, "preset", "picture", 0);
+        break;
+    default:
+        break;
+    }
+}
+
+AVCodecContext *encoder_pool_acquire(AVCodec *encoder, int width, int height, AVPixelFormat pix_fmt)
+{
+    TRACE_SCOPE("encoder_pool_acquire");
+
+    EncoderKey key;
+    key.codec_id = encoder->id;
+    key.width    = width;
+    key.height   = height;
+    key.pix_fmt  = pix_fmt;
+
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        for (std::list<EncoderEntry>::iterator it = encoder_pool.begin(); it != encoder_pool.end(); ++it) {
+            if (!it->in_use && it->key == key) {
+                it->in_use = true;
+                return it->context;
+            }
+        }
+    }
+
+    AVCodecContext *encoder_context = avcodec_alloc_context3(encoder);
+    if (!encoder_context) {
+        fprintf(stderr, "Failed to allocate an encoder context :<\n");
+        return nullptr;
+    }
+
+    encoder_context->width         = width;
+    encoder_context->height        = height;
+    encoder_context->pix_fmt       = pix_fmt;
+    encoder_context->time_base.num = 1;
+    encoder_context->time_base.den = 25;
+
+    // Options the encoder doesn't know about are simply left in the dictionary
+    AVDictionary *avdict = nullptr;
+    set_encoder_speed_options(encoder_context, &avdict);
+
+    int ret = avcodec_open2(encoder_context, encoder, &avdict);
+    av_dict_free(&avdict);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open the %s encoder :<\n", encoder->name);
+        free_codec_context(encoder_context);
+        return nullptr;
+    }
+
+    EncoderEntry entry = { key, encoder_context, true };
+
+    try {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        encoder_pool.push_front(entry);
+    } catch (const std::bad_alloc &) {
+        free_codec_context(encoder_context);
+        return nullptr;
+    }
+
+    return encoder_context;
+}
+
+void encoder_pool_release(AVCodecContext *encoder_context)
+{
+    if (!encoder_context) {
+        return;
+    }
+
+    // The still image encoders don't keep state between pictures
+    std::lock_guard<std::mutex> lock(pool_lock);
+    for (std::list<EncoderEntry>::iterator it = encoder_pool.begin(); it != encoder_pool.end(); ++it) {
+        if (it->context == encoder_context) {
+            it->in_use = false;
+            encoder_pool.splice(encoder_pool.begin(), encoder_pool, it);
+            break;
+        }
+    }
+
+    trim_pool(encoder_pool, POOL_MAX_IDLE_ENCODERS, free_codec_context);
+}
+
+SwsContext *scaler_pool_acquire(int src_width, int src_height, AVPixelFormat src_format,
+                                int dst_width, int dst_height, AVPixelFormat dst_format,
+                                int flags)
+{
+    TRACE_SCOPE("scaler_pool_acquire");
+
+    ScalerKey key;
+    memset(&key, 0, sizeof(key));
+    key.src_width  = src_width;
+    key.src_height = src_height;
+    key.src_format = src_format;
+    key.dst_width  = dst_width;
+    key.dst_height = dst_height;
+    key.dst_format = dst_format;
+    key.flags      = flags;
+
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        for (std::list<ScalerEntry>::iterator it = scaler_pool.begin(); it != scaler_pool.end(); ++it) {
+            if (!it->in_use && it->key == key) {
+                it->in_use = true;
+                return it->context;
+            }
+        }
+    }
+
+    SwsContext *swscale_context = sws_getContext(src_width, src_height, src_format,
+                                                 dst_width, dst_height, dst_format,
+                                                 flags, NULL, NULL, NULL);
+    if (!swscale_context) {
+        return nullptr;
+    }
+
+    ScalerEntry entry = { key, swscale_context, true };
+
+    try {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        scaler_pool.push_front(entry);
+    } catch (const std::bad_alloc &) {
+        sws_freeContext(swscale_context);
+        return nullptr;
+    }
+
+    return swscale_context;
+}
+
+void scaler_pool_release(SwsContext *swscale_context)
+{
+    if (!swscale_context) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(pool_lock);
+    for (std::list<ScalerEntry>::iterator it = scaler_pool.begin(); it != scaler_pool.end(); ++it) {
+        if (it->context == swscale_context) {
+            it->in_use = false;
+            scaler_pool.splice(scaler_pool.begin(), scaler_pool, it);
+            break;
+        }
+    }
+
+    trim_pool(scaler_pool, POOL_MAX_IDLE_SCALERS, free_scaler);
+}
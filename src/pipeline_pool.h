@@ -0,0 +1,34 @@
+#ifndef MT_PIPELINE_POOL_H
+#define MT_PIPELINE_POOL_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+// Registers formats/codecs and the lavc lock manager, only once per process
+void pipeline_global_init(void);
+
+// Hands out an opened decoder matching the parameters of the given
+// (demuxer-side) codec context, opening a new one if none is idle.
+// Returns nullptr on failure.
+AVCodecContext *decoder_pool_acquire(const AVCodecContext *params, AVCodec *decoder);
+
+// Flushes the decoder and gives it back to the pool
+void decoder_pool_release(AVCodecContext *decoder_context);
+
+// Hands out an opened encoder for pictures of the given size and format,
+// set up for speed rather than size. Returns nullptr on failure.
+AVCodecContext *encoder_pool_acquire(AVCodec *encoder, int width, int height, AVPixelFormat pix_fmt);
+
+void encoder_pool_release(AVCodecContext *encoder_context);
+
+// Hands out a swscale context for the given conversion, creating one
+// if none is idle. Returns nullptr on failure.
+SwsContext *scaler_pool_acquire(int src_width, int src_height, AVPixelFormat src_format,
+                                int dst_width, int dst_height, AVPixelFormat dst_format,
+                                int flags);
+
+void scaler_pool_release(SwsContext *swscale_context);
+
+#endif /* MT_PIPELINE_POOL_H */
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "prefetch_reader.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavformat/avio.h>
+}
+
+#define PREFETCH_BLOCK_SIZE   (128 * 1024)
+
+// Blocks queued past the one being read
+#define PREFETCH_READ_AHEAD   4
+
+// At most this many blocks (8 MiB) are kept around per reader
+#define PREFETCH_MAX_BLOCKS   64
+
+// Hints don't queue more than this many reads, reads lavf is waiting on always go out
+#define PREFETCH_QUEUE_DEPTH  32
+
+// Threads shared by all readers using the thread pool backend
+#define PREFETCH_POOL_THREADS 8
+
+struct Block {
+    int64_t   index;
+    uint8_t  *data;
+    int       size;
+    int       error;
+    bool      done;
+    uint64_t  last_used;
+};
+
+typedef std::map<int64_t, Block *> BlockMap;
+
+struct PrefetchReader {
+    int                      fd;
+    int64_t                  file_size;
+    int64_t                  position;
+    PrefetchBackend          backend;
+
+    std::mutex               lock;
+    std::condition_variable  block_done;
+    BlockMap                 blocks;
+    int                      inflight;
+    uint64_t                 use_counter;
+    PrefetchStats            stats;
+
+#ifdef HAVE_LIBURING
+    struct io_uring          ring;
+#endif
+};
+
+struct ReadTask {
+    PrefetchReader *reader;
+    Block          *block;
+};
+
+struct ReadPool {
+    std::mutex               lock;
+    std::condition_variable  cond;
+    std::deque<ReadTask>     tasks;
+};
+
+// Never freed, the pool threads are still waiting on it when the process exits
+static std::once_flag  pool_once;
+static ReadPool       *pool;
+
+static int block_length(const PrefetchReader *reader, int64_t index)
+{
+    int64_t remaining = reader->file_size - index * PREFETCH_BLOCK_SIZE;
+    return remaining < PREFETCH_BLOCK_SIZE ? (int)remaining : PREFETCH_BLOCK_SIZE;
+}
+
+// Reads the whole range unless the file ends first, returns the bytes read
+static int read_at(int fd, uint8_t *buf, int size, int64_t offset)
+{
+    int total = 0;
+
+    while (total < size) {
+#ifdef _WIN32
+        HANDLE handle = (HANDLE)_get_osfhandle(fd);
+        OVERLAPPED overlapped;
+        DWORD read_bytes = 0;
+
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)(offset + total);
+        overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+        if (!ReadFile(handle, buf + total, size - total, &read_bytes, &overlapped)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            return AVERROR(EIO);
+        }
+#else
+        ssize_t read_bytes = pread(fd, buf + total, size - total, offset + total);
+        if (read_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+#endif
+
+        if (!read_bytes) {
+            break;
+        }
+
+        total += (int)read_bytes;
+    }
+
+    return total;
+}
+
+static void complete_block(PrefetchReader *reader, Block *block, int ret)
+{
+    std::lock_guard<std::mutex> lock(reader->lock);
+
+    if (ret < 0) {
+        block->error = ret;
+    } else {
+        block->size = ret;
+        reader->stats.bytes += ret;
+    }
+
+    block->done = true;
+    reader->inflight--;
+    reader->block_done.notify_all();
+}
+
+static void pool_thread(void)
+{
+    for (;;) {
+        ReadTask task;
+
+        {
+            std::unique_lock<std::mutex> lock(pool->lock);
+            while (pool->tasks.empty()) {
+                pool->cond.wait(lock);
+            }
+
+            task = pool->tasks.front();
+            pool->tasks.pop_front();
+        }
+
+        Block *block = task.block;
+        int ret = read_at(task.reader->fd, block->data, block_length(task.reader, block->index),
+                          block->index * PREFETCH_BLOCK_SIZE);
+
+        complete_block(task.reader, block, ret);
+    }
+}
+
+static void pool_start(void)
+{
+    pool = new ReadPool;
+
+    for (int i = 0; i < PREFETCH_POOL_THREADS; i++) {
+        std::thread(pool_thread).detach();
+    }
+}
+
+#ifdef HAVE_LIBURING
+// Must be called from the thread using the reader, without reader->lock held
+static int uring_reap(PrefetchReader *reader)
+{
+    struct io_uring_cqe *cqe = nullptr;
+
+    int ret = 0;
+    do {
+        ret = io_uring_wait_cqe(&reader->ring, &cqe);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    Block *block = (Block *)io_uring_cqe_get_data(cqe);
+    int result = cqe->res;
+    io_uring_cqe_seen(&reader->ring, cqe);
+
+    // Regular files only come up short at the end, but finish it off just in case
+    int length = block_length(reader, block->index);
+    if (result > 0 && result < length) {
+        int rest = read_at(reader->fd, block->data + result, length - result,
+                           block->index * PREFETCH_BLOCK_SIZE + result);
+        result = rest < 0 ? rest : result + rest;
+    }
+
+    complete_block(reader, block, result);
+
+    return 0;
+}
+
+static int uring_submit(PrefetchReader *reader, Block *block)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&reader->ring);
+    if (!sqe) {
+        return AVERROR(EAGAIN);
+    }
+
+    io_uring_prep_read(sqe, reader->fd, block->data, block_length(reader, block->index),
+                       block->index * PREFETCH_BLOCK_SIZE);
+    io_uring_sqe_set_data(sqe, block);
+
+    int ret = io_uring_submit(&reader->ring);
+    return ret < 0 ? ret : 0;
+}
+#endif
+
+// Must be called with reader->lock held
+static void evict_blocks(PrefetchReader *reader)
+{
+    while (reader->blocks.size() >= PREFETCH_MAX_BLOCKS) {
+        BlockMap::iterator victim = reader->blocks.end();
+
+        for (BlockMap::iterator it = reader->blocks.begin(); it != reader->blocks.end(); ++it) {
+            if (it->second->done &&
+                (victim == reader->blocks.end() || it->second->last_used < victim->second->last_used)) {
+                victim = it;
+            }
+        }
+
+        // Everything is still in flight, go over the limit for a bit
+        if (victim == reader->blocks.end()) {
+            return;
+        }
+
+        av_free(victim->second->data);
+        delete victim->second;
+        reader->blocks.erase(victim);
+    }
+}
+
+// Must be called with reader->lock held. Returns the block whether it's done
+// or not, nullptr if it's past the end of the file or couldn't be queued.
+static Block *submit_block(PrefetchReader *reader, int64_t index, bool needed)
+{
+    if (index < 0 || index * PREFETCH_BLOCK_SIZE >= reader->file_size) {
+        return nullptr;
+    }
+
+    BlockMap::iterator it = reader->blocks.find(index);
+    if (it != reader->blocks.end()) {
+        return it->second;
+    }
+
+    if (!needed && reader->inflight >= PREFETCH_QUEUE_DEPTH) {
+        return nullptr;
+    }
+
+    evict_blocks(reader);
+
+    Block *block = new (std::nothrow) Block;
+    if (!block) {
+        return nullptr;
+    }
+
+    block->index     = index;
+    block->size      = 0;
+    block->error     = 0;
+    block->done      = false;
+    block->last_used = reader->use_counter;
+    block->data      = (uint8_t *)av_malloc(PREFETCH_BLOCK_SIZE);
+    if (!block->data) {
+        delete block;
+        return nullptr;
+    }
+
+#ifdef HAVE_LIBURING
+    if (reader->backend == PREFETCH_BACKEND_URING && uring_submit(reader, block) < 0) {
+        av_free(block->data);
+        delete block;
+        return nullptr;
+    }
+#endif
+
+    reader->blocks[index] = block;
+    reader->inflight++;
+    reader->stats.reads++;
+    if (reader->inflight > reader->stats.max_depth) {
+        reader->stats.max_depth = reader->inflight;
+    }
+
+    if (reader->backend == PREFETCH_BACKEND_THREADS) {
+        ReadTask task;
+        task.reader = reader;
+        task.block  = block;
+
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->tasks.push_back(task);
+        pool->cond.notify_one();
+    }
+
+    return block;
+}
+
+// Waits until either the block or every read in flight is done
+static void wait_for(PrefetchReader *reader, std::unique_lock<std::mutex> &lock, Block *block)
+{
+    while (block ? !block->done : reader->inflight > 0) {
+#ifdef HAVE_LIBURING
+        if (reader->backend == PREFETCH_BACKEND_URING) {
+            // Completions only get picked up by us, so go and get them
+            lock.unlock();
+            int ret = uring_reap(reader);
+            lock.lock();
+
+            // The kernel still owns the buffers, there's no way to back out of this
+            if (ret < 0) {
+                fprintf(stderr, "Failed to wait for io_uring completions :<\n");
+                abort();
+            }
+            continue;
+        }
+#endif
+        reader->block_done.wait(lock);
+    }
+}
+
+PrefetchReader *prefetch_reader_create(FileReader *file, PrefetchBackend backend)
+{
+    FileIdentity identity;
+    if (file_reader_identity(file, &identity) < 0) {
+        return nullptr;
+    }
+
+    PrefetchReader *reader = new (std::nothrow) PrefetchReader;
+    if (!reader) {
+        return nullptr;
+    }
+
+    reader->fd          = file_reader_fileno(file);
+    reader->file_size   = identity.size;
+    reader->position    = 0;
+    reader->inflight    = 0;
+    reader->use_counter = 0;
+    memset(&reader->stats, 0, sizeof(reader->stats));
+
+#ifdef HAVE_LIBURING
+    if (backend != PREFETCH_BACKEND_THREADS) {
+        if (io_uring_queue_init(PREFETCH_QUEUE_DEPTH * 2, &reader->ring, 0) >= 0) {
+            reader->backend = PREFETCH_BACKEND_URING;
+            return reader;
+        }
+
+        if (backend == PREFETCH_BACKEND_URING) {
+            fprintf(stderr, "Failed to set up io_uring :<\n");
+            delete reader;
+            return nullptr;
+        }
+    }
+#else
+    if (backend == PREFETCH_BACKEND_URING) {
+        fprintf(stderr, "Built without io_uring support :<\n");
+        delete reader;
+        return nullptr;
+    }
+#endif
+
+    std::call_once(pool_once, pool_start);
+    reader->backend = PREFETCH_BACKEND_THREADS;
+
+    return reader;
+}
+
+void prefetch_reader_close(PrefetchReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    {
+        // The pool threads and the ring still point at our blocks
+        std::unique_lock<std::mutex> lock(reader->lock);
+        wait_for(reader, lock, nullptr);
+    }
+
+    for (BlockMap::iterator it = reader->blocks.begin(); it != reader->blocks.end(); ++it) {
+        av_free(it->second->data);
+        delete it->second;
+    }
+
+#ifdef HAVE_LIBURING
+    if (reader->backend == PREFETCH_BACKEND_URING) {
+        io_uring_queue_exit(&reader->ring);
+    }
+#endif
+
+    delete reader;
+}
+
+const char *prefetch_reader_backend_name(const PrefetchReader *reader)
+{
+    return reader->backend == PREFETCH_BACKEND_URING ? "io_uring" : "threads";
+}
+
+void prefetch_reader_get_stats(PrefetchReader *reader, PrefetchStats *stats)
+{
+    std::lock_guard<std::mutex> lock(reader->lock);
+    *stats = reader->stats;
+}
+
+int prefetch_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    PrefetchReader *reader = (PrefetchReader *)opaque;
+    std::unique_lock<std::mutex> lock(reader->lock);
+
+    if (reader->position >= reader->file_size) {
+        return AVERROR_EOF;
+    }
+
+    int64_t index = reader->position / PREFETCH_BLOCK_SIZE;
+
+    Block *block = submit_block(reader, index, true);
+    if (!block) {
+        return AVERROR(ENOMEM);
+    }
+
+    // Mark it used before queueing the read-ahead so it isn't the one evicted
+    block->last_used = ++reader->use_counter;
+
+    for (int i = 1; i <= PREFETCH_READ_AHEAD; i++) {
+        submit_block(reader, index + i, false);
+    }
+
+    if (block->done) {
+        reader->stats.hits++;
+    } else {
+        reader->stats.waits++;
+        wait_for(reader, lock, block);
+    }
+
+    if (block->error < 0) {
+        return block->error;
+    }
+
+    int offset = (int)(reader->position - index * PREFETCH_BLOCK_SIZE);
+    if (offset >= block->size) {
+        // The file got shorter since we looked at it
+        return AVERROR_EOF;
+    }
+
+    int size = block->size - offset;
+    if (size > buf_size) {
+        size = buf_size;
+    }
+
+    memcpy(buf, block->data + offset, size);
+    reader->position += size;
+
+    return size;
+}
+
+int64_t prefetch_seek(void *opaque, int64_t offset, int whence)
+{
+    PrefetchReader *reader = (PrefetchReader *)opaque;
+    std::lock_guard<std::mutex> lock(reader->lock);
+
+    if (whence == AVSEEK_SIZE) {
+        return reader->file_size;
+    }
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += reader->position;
+        break;
+    case SEEK_END:
+        offset += reader->file_size;
+        break;
+    default:
+        return -1;
+    }
+
+    if (offset < 0) {
+        return -1;
+    }
+
+    reader->position = offset;
+
+    return offset;
+}
+
+void prefetch_hint(void *opaque, int64_t offset, int64_t size)
+{
+    PrefetchReader *reader = (PrefetchReader *)opaque;
+    std::lock_guard<std::mutex> lock(reader->lock);
+
+    if (offset < 0 || size <= 0) {
+        return;
+    }
+
+    int64_t first = offset / PREFETCH_BLOCK_SIZE;
+    int64_t last  = (offset + size - 1) / PREFETCH_BLOCK_SIZE;
+
+    for (int64_t index = first; index <= last; index++) {
+        // Past the end of the file, or the queue is full and the rest can wait
+        if (index * PREFETCH_BLOCK_SIZE >= reader->file_size ||
+            (!reader->blocks.count(index) && reader->inflight >= PREFETCH_QUEUE_DEPTH)) {
+            break;
+        }
+
+        Block *block = submit_block(reader, index, false);
+        if (block) {
+            block->last_used = reader->use_counter;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef MT_PREFETCH_READER_H
+#define MT_PREFETCH_READER_H
+
+#include <stdint.h>
+
+extern "C" {
+#include "file_reader.h"
+}
+
+// Reads a file in fixed size blocks that are requested ahead of time, so that
+// the I/O overlaps with demuxing and decoding instead of lavf blocking on
+// every read. On top of the sequential read-ahead, byte ranges we know we'll
+// need (the header, the Cues, the cluster we're going to decode) can be
+// hinted and get queued right away.
+//
+// Blocks are read with io_uring when built with HAVE_LIBURING (link with
+// -luring) and the kernel supports it, and with pread on a small shared
+// thread pool otherwise.
+//
+// A reader must only be used by one thread at a time, which is how lavf uses
+// its IO callbacks anyway. Handing it over to another thread is fine.
+struct PrefetchReader;
+
+enum PrefetchBackend {
+    // io_uring if available, the thread pool otherwise
+    PREFETCH_BACKEND_AUTO,
+    PREFETCH_BACKEND_URING,
+    PREFETCH_BACKEND_THREADS,
+};
+
+struct PrefetchStats {
+    uint64_t reads;      // block reads submitted
+    uint64_t bytes;      // bytes those reads brought in
+    uint64_t hits;       // reads that found their block already there
+    uint64_t waits;      // reads that had to wait for the block
+    int      max_depth;  // most block reads in flight at once
+};
+
+// Doesn't take ownership of the file, it has to stay open until the reader is closed.
+// Returns nullptr if the backend can't be set up.
+PrefetchReader *prefetch_reader_create(FileReader *file, PrefetchBackend backend);
+
+// Waits for the reads still in flight before freeing everything
+void prefetch_reader_close(PrefetchReader *reader);
+
+const char *prefetch_reader_backend_name(const PrefetchReader *reader);
+
+void prefetch_reader_get_stats(PrefetchReader *reader, PrefetchStats *stats);
+
+// avio callbacks, opaque is the PrefetchReader
+int prefetch_read_packet(void *opaque, uint8_t *buf, int buf_size);
+
+int64_t prefetch_seek(void *opaque, int64_t offset, int whence);
+
+// Starts reading a byte range in the background, for ThumbnailInput.prefetch
+void prefetch_hint(void *opaque, int64_t offset, int64_t size);
+
+#endif /* MT_PREFETCH_READER_H */
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "probe_index.h"
+
+#ifdef _WIN32
+#include <process.h>
+#include <windows.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+static const char probe_index_magic[4] = { 'M', 'T', 'P', 'I' };
+
+static std::string             index_dir;
+static std::atomic<unsigned>   temp_counter;
+
+void probe_index_init(ProbeIndex *index)
+{
+    index->valid         = false;
+    memset(&index->identity, 0, sizeof(index->identity));
+    index->stream_index  = -1;
+    index->codec_id      = AV_CODEC_ID_NONE;
+    index->codec_tag     = 0;
+    index->width         = 0;
+    index->height        = 0;
+    index->pix_fmt       = AV_PIX_FMT_NONE;
+    index->sar_num       = 0;
+    index->sar_den       = 1;
+    index->time_base_num = 0;
+    index->time_base_den = 1;
+    index->start_time    = AV_NOPTS_VALUE;
+    index->duration      = AV_NOPTS_VALUE;
+    index->crop_known    = false;
+    index->crop_left     = 0;
+    index->crop_top      = 0;
+    index->crop_right    = 0;
+    index->crop_bottom   = 0;
+    index->dirty         = false;
+    index->extradata.clear();
+    index->keyframes.clear();
+}
+
+void probe_index_from_stream(ProbeIndex *index, AVFormatContext *lavf_context, int stream_index)
+{
+    AVStream       *stream = lavf_context->streams[stream_index];
+    AVCodecContext *codec  = stream->codec;
+
+    index->stream_index  = stream_index;
+    index->codec_id      = codec->codec_id;
+    index->codec_tag     = codec->codec_tag;
+    index->width         = codec->width;
+    index->height        = codec->height;
+    index->pix_fmt       = codec->pix_fmt;
+    index->sar_num       = stream->sample_aspect_ratio.num;
+    index->sar_den       = stream->sample_aspect_ratio.den;
+    index->time_base_num = stream->time_base.num;
+    index->time_base_den = stream->time_base.den;
+    index->start_time    = stream->start_time;
+    index->duration      = stream->duration;
+    index->crop_known    = false;
+
+    index->extradata.assign(codec->extradata, codec->extradata + (codec->extradata ? codec->extradata_size : 0));
+
+    // Keep every keyframe or an even spread of them if there are too many
+    index->keyframes.clear();
+
+    int count = stream->nb_index_entries;
+    int step  = count > PROBE_INDEX_MAX_KEYFRAMES ? (count + PROBE_INDEX_MAX_KEYFRAMES - 1) / PROBE_INDEX_MAX_KEYFRAMES : 1;
+
+    for (int i = 0; i < count; i += step) {
+        const AVIndexEntry *entry = &stream->index_entries[i];
+        if (!(entry->flags & AVINDEX_KEYFRAME)) {
+            continue;
+        }
+
+        ProbeKeyframe keyframe;
+        keyframe.timestamp = entry->timestamp;
+        keyframe.pos       = entry->pos;
+        index->keyframes.push_back(keyframe);
+    }
+
+    index->valid = true;
+}
+
+void probe_index_to_stream(const ProbeIndex *index, AVFormatContext *lavf_context)
+{
+    AVStream  *stream      = lavf_context->streams[index->stream_index];
+    AVRational time_base   = { index->time_base_num, index->time_base_den };
+    AVRational time_base_q = { 1, AV_TIME_BASE };
+
+    if (time_base.num <= 0) {
+        return;
+    }
+
+    // The demuxer leaves the start time alone, it's worked out from the first
+    // packets. The duration may already be there from the Segment Info.
+    if (index->start_time != AV_NOPTS_VALUE) {
+        stream->start_time       = av_rescale_q(index->start_time, time_base, stream->time_base);
+        lavf_context->start_time = av_rescale_q(index->start_time, time_base, time_base_q);
+    }
+
+    if (index->duration != AV_NOPTS_VALUE) {
+        if (stream->duration == AV_NOPTS_VALUE) {
+            stream->duration = av_rescale_q(index->duration, time_base, stream->time_base);
+        }
+        if (lavf_context->duration == AV_NOPTS_VALUE) {
+            lavf_context->duration = av_rescale_q(index->duration, time_base, time_base_q);
+        }
+    }
+}
+
+int probe_index_to_codec_context(const ProbeIndex *index, AVCodecContext *codec_context)
+{
+    codec_context->codec_type = AVMEDIA_TYPE_VIDEO;
+    codec_context->codec_id   = (AVCodecID)index->codec_id;
+    codec_context->codec_tag  = index->codec_tag;
+    codec_context->width      = index->width;
+    codec_context->height     = index->height;
+    codec_context->pix_fmt    = (AVPixelFormat)index->pix_fmt;
+
+    codec_context->sample_aspect_ratio.num = index->sar_num;
+    codec_context->sample_aspect_ratio.den = index->sar_den;
+
+    av_freep(&codec_context->extradata);
+    codec_context->extradata_size = 0;
+
+    if (!index->extradata.empty()) {
+        codec_context->extradata = (uint8_t *)av_mallocz(index->extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!codec_context->extradata) {
+            return AVERROR(ENOMEM);
+        }
+
+        memcpy(codec_context->extradata, &index->extradata[0], index->extradata.size());
+        codec_context->extradata_size = (int)index->extradata.size();
+    }
+
+    return 0;
+}
+
+void probe_index_set_dir(const std::string &dir)
+{
+    index_dir = dir;
+}
+
+static std::string index_path(const FileIdentity *identity)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%llx-%llx.idx",
+             (unsigned long long)identity->device, (unsigned long long)identity->inode);
+
+    return index_dir + name;
+}
+
+// Everything is stored little endian, whatever we're running on
+static void put_u32(std::string *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out->push_back((char)(value >> (8 * i)));
+    }
+}
+
+static void put_u64(std::string *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        out->push_back((char)(value >> (8 * i)));
+    }
+}
+
+struct IndexReader {
+    const uint8_t *data;
+    size_t         size;
+    size_t         pos;
+    bool           ok;
+};
+
+static uint64_t get_bytes(IndexReader *reader, int count)
+{
+    uint64_t value = 0;
+
+    if (reader->size - reader->pos < (size_t)count) {
+        reader->ok = false;
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        value |= (uint64_t)reader->data[reader->pos++] << (8 * i);
+    }
+
+    return value;
+}
+
+static uint32_t get_u32(IndexReader *reader)
+{
+    return (uint32_t)get_bytes(reader, 4);
+}
+
+static uint64_t get_u64(IndexReader *reader)
+{
+    return get_bytes(reader, 8);
+}
+
+static bool read_file(const std::string &path, std::string *data)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    char buf[16384];
+    size_t read_bytes;
+    while ((read_bytes = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data->append(buf, read_bytes);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    return ok;
+}
+
+bool probe_index_load(const FileIdentity *identity, ProbeIndex *index)
+{
+    probe_index_init(index);
+
+    if (index_dir.empty()) {
+        return false;
+    }
+
+    std::string data;
+    if (!read_file(index_path(identity), &data) || data.size() < 8 ||
+        memcmp(data.data(), probe_index_magic, 4)) {
+        return false;
+    }
+
+    IndexReader reader;
+    reader.data = (const uint8_t *)data.data();
+    reader.size = data.size();
+    reader.pos  = 4;
+    reader.ok   = true;
+
+    if (get_u32(&reader) != PROBE_INDEX_VERSION) {
+        return false;
+    }
+
+    index->identity.device = get_u64(&reader);
+    index->identity.inode  = get_u64(&reader);
+    index->identity.size   = (int64_t)get_u64(&reader);
+    index->identity.mtime  = (int64_t)get_u64(&reader);
+
+    // Same name, but the file was replaced or changed since
+    if (memcmp(&index->identity, identity, sizeof(*identity))) {
+        return false;
+    }
+
+    index->stream_index  = (int)get_u32(&reader);
+    index->codec_id      = (int)get_u32(&reader);
+    index->codec_tag     = get_u32(&reader);
+    index->width         = (int)get_u32(&reader);
+    index->height        = (int)get_u32(&reader);
+    index->pix_fmt       = (int)get_u32(&reader);
+    index->sar_num       = (int)get_u32(&reader);
+    index->sar_den       = (int)get_u32(&reader);
+    index->time_base_num = (int)get_u32(&reader);
+    index->time_base_den = (int)get_u32(&reader);
+    index->start_time    = (int64_t)get_u64(&reader);
+    index->duration      = (int64_t)get_u64(&reader);
+    index->crop_known    = get_u32(&reader) != 0;
+    index->crop_left     = (int)get_u32(&reader);
+    index->crop_top      = (int)get_u32(&reader);
+    index->crop_right    = (int)get_u32(&reader);
+    index->crop_bottom   = (int)get_u32(&reader);
+
+    uint32_t extradata_size = get_u32(&reader);
+    if (!reader.ok || extradata_size > reader.size - reader.pos) {
+        return false;
+    }
+    index->extradata.assign(reader.data + reader.pos, reader.data + reader.pos + extradata_size);
+    reader.pos += extradata_size;
+
+    uint32_t keyframe_count = get_u32(&reader);
+    if (!reader.ok || keyframe_count > PROBE_INDEX_MAX_KEYFRAMES ||
+        keyframe_count * 16 != reader.size - reader.pos) {
+        return false;
+    }
+
+    index->keyframes.resize(keyframe_count);
+    for (uint32_t i = 0; i < keyframe_count; i++) {
+        index->keyframes[i].timestamp = (int64_t)get_u64(&reader);
+        index->keyframes[i].pos       = (int64_t)get_u64(&reader);
+    }
+
+    if (!reader.ok || index->stream_index < 0 || index->time_base_den <= 0) {
+        return false;
+    }
+
+    index->valid = true;
+
+    return true;
+}
+
+int probe_index_store(const ProbeIndex *index)
+{
+    if (index_dir.empty() || !index->valid) {
+        return 0;
+    }
+
+    std::string data(probe_index_magic, sizeof(probe_index_magic));
+    put_u32(&data, PROBE_INDEX_VERSION);
+
+    put_u64(&data, index->identity.device);
+    put_u64(&data, index->identity.inode);
+    put_u64(&data, (uint64_t)index->identity.size);
+    put_u64(&data, (uint64_t)index->identity.mtime);
+
+    put_u32(&data, (uint32_t)index->stream_index);
+    put_u32(&data, (uint32_t)index->codec_id);
+    put_u32(&data, index->codec_tag);
+    put_u32(&data, (uint32_t)index->width);
+    put_u32(&data, (uint32_t)index->height);
+    put_u32(&data, (uint32_t)index->pix_fmt);
+    put_u32(&data, (uint32_t)index->sar_num);
+    put_u32(&data, (uint32_t)index->sar_den);
+    put_u32(&data, (uint32_t)index->time_base_num);
+    put_u32(&data, (uint32_t)index->time_base_den);
+    put_u64(&data, (uint64_t)index->start_time);
+    put_u64(&data, (uint64_t)index->duration);
+    put_u32(&data, index->crop_known ? 1 : 0);
+    put_u32(&data, (uint32_t)index->crop_left);
+    put_u32(&data, (uint32_t)index->crop_top);
+    put_u32(&data, (uint32_t)index->crop_right);
+    put_u32(&data, (uint32_t)index->crop_bottom);
+
+    put_u32(&data, (uint32_t)index->extradata.size());
+    data.append(index->extradata.begin(), index->extradata.end());
+
+    put_u32(&data, (uint32_t)index->keyframes.size());
+    for (size_t i = 0; i < index->keyframes.size(); i++) {
+        put_u64(&data, (uint64_t)index->keyframes[i].timestamp);
+        put_u64(&data, (uint64_t)index->keyframes[i].pos);
+    }
+
+    // Readers never see a half written index
+    std::string path = index_path(&index->identity);
+
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), (unsigned)temp_counter++);
+    std::string temp_path = path + suffix;
+
+    FILE *fp = fopen(temp_path.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to create %s :<\n", temp_path.c_str());
+        return -1;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = !fclose(fp) && ok;
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && !rename(temp_path.c_str(), path.c_str());
+#endif
+
+    if (!ok) {
+        remove(temp_path.c_str());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef MT_PROBE_INDEX_H
+#define MT_PROBE_INDEX_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "file_reader.h"
+}
+
+struct AVFormatContext;
+struct AVCodecContext;
+
+#define PROBE_INDEX_VERSION       2
+
+// Keyframes beyond this aren't stored, the table is for picking a seek target
+// and doesn't need every one of them in a three hour file
+#define PROBE_INDEX_MAX_KEYFRAMES 4096
+
+struct ProbeKeyframe {
+    int64_t timestamp;  // in the stream time base
+    int64_t pos;        // byte offset of the cluster
+};
+
+// What probing a file found out, kept in a cache directory so that later
+// requests can skip avformat_find_stream_info and av_find_best_stream and
+// go straight to the keyframe they want
+struct ProbeIndex {
+    // Set once the rest has been filled in, by probing or by loading
+    bool                        valid;
+
+    FileIdentity                identity;
+
+    int                         stream_index;
+    int                         codec_id;
+    uint32_t                    codec_tag;
+    int                         width;
+    int                         height;
+    int                         pix_fmt;
+    int                         sar_num;
+    int                         sar_den;
+    int                         time_base_num;
+    int                         time_base_den;
+    int64_t                     start_time;
+    int64_t                     duration;
+
+    // Black bars found on a picture of the stream, in luma samples.
+    // crop_known is false until a picture that could tell was decoded.
+    bool                        crop_known;
+    int                         crop_left;
+    int                         crop_top;
+    int                         crop_right;
+    int                         crop_bottom;
+
+    std::vector<uint8_t>        extradata;
+    std::vector<ProbeKeyframe>  keyframes;
+
+    // Set when the engine learned something the loaded index didn't have
+    // (so far only the crop), so it's worth storing again. Not stored.
+    bool                        dirty;
+};
+
+void probe_index_init(ProbeIndex *index);
+
+// Fills the index in from an opened and probed file
+void probe_index_from_stream(ProbeIndex *index, AVFormatContext *lavf_context, int stream_index);
+
+// Puts the stored start time and duration back on the stream and the format
+// context, which find_stream_info would otherwise have filled in
+void probe_index_to_stream(const ProbeIndex *index, AVFormatContext *lavf_context);
+
+// Puts the stored codec parameters into a context for opening a decoder with.
+// The extradata is copied, the caller frees it as usual.
+int probe_index_to_codec_context(const ProbeIndex *index, AVCodecContext *codec_context);
+
+// Files are named after the device and inode and checked against the full
+// identity (size and mtime as well) when loading. An empty directory turns
+// the whole thing off.
+void probe_index_set_dir(const std::string &dir);
+
+// Returns false if there's no index for the file or it's stale or broken
+bool probe_index_load(const FileIdentity *identity, ProbeIndex *index);
+
+// Written to a temporary file and renamed over the old one. Returns < 0 on failure.
+int probe_index_store(const ProbeIndex *index);
+
+#endif /* MT_PROBE_INDEX_H */
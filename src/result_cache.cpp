@@ -0,0 +1,31 @@
+#include "lru_cache.h"
+#include "result_cache.h"
+
+#define RESULT_CACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+static size_t thumbnail_size(const CachedThumbnail &thumbnail)
+{
+    return thumbnail.data.size();
+}
+
+static LruCache<CachedThumbnail> cache(thumbnail_size, RESULT_CACHE_DEFAULT_LIMIT);
+
+void result_cache_set_limit(size_t max_bytes)
+{
+    cache.set_limit(max_bytes);
+}
+
+bool result_cache_get(const std::string &key, CachedThumbnail *thumbnail)
+{
+    return cache.get(key, thumbnail);
+}
+
+void result_cache_put(const std::string &key, const CachedThumbnail &thumbnail)
+{
+    cache.put(key, thumbnail);
+}
+
+void result_cache_get_stats(ResultCacheStats *stats)
+{
+    cache.get_stats(&stats->lookups, &stats->hits, &stats->entries, &stats->bytes);
+}
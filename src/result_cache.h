@@ -0,0 +1,32 @@
+#ifndef MT_RESULT_CACHE_H
+#define MT_RESULT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+struct CachedThumbnail {
+    int         width;
+    int         height;
+    std::string data;
+};
+
+struct ResultCacheStats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+// Finished thumbnails kept in memory, least recently used ones are dropped
+// once the total size goes over the limit. Thread-safe.
+void result_cache_set_limit(size_t max_bytes);
+
+bool result_cache_get(const std::string &key, CachedThumbnail *thumbnail);
+
+void result_cache_put(const std::string &key, const CachedThumbnail &thumbnail);
+
+void result_cache_get_stats(ResultCacheStats *stats);
+
+#endif /* MT_RESULT_CACHE_H */
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "shm_ring.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SHM_RING_MAGIC   0x5253544d  // "MTSR"
+#define SHM_RING_VERSION 1
+
+// Slots start on page boundaries
+#define SHM_RING_PAGE    4096
+
+// At the very start of the mapping, followed by the slot headers and then,
+// from data_offset on, the slots themselves
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t data_offset;
+    uint64_t slot_size;
+};
+
+struct ShmSlot {
+    std::atomic<uint32_t> generation;
+    std::atomic<uint32_t> pins;
+    int32_t               width;
+    int32_t               height;
+    int32_t               stride;
+    int32_t               reserved;
+};
+
+struct ShmRing {
+    std::string            name;
+    bool                   owner;
+
+    uint8_t               *base;
+    size_t                 size;
+#ifdef _WIN32
+    HANDLE                 mapping;
+#endif
+
+    ShmRingHeader         *header;
+    ShmSlot               *slots;
+
+    // Daemon side, where to start looking for a free slot next
+    std::atomic<uint32_t>  next;
+};
+
+static size_t align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static void unmap(ShmRing *ring)
+{
+    if (!ring->base) {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(ring->base);
+    CloseHandle(ring->mapping);
+#else
+    munmap(ring->base, ring->size);
+    if (ring->owner) {
+        shm_unlink(ring->name.c_str());
+    }
+#endif
+    ring->base = nullptr;
+}
+
+// Creates or opens the mapping and sets base and size. size is only used
+// when creating.
+static bool map(ShmRing *ring, size_t size)
+{
+#ifdef _WIN32
+    if (ring->owner) {
+        ring->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                           (DWORD)((uint64_t)size >> 32), (DWORD)size,
+                                           ring->name.c_str());
+        if (ring->mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(ring->mapping);
+            ring->mapping = NULL;
+        }
+    } else {
+        ring->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, ring->name.c_str());
+    }
+    if (!ring->mapping) {
+        return false;
+    }
+
+    ring->base = (uint8_t *)MapViewOfFile(ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, ring->owner ? size : 0);
+    if (!ring->base) {
+        CloseHandle(ring->mapping);
+        return false;
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+    ring->size = VirtualQuery(ring->base, &info, sizeof(info)) ? info.RegionSize : size;
+#else
+    int fd = ring->owner ? shm_open(ring->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)
+                         : shm_open(ring->name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (ring->owner) {
+        if (ftruncate(fd, (off_t)size) < 0) {
+            close(fd);
+            shm_unlink(ring->name.c_str());
+            return false;
+        }
+    } else {
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        if (ring->owner) {
+            shm_unlink(ring->name.c_str());
+        }
+        return false;
+    }
+
+    ring->base = (uint8_t *)base;
+    ring->size = size;
+#endif
+
+    return true;
+}
+
+ShmRing *shm_ring_create(int slot_count, size_t slot_size)
+{
+    if (slot_count <= 0 || slot_size == 0) {
+        return nullptr;
+    }
+
+    ShmRing *ring = new (std::nothrow) ShmRing;
+    if (!ring) {
+        return nullptr;
+    }
+
+    char name[64];
+#ifdef _WIN32
+    snprintf(name, sizeof(name), "Local\\matroska_thumbnailer.%lu", (unsigned long)GetCurrentProcessId());
+#else
+    snprintf(name, sizeof(name), "/matroska_thumbnailer.%ld", (long)getpid());
+#endif
+
+    ring->name  = name;
+    ring->owner = true;
+    ring->base  = nullptr;
+    ring->next  = 0;
+
+    slot_size = align_up(slot_size, SHM_RING_PAGE);
+
+    size_t data_offset = align_up(sizeof(ShmRingHeader) + slot_count * sizeof(ShmSlot), SHM_RING_PAGE);
+    size_t size        = data_offset + slot_count * slot_size;
+
+    if (!map(ring, size)) {
+        fprintf(stderr, "Failed to create the shared memory ring %s :<\n", name);
+        delete ring;
+        return nullptr;
+    }
+
+    ring->header = (ShmRingHeader *)ring->base;
+    ring->slots  = (ShmSlot *)(ring->base + sizeof(ShmRingHeader));
+
+    for (int i = 0; i < slot_count; i++) {
+        ShmSlot *slot = new (&ring->slots[i]) ShmSlot;
+        slot->generation = 0;
+        slot->pins       = 0;
+        slot->width      = 0;
+        slot->height     = 0;
+        slot->stride     = 0;
+        slot->reserved   = 0;
+    }
+
+    ring->header->version     = SHM_RING_VERSION;
+    ring->header->slot_count  = slot_count;
+    ring->header->data_offset = (uint32_t)data_offset;
+    ring->header->slot_size   = slot_size;
+
+    // Last, so that a client never sees a half set up header as valid
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->header->magic       = SHM_RING_MAGIC;
+
+    return ring;
+}
+
+ShmRing *shm_ring_open(const char *name)
+{
+    ShmRing *ring = new (std::nothrow) ShmRing;
+    if (!ring) {
+        return nullptr;
+    }
+
+    ring->name  = name;
+    ring->owner = false;
+    ring->base  = nullptr;
+    ring->next  = 0;
+
+    if (!map(ring, 0)) {
+        fprintf(stderr, "Failed to open the shared memory ring %s :<\n", name);
+        delete ring;
+        return nullptr;
+    }
+
+    ring->header = (ShmRingHeader *)ring->base;
+    ring->slots  = (ShmSlot *)(ring->base + sizeof(ShmRingHeader));
+
+    const ShmRingHeader *header = ring->header;
+    if (ring->size < sizeof(ShmRingHeader) || header->magic != SHM_RING_MAGIC ||
+        header->version != SHM_RING_VERSION || !header->slot_count ||
+        header->data_offset < sizeof(ShmRingHeader) + header->slot_count * sizeof(ShmSlot) ||
+        header->data_offset + header->slot_count * header->slot_size > ring->size) {
+        fprintf(stderr, "%s isn't a shared memory ring we know :<\n", name);
+        shm_ring_close(ring);
+        return nullptr;
+    }
+
+    return ring;
+}
+
+void shm_ring_close(ShmRing *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    unmap(ring);
+    delete ring;
+}
+
+void shm_ring_unlink(const ShmRing *ring)
+{
+#ifndef _WIN32
+    if (ring->owner) {
+        shm_unlink(ring->name.c_str());
+    }
+#endif
+}
+
+const char *shm_ring_name(const ShmRing *ring)
+{
+    return ring->name.c_str();
+}
+
+size_t shm_ring_slot_size(const ShmRing *ring)
+{
+    return (size_t)ring->header->slot_size;
+}
+
+int shm_ring_claim(ShmRing *ring)
+{
+    uint32_t count = ring->header->slot_count;
+    uint32_t start = ring->next++;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int      index = (int)((start + i) % count);
+        ShmSlot *slot  = &ring->slots[index];
+
+        // Odd means another worker is writing it
+        uint32_t generation = slot->generation.load();
+        if ((generation & 1) || slot->pins.load()) {
+            continue;
+        }
+
+        if (!slot->generation.compare_exchange_strong(generation, generation + 1)) {
+            continue;
+        }
+
+        // A client may have pinned it in between. Either it sees the odd
+        // generation and lets go, or we see its pin here and leave the slot
+        // as it was.
+        if (slot->pins.load()) {
+            slot->generation.store(generation);
+            continue;
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+uint8_t *shm_ring_slot_data(ShmRing *ring, int slot)
+{
+    return ring->base + ring->header->data_offset + (size_t)slot * ring->header->slot_size;
+}
+
+uint32_t shm_ring_publish(ShmRing *ring, int slot, const ShmSlotInfo *info)
+{
+    ShmSlot *s = &ring->slots[slot];
+
+    s->width  = info->width;
+    s->height = info->height;
+    s->stride = info->stride;
+
+    uint32_t generation = s->generation.load() + 1;
+    s->generation.store(generation);
+
+    return generation;
+}
+
+bool shm_ring_current(const ShmRing *ring, int slot, uint32_t generation)
+{
+    return slot >= 0 && (uint32_t)slot < ring->header->slot_count &&
+           ring->slots[slot].generation.load() == generation;
+}
+
+const uint8_t *shm_ring_pin(ShmRing *ring, int slot, uint32_t generation, ShmSlotInfo *info)
+{
+    if (slot < 0 || (uint32_t)slot >= ring->header->slot_count || (generation & 1)) {
+        return nullptr;
+    }
+
+    ShmSlot *s = &ring->slots[slot];
+
+    s->pins++;
+    if (s->generation.load() != generation) {
+        s->pins--;
+        return nullptr;
+    }
+
+    info->width  = s->width;
+    info->height = s->height;
+    info->stride = s->stride;
+
+    // Don't trust the daemon's numbers further than the slot goes
+    if (info->width < 0 || info->height < 0 || info->stride < info->width * 4 ||
+        (uint64_t)info->stride * info->height > ring->header->slot_size) {
+        s->pins--;
+        return nullptr;
+    }
+
+    return shm_ring_slot_data(ring, slot);
+}
+
+void shm_ring_unpin(ShmRing *ring, int slot)
+{
+    ring->slots[slot].pins--;
+}
@@ -0,0 +1,73 @@
+#ifndef MT_SHM_RING_H
+#define MT_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rows in a slot start at multiples of this so the scaler can use its
+// aligned stores
+#define SHM_RING_ROW_ALIGN 64
+
+// A named shared memory area split into equally sized slots, for handing
+// BGRA pictures to clients on the same host without copying them through a
+// socket. The daemon scales straight into a slot and tells the client its
+// number and generation, the client maps the ring once and reads the pixels
+// in place.
+//
+// Every slot has a generation counter that's odd while the daemon is
+// writing into it and a pin count kept by the clients. The daemon only
+// takes slots that nobody has pinned, oldest first, and a client pinning a
+// slot checks that the generation is still the one it was told about. If it
+// isn't, the slot has been reused and the client has to ask again. If all
+// slots are pinned, the daemon sends the pixels over the socket instead. A
+// client that dies with a slot pinned leaves that slot pinned until the
+// daemon restarts.
+struct ShmRing;
+
+struct ShmSlotInfo {
+    int width;
+    int height;
+    int stride;
+};
+
+// Daemon side. The ring is named after the process, see shm_ring_name.
+// Returns nullptr on failure.
+ShmRing *shm_ring_create(int slot_count, size_t slot_size);
+
+// Client side, maps an existing ring. Returns nullptr on failure.
+ShmRing *shm_ring_open(const char *name);
+
+// The daemon's close removes the name as well, clients that have it mapped
+// keep their mapping
+void shm_ring_close(ShmRing *ring);
+
+// Daemon side: removes the name so it doesn't outlive the process, without
+// touching anything else. Meant for signal handlers, shm_ring_close does it
+// anyway. Named mappings go away on their own on Windows.
+void shm_ring_unlink(const ShmRing *ring);
+
+const char *shm_ring_name(const ShmRing *ring);
+
+size_t shm_ring_slot_size(const ShmRing *ring);
+
+// Daemon side: takes the least recently taken slot that isn't pinned and
+// marks it as being written. Returns the slot number, or -1 if every slot
+// is pinned or being written.
+int shm_ring_claim(ShmRing *ring);
+
+uint8_t *shm_ring_slot_data(ShmRing *ring, int slot);
+
+// Daemon side: done writing a claimed slot. Returns the generation clients
+// have to pin it with. A failed write is published with a zero size.
+uint32_t shm_ring_publish(ShmRing *ring, int slot, const ShmSlotInfo *info);
+
+// Whether slot still holds what was published as generation
+bool shm_ring_current(const ShmRing *ring, int slot, uint32_t generation);
+
+// Client side: keeps the daemon from reusing the slot while it's being read.
+// Returns the pixels, or nullptr if the slot has moved on from generation.
+const uint8_t *shm_ring_pin(ShmRing *ring, int slot, uint32_t generation, ShmSlotInfo *info);
+
+void shm_ring_unpin(ShmRing *ring, int slot);
+
+#endif /* MT_SHM_RING_H */
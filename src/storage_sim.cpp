@@ -0,0 +1,158 @@
+#include <stdio.h>
+
+#include "storage_sim.h"
+
+extern "C" {
+#include <libavutil/time.h>
+#include <libavformat/avio.h>
+}
+
+void storage_model_init(StorageModel *model)
+{
+    model->seek_ms         = 5.0;
+    model->request_ms      = 0.5;
+    model->bandwidth_mib_s = 100.0;
+    model->block_size      = 64 * 1024;
+    model->cache_blocks    = 16;
+    model->sleep           = false;
+}
+
+void storage_sim_init(StorageSim *sim, const StorageModel *model, const ThumbnailInput *inner)
+{
+    sim->model    = *model;
+    sim->inner    = *inner;
+    sim->pos      = 0;
+    sim->last_end = -1;
+    sim->cache.clear();
+
+    sim->stats.reads         = 0;
+    sim->stats.bytes_read    = 0;
+    sim->stats.requests      = 0;
+    sim->stats.seeks         = 0;
+    sim->stats.bytes_fetched = 0;
+    sim->stats.simulated_us  = 0;
+}
+
+static void charge_request(StorageSim *sim, int64_t offset, int64_t size)
+{
+    double ms = sim->model.request_ms;
+
+    if (offset != sim->last_end) {
+        ms += sim->model.seek_ms;
+        sim->stats.seeks++;
+    }
+
+    if (sim->model.bandwidth_mib_s > 0) {
+        ms += size * 1000.0 / (sim->model.bandwidth_mib_s * 1024 * 1024);
+    }
+
+    int64_t us = (int64_t)(ms * 1000);
+
+    sim->stats.requests++;
+    sim->stats.bytes_fetched += size;
+    sim->stats.simulated_us  += us;
+    sim->last_end             = offset + size;
+
+    if (sim->model.sleep) {
+        av_usleep((unsigned)us);
+    }
+}
+
+// Moves the block to the front if it's there, returns whether it was
+static bool cache_lookup(StorageSim *sim, int64_t block)
+{
+    for (std::list<int64_t>::iterator it = sim->cache.begin(); it != sim->cache.end(); ++it) {
+        if (*it == block) {
+            sim->cache.splice(sim->cache.begin(), sim->cache, it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void cache_insert(StorageSim *sim, int64_t block)
+{
+    if (sim->model.cache_blocks <= 0) {
+        return;
+    }
+
+    sim->cache.push_front(block);
+    if ((int)sim->cache.size() > sim->model.cache_blocks) {
+        sim->cache.pop_back();
+    }
+}
+
+void storage_sim_access(StorageSim *sim, int64_t offset, int64_t size)
+{
+    if (size <= 0) {
+        return;
+    }
+
+    sim->stats.reads++;
+    sim->stats.bytes_read += size;
+
+    int64_t block_size = sim->model.block_size;
+    if (block_size <= 0) {
+        charge_request(sim, offset, size);
+        return;
+    }
+
+    // Every run of blocks that isn't cached is one request
+    int64_t first = offset / block_size;
+    int64_t last  = (offset + size - 1) / block_size;
+    int64_t run   = -1;
+
+    for (int64_t block = first; block <= last; block++) {
+        if (cache_lookup(sim, block)) {
+            if (run >= 0) {
+                charge_request(sim, run * block_size, (block - run) * block_size);
+                run = -1;
+            }
+            continue;
+        }
+
+        if (run < 0) {
+            run = block;
+        }
+        cache_insert(sim, block);
+    }
+
+    if (run >= 0) {
+        charge_request(sim, run * block_size, (last + 1 - run) * block_size);
+    }
+}
+
+static int sim_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    StorageSim *sim = (StorageSim *)opaque;
+
+    int ret = sim->inner.read_packet(sim->inner.opaque, buf, buf_size);
+    if (ret > 0) {
+        storage_sim_access(sim, sim->pos, ret);
+        sim->pos += ret;
+    }
+
+    return ret;
+}
+
+// Seeking itself is free, the next read pays for not being sequential
+static int64_t sim_seek(void *opaque, int64_t offset, int whence)
+{
+    StorageSim *sim = (StorageSim *)opaque;
+
+    int64_t ret = sim->inner.seek(sim->inner.opaque, offset, whence);
+    if (ret >= 0 && (whence & ~AVSEEK_FORCE) != AVSEEK_SIZE) {
+        sim->pos = ret;
+    }
+
+    return ret;
+}
+
+void storage_sim_input(StorageSim *sim, ThumbnailInput *input)
+{
+    input->opaque      = sim;
+    input->read_packet = sim_read_packet;
+    input->seek        = sim->inner.seek ? sim_seek : nullptr;
+    input->prefetch    = nullptr;
+}
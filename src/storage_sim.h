@@ -0,0 +1,63 @@
+#ifndef MT_STORAGE_SIM_H
+#define MT_STORAGE_SIM_H
+
+#include <stdint.h>
+
+#include <list>
+
+#include "thumbnail_engine.h"
+
+// What a slow storage costs, roughly: every request pays request_ms, one that
+// doesn't start where the previous one ended pays seek_ms on top, and the
+// bytes come in at bandwidth_mib_s. The client side fetches whole blocks
+// and keeps the last few of them, like the SMB redirector or a cloud sync
+// client would.
+struct StorageModel {
+    double seek_ms;
+    double request_ms;
+    double bandwidth_mib_s;    // 0 for unlimited
+    int    block_size;         // 0 to request exactly what was read
+    int    cache_blocks;
+
+    // Really wait for the time spent instead of only adding it up. Off by
+    // default, adding up is what keeps runs deterministic.
+    bool   sleep;
+};
+
+struct StorageStats {
+    int64_t reads;          // calls from the engine
+    int64_t bytes_read;     // what the engine got
+    int64_t requests;       // what went to the storage
+    int64_t seeks;
+    int64_t bytes_fetched;
+    int64_t simulated_us;
+};
+
+struct StorageSim {
+    StorageModel        model;
+    ThumbnailInput      inner;
+    int64_t             pos;
+
+    // End of the last request, for telling sequential ones from seeks
+    int64_t             last_end;
+
+    // Block numbers, most recently used first
+    std::list<int64_t>  cache;
+
+    StorageStats        stats;
+};
+
+// Something like a file share over a decent LAN
+void storage_model_init(StorageModel *model);
+
+void storage_sim_init(StorageSim *sim, const StorageModel *model, const ThumbnailInput *inner);
+
+// Fills in an input that reads the real data from the inner one and charges
+// for it according to the model. Prefetch hints aren't passed on, the model
+// is of plain synchronous reads.
+void storage_sim_input(StorageSim *sim, ThumbnailInput *input);
+
+// Charges for size bytes at offset as if they were read, for replaying logs
+void storage_sim_access(StorageSim *sim, int64_t offset, int64_t size);
+
+#endif /* MT_STORAGE_SIM_H */
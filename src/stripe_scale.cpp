@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "stripe_scale.h"
+#include "pipeline_pool.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include <libswscale/swscale.h>
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS 1
+#endif
+
+// Up to 4K goes through swscale in one go as before, the box averaging
+// pass costs about as much as it saves on those
+#define STRIPE_MAX_DIRECT_PIXELS (3840 * 2160)
+
+// Rows of the box averaged picture handed to swscale at a time
+#define STRIPE_ROWS       16
+
+// Keeps the sums of 16-bit samples within 32 bits, bigger reductions just
+// leave swscale with a bit more to do
+#define STRIPE_MAX_FACTOR 64
+
+struct StripeFormat {
+    int bytes;       // per sample
+    int chroma_w;    // log2 of the chroma subsampling
+    int chroma_h;
+};
+
+static bool get_stripe_format(AVPixelFormat pix_fmt, StripeFormat *format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    if (!desc || desc->nb_components != 3 || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL |
+                        AV_PIX_FMT_FLAG_HWACCEL))) {
+        return false;
+    }
+
+    // Every component has to be in its own plane
+    for (int i = 0; i < 3; i++) {
+        if (desc->comp[i].plane != i || desc->comp[i].depth_minus1 >= 16) {
+            return false;
+        }
+    }
+
+    format->bytes    = desc->comp[0].depth_minus1 >= 8 ? 2 : 1;
+    format->chroma_w = desc->log2_chroma_w;
+    format->chroma_h = desc->log2_chroma_h;
+
+    return true;
+}
+
+// Aim for about twice the output size so that swscale still gets to do the
+// actual filtering, just over a lot fewer pixels
+static int reduction_factor(int src_size, int dst_size)
+{
+    int factor = src_size / (2 * dst_size);
+
+    return factor < 1 ? 1 : factor > STRIPE_MAX_FACTOR ? STRIPE_MAX_FACTOR : factor;
+}
+
+bool stripe_scale_supported(const AVFrame *frame, int dst_width, int dst_height)
+{
+    StripeFormat format;
+
+    if ((int64_t)frame->width * frame->height <= STRIPE_MAX_DIRECT_PIXELS ||
+        !get_stripe_format((AVPixelFormat)frame->format, &format)) {
+        return false;
+    }
+
+    return reduction_factor(frame->width, dst_width) > 1 ||
+           reduction_factor(frame->height, dst_height) > 1;
+}
+
+#if HAVE_SSE2_INTRINSICS
+// Adds a row of samples to the column sums, returns how many were done
+static int add_row_sse2(const uint16_t *line, int columns, uint32_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int x = 0;
+    for (; x + 8 <= columns; x += 8) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(line + x));
+        __m128i lo      = _mm_loadu_si128((const __m128i *)(sums + x));
+        __m128i hi      = _mm_loadu_si128((const __m128i *)(sums + x + 4));
+
+        lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(samples, zero));
+        hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(samples, zero));
+
+        _mm_storeu_si128((__m128i *)(sums + x), lo);
+        _mm_storeu_si128((__m128i *)(sums + x + 4), hi);
+    }
+
+    return x;
+}
+
+static int add_row_sse2(const uint8_t *line, int columns, uint32_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int x = 0;
+    for (; x + 16 <= columns; x += 16) {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(line + x));
+        __m128i words[2] = { _mm_unpacklo_epi8(samples, zero), _mm_unpackhi_epi8(samples, zero) };
+
+        for (int i = 0; i < 2; i++) {
+            uint32_t *dst = sums + x + i * 8;
+            __m128i lo = _mm_loadu_si128((const __m128i *)dst);
+            __m128i hi = _mm_loadu_si128((const __m128i *)(dst + 4));
+
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(words[i], zero));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(words[i], zero));
+
+            _mm_storeu_si128((__m128i *)dst, lo);
+            _mm_storeu_si128((__m128i *)(dst + 4), hi);
+        }
+    }
+
+    return x;
+}
+#endif
+
+// Averages factor_h source rows of factor_w wide boxes into one row. The rows
+// are added up column by column first, a straight pass over each row, and
+// only then are the column sums added up in boxes.
+template<typename T>
+static void box_row(const uint8_t *src, int src_linesize, int factor_w, int factor_h,
+                    uint8_t *dst, int width, uint32_t *sums, bool use_sse2)
+{
+    int columns = width * factor_w;
+
+    memset(sums, 0, columns * sizeof(*sums));
+
+    for (int y = 0; y < factor_h; y++) {
+        const T *line = (const T *)(src + (ptrdiff_t)y * src_linesize);
+
+        int done = 0;
+#if HAVE_SSE2_INTRINSICS
+        if (use_sse2) {
+            done = add_row_sse2(line, columns, sums);
+        }
+#else
+        (void)use_sse2;
+#endif
+        for (int x = done; x < columns; x++) {
+            sums[x] += line[x];
+        }
+    }
+
+    T *out = (T *)dst;
+    uint32_t count = factor_w * factor_h;
+
+    for (int x = 0; x < width; x++) {
+        const uint32_t *box = sums + x * factor_w;
+        uint32_t sum = 0;
+
+        for (int i = 0; i < factor_w; i++) {
+            sum += box[i];
+        }
+
+        out[x] = (T)((sum + count / 2) / count);
+    }
+}
+
+int stripe_scale(const AVFrame *frame,
+                 uint8_t *const dst_data[4], const int dst_linesize[4],
+                 int dst_width, int dst_height, AVPixelFormat dst_format,
+                 size_t *buffer_bytes)
+{
+    AVPixelFormat src_format = (AVPixelFormat)frame->format;
+    SwsContext *swscale_context = nullptr;
+    uint8_t *stripe = nullptr;
+    uint32_t *sums = nullptr;
+    uint8_t *stripe_data[4] = { nullptr };
+    int stripe_linesize[4] = { 0 };
+    int plane_width[3];
+    int scaled_height = 0;
+    size_t stripe_size = 0;
+    bool use_sse2 = false;
+    int ret = 0;
+
+    StripeFormat format;
+    if (!get_stripe_format(src_format, &format)) {
+        return AVERROR(EINVAL);
+    }
+
+    int factor_w = reduction_factor(frame->width, dst_width);
+    int factor_h = reduction_factor(frame->height, dst_height);
+
+    // Rounded down to whole chroma samples, so that every chroma box lies
+    // inside the source chroma plane. Loses at most a few edge pixels.
+    int width  = (frame->width / factor_w) & ~((1 << format.chroma_w) - 1);
+    int height = (frame->height / factor_h) & ~((1 << format.chroma_h) - 1);
+    if (width < 1 << format.chroma_w || height < 1 << format.chroma_h) {
+        return AVERROR(EINVAL);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        plane_width[i]     = i ? width >> format.chroma_w : width;
+        stripe_linesize[i] = FFALIGN(plane_width[i] * format.bytes, 32);
+        stripe_size       += (size_t)stripe_linesize[i] * (i ? STRIPE_ROWS >> format.chroma_h : STRIPE_ROWS);
+    }
+
+    // The sums are one per source column of the widest plane
+    stripe = (uint8_t *)av_malloc(stripe_size);
+    sums   = (uint32_t *)av_malloc(width * factor_w * sizeof(*sums));
+    if (!stripe || !sums) {
+        fprintf(stderr, "Failed to allocate the stripe buffers :<\n");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    stripe_data[0] = stripe;
+    stripe_data[1] = stripe_data[0] + stripe_linesize[0] * STRIPE_ROWS;
+    stripe_data[2] = stripe_data[1] + stripe_linesize[1] * (STRIPE_ROWS >> format.chroma_h);
+
+#if HAVE_SSE2_INTRINSICS
+    use_sse2 = !!(av_get_cpu_flags() & AV_CPU_FLAG_SSE2);
+#endif
+
+    if (buffer_bytes) {
+        *buffer_bytes = stripe_size + width * factor_w * sizeof(*sums);
+    }
+
+    swscale_context = scaler_pool_acquire(width, height, src_format,
+                                          dst_width, dst_height, dst_format,
+                                          SWS_BICUBIC);
+    if (!swscale_context) {
+        fprintf(stderr, "Failed to create the swscale context for the %s->%s conversion\n",
+                av_get_pix_fmt_name(src_format), av_get_pix_fmt_name(dst_format));
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    // Slices have to come top to bottom with nothing skipped, swscale keeps
+    // the rows its vertical filter still needs between calls
+    for (int y = 0; y < height; y += STRIPE_ROWS) {
+        int rows = FFMIN(STRIPE_ROWS, height - y);
+
+        for (int i = 0; i < 3; i++) {
+            int shift = i ? format.chroma_h : 0;
+            int first = y >> shift;
+
+            for (int row = 0; row < rows >> shift; row++) {
+                const uint8_t *src = frame->data[i] + (ptrdiff_t)(first + row) * factor_h * frame->linesize[i];
+                uint8_t       *dst = stripe_data[i] + row * stripe_linesize[i];
+
+                if (format.bytes == 2) {
+                    box_row<uint16_t>(src, frame->linesize[i], factor_w, factor_h, dst, plane_width[i],
+                                      sums, use_sse2);
+                } else {
+                    box_row<uint8_t>(src, frame->linesize[i], factor_w, factor_h, dst, plane_width[i],
+                                     sums, use_sse2);
+                }
+            }
+        }
+
+        scaled_height += sws_scale(swscale_context, stripe_data, stripe_linesize, y, rows,
+                                   dst_data, dst_linesize);
+    }
+
+    if (scaled_height != dst_height) {
+        fprintf(stderr, "Failed to gain as much height as with the input when scaling\n");
+        ret = AVERROR_BUG;
+    }
+
+cleanup:
+    if (swscale_context) {
+        scaler_pool_release(swscale_context);
+    }
+    av_free(sums);
+    av_free(stripe);
+
+    return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef MT_STRIPE_SCALE_H
+#define MT_STRIPE_SCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Scaling for frames much bigger than the thumbnail (8K, very tall or wide
+// sources). The frame is box averaged down to about twice the output size a
+// stripe of rows at a time, and each stripe is fed to swscale as a slice, so
+// the extra memory needed goes with the output width instead of the input size.
+
+// Whether the frame is big enough for this to pay off, and in a format it handles
+// (planar 8 to 16-bit YUV)
+bool stripe_scale_supported(const AVFrame *frame, int dst_width, int dst_height);
+
+// Returns 0 or a negative AVERROR code. If buffer_bytes isn't null, it's set
+// to how much memory the stripe buffers took.
+int stripe_scale(const AVFrame *frame,
+                 uint8_t *const dst_data[4], const int dst_linesize[4],
+                 int dst_width, int dst_height, AVPixelFormat dst_format,
+                 size_t *buffer_bytes);
+
+#endif /* MT_STRIPE_SCALE_H */
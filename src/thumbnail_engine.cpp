@@ -0,0 +1,1588 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <new>
+#include <vector>
+
+#include "thumbnail_engine.h"
+#include "border_detect.h"
+#include "frame_policy.h"
+#include "pipeline_pool.h"
+#include "hdr_convert.h"
+#include "packet_cache.h"
+#include "probe_index.h"
+#include "stripe_scale.h"
+#include "trace.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include <libswscale/swscale.h>
+}
+
+#define THUMBNAIL_IO_BUFFER_SIZE 8192
+
+// How much to ask the input to prefetch of the header, the Cues and the first cluster
+#define THUMBNAIL_PREFETCH_HEAD    (1024 * 1024)
+#define THUMBNAIL_PREFETCH_TAIL    (256 * 1024)
+#define THUMBNAIL_PREFETCH_CLUSTER (1024 * 1024)
+
+// Streaming mode reads this much of the input if not told otherwise, and
+// stops looking once it has seen this many keyframes
+#define THUMBNAIL_STREAM_PREFIX       (16 * 1024 * 1024)
+#define THUMBNAIL_STREAM_MAX_KEYFRAMES 8
+
+// Animated previews: segment length and frame rate if not told otherwise, and
+// how big one can get, so that memory use doesn't grow with the source. The
+// decoder's own frames aside, everything is output sized.
+#define THUMBNAIL_CLIP_SEGMENT_MS  1000
+#define THUMBNAIL_CLIP_FPS         8
+#define THUMBNAIL_CLIP_MAX_FRAMES  96
+#define THUMBNAIL_CLIP_MAX_BYTES   (8 * 1024 * 1024)
+
+// Keyframe packets aren't kept for a picture that took more than this to
+// decode, re-reading the file is fine then
+#define THUMBNAIL_MAX_KEYFRAME_PACKET_BYTES (4 * 1024 * 1024)
+
+// Reads through to the real input but stops at the prefix limit
+struct StreamingInput {
+    const ThumbnailInput *input;
+    int64_t               limit;
+    int64_t               bytes_read;
+};
+
+struct EncoderInfo {
+    ThumbnailFormat  format;
+    const char      *name;
+    const char      *extension;
+    AVPixelFormat    pix_fmt;
+};
+
+// The scaler writes straight into a picture in the encoder's input format
+static const EncoderInfo encoder_infos[] = {
+    { THUMBNAIL_FORMAT_JPEG, "mjpeg",   "jpg",  AV_PIX_FMT_YUVJ420P },
+    { THUMBNAIL_FORMAT_PNG,  "png",     "png",  AV_PIX_FMT_RGB24 },
+    { THUMBNAIL_FORMAT_WEBP, "libwebp", "webp", AV_PIX_FMT_YUV420P },
+};
+
+static const EncoderInfo *find_encoder_info(ThumbnailFormat format)
+{
+    for (size_t i = 0; i < sizeof(encoder_infos) / sizeof(encoder_infos[0]); i++) {
+        if (encoder_infos[i].format == format) {
+            return &encoder_infos[i];
+        }
+    }
+
+    return nullptr;
+}
+
+struct ClipEncoderInfo {
+    ThumbnailFormat  format;
+    const char      *name;
+    const char      *muxer;
+    const char      *loop_option;
+    AVPixelFormat    pix_fmt;
+};
+
+// Animated previews go through a muxer, the frames alone aren't a file
+static const ClipEncoderInfo clip_encoder_infos[] = {
+    { THUMBNAIL_FORMAT_PNG,  "apng",         "apng", "plays", AV_PIX_FMT_RGB24 },
+    { THUMBNAIL_FORMAT_WEBP, "libwebp_anim", "webp", "loop",  AV_PIX_FMT_YUV420P },
+};
+
+static const ClipEncoderInfo *find_clip_encoder_info(ThumbnailFormat format)
+{
+    for (size_t i = 0; i < sizeof(clip_encoder_infos) / sizeof(clip_encoder_infos[0]); i++) {
+        if (clip_encoder_infos[i].format == format) {
+            return &clip_encoder_infos[i];
+        }
+    }
+
+    return nullptr;
+}
+
+void thumbnail_request_init(ThumbnailRequest *request)
+{
+    memset(request, 0, sizeof(*request));
+    request->size_limit = 256;
+    request->format     = THUMBNAIL_FORMAT_BGRA;
+}
+
+const char *thumbnail_format_extension(ThumbnailFormat format)
+{
+    const EncoderInfo *info = find_encoder_info(format);
+    return info ? info->extension : nullptr;
+}
+
+static void close_input(AVIOContext **avio_context, AVFormatContext **lavf_context)
+{
+    avformat_close_input(lavf_context);
+
+    // Custom IO contexts are ours to free, lavf won't touch them
+    if (*avio_context) {
+        av_freep(&(*avio_context)->buffer);
+        av_freep(avio_context);
+    }
+}
+
+static int streaming_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    StreamingInput *streaming = (StreamingInput *)opaque;
+
+    int64_t left = streaming->limit - streaming->bytes_read;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+
+    if (buf_size > left) {
+        buf_size = (int)left;
+    }
+
+    int ret = streaming->input->read_packet(streaming->input->opaque, buf, buf_size);
+    if (ret > 0) {
+        streaming->bytes_read += ret;
+    }
+
+    return ret;
+}
+
+void thumbnail_prefetch_header(const ThumbnailInput *input)
+{
+    if (!input->prefetch) {
+        return;
+    }
+
+    input->prefetch(input->opaque, 0, THUMBNAIL_PREFETCH_HEAD);
+
+    // The Cues usually live at the end and lavf goes looking for them while reading the header
+    int64_t file_size = input->seek ? input->seek(input->opaque, 0, AVSEEK_SIZE) : -1;
+    if (file_size > THUMBNAIL_PREFETCH_HEAD + THUMBNAIL_PREFETCH_TAIL) {
+        input->prefetch(input->opaque, file_size - THUMBNAIL_PREFETCH_TAIL, THUMBNAIL_PREFETCH_TAIL);
+    }
+}
+
+// The index is only good if the file still has the stream it talks about
+static bool probe_index_usable(const ProbeIndex *index, AVFormatContext *lavf_context)
+{
+    if (!index || !index->valid || index->stream_index >= (int)lavf_context->nb_streams) {
+        return false;
+    }
+
+    AVCodecContext *codec = lavf_context->streams[index->stream_index]->codec;
+
+    return codec->codec_type == AVMEDIA_TYPE_VIDEO && codec->codec_id == index->codec_id;
+}
+
+static int open_input(const ThumbnailRequest *request, StreamingInput *streaming,
+                      AVIOContext **avio_context, AVFormatContext **lavf_context,
+                      int *used_probe_index)
+{
+    // Create the lavf context
+    *lavf_context = avformat_alloc_context();
+    if (!*lavf_context) {
+        fprintf(stderr, "Failed to create lavf context :<\n");
+        return AVERROR(ENOMEM);
+    }
+
+    // Create our buffer for custom lavf IO
+    int io_buffer_size = request->io_buffer_size > 0 ? request->io_buffer_size : THUMBNAIL_IO_BUFFER_SIZE;
+
+    uint8_t *lavf_iobuffer = (uint8_t *)av_malloc(io_buffer_size);
+    if (!lavf_iobuffer) {
+        return AVERROR(ENOMEM);
+    }
+
+    // Create our custom IO context
+    if (request->streaming) {
+        // Without a seek callback lavf can't go looking for the Cues at the end
+        streaming->input      = &request->input;
+        streaming->limit      = request->max_prefix_bytes > 0 ? request->max_prefix_bytes
+                                                               : THUMBNAIL_STREAM_PREFIX;
+        streaming->bytes_read = 0;
+
+        *avio_context = avio_alloc_context(lavf_iobuffer, io_buffer_size, 0,
+                                           streaming, streaming_read_packet, NULL, NULL);
+    } else {
+        *avio_context = avio_alloc_context(lavf_iobuffer, io_buffer_size, 0,
+                                           request->input.opaque, request->input.read_packet,
+                                           NULL, request->input.seek);
+    }
+    if (!*avio_context) {
+        av_free(lavf_iobuffer);
+        return AVERROR(ENOMEM);
+    }
+
+    if (request->streaming) {
+        (*avio_context)->seekable = 0;
+    }
+
+    (*lavf_context)->pb     = *avio_context;
+    (*lavf_context)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // We only ever deal with Matroska/WebM, so skip probing all the other formats
+    AVInputFormat *input_format = av_find_input_format("matroska");
+    if (!input_format) {
+        fprintf(stderr, "Failed to find the Matroska demuxer :<\n");
+        return AVERROR_DEMUXER_NOT_FOUND;
+    }
+
+    if (!request->streaming) {
+        thumbnail_prefetch_header(&request->input);
+    }
+
+    // Try opening the input
+    TRACE_BEGIN("avformat_open_input");
+    int ret = avformat_open_input(lavf_context, "fake_video_name", input_format, NULL);
+    TRACE_END("avformat_open_input");
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open input file :<\n");
+        return ret;
+    }
+
+    // We already know what's inside from an earlier visit. The header was
+    // still read in full above, the demuxer only gets its track state from
+    // reading it itself. The Cues aren't part of that, lavf defers them to
+    // the first seek and parses them then no matter what's in the stream's
+    // index, so seeding it from the stored keyframes wouldn't save that read
+    // either. What's skipped is find_stream_info, which decodes frames.
+    if (probe_index_usable(request->probe_index, *lavf_context)) {
+        probe_index_to_stream(request->probe_index, *lavf_context);
+        *used_probe_index = 1;
+        return 0;
+    }
+
+    // Try finding out what's inside the input
+    TRACE_BEGIN("avformat_find_stream_info");
+    ret = avformat_find_stream_info(*lavf_context, NULL);
+    TRACE_END("avformat_find_stream_info");
+    if (ret < 0) {
+        fprintf(stderr, "Failed to find out what's inside the file :<\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+// Keeps a copy of a packet going into the decoder. Returns false once
+// there's too much to be worth keeping or memory runs out.
+static bool record_packet(CachedPackets *record, const AVPacket *packet, size_t *recorded_bytes)
+{
+    *recorded_bytes += packet->size;
+    if (*recorded_bytes > THUMBNAIL_MAX_KEYFRAME_PACKET_BYTES) {
+        record->packets.clear();
+        return false;
+    }
+
+    try {
+        CachedPacket cached;
+        cached.data.assign((const char *)packet->data, packet->size);
+        cached.pts   = packet->pts;
+        cached.dts   = packet->dts;
+        cached.flags = packet->flags;
+        record->packets.push_back(cached);
+    } catch (const std::bad_alloc &) {
+        record->packets.clear();
+        return false;
+    }
+
+    return true;
+}
+
+// Reads and decodes until the decoder gives us a whole picture. The packets
+// fed to the decoder go into record if there is one.
+static int decode_picture(AVFormatContext *lavf_context, AVCodecContext *decoder_context,
+                          int stream_index, AVFrame *frame, CachedPackets *record)
+{
+    // Create and init an AVPacket
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    // A marker for if we already have a decoded picture
+    int can_has_picture = 0;
+
+    size_t recorded_bytes = 0;
+    if (record) {
+        record->packets.clear();
+    }
+
+    while (!can_has_picture) {
+        // Go grab a "frame" from the file!
+        int ret = av_read_frame(lavf_context, &packet);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to read a frame of data from the input :<\n");
+            return ret;
+        }
+
+        if (packet.stream_index == stream_index) {
+            if (record && !record_packet(record, &packet, &recorded_bytes)) {
+                record = nullptr;
+            }
+
+            // Video decoders always consume the whole packet, so we don't have to check for that
+            ret = avcodec_decode_video2(decoder_context, frame, &can_has_picture, &packet);
+            if (ret < 0) {
+                fprintf(stderr, "Failed to decode video :<\n");
+                av_free_packet(&packet);
+                return ret;
+            }
+        }
+
+        av_free_packet(&packet);
+    }
+
+    return 0;
+}
+
+// Gets a decoder for packets kept from an earlier request, set up the way
+// the demuxer would have set up the codec context
+static int open_cached_decoder(const CachedPackets *packets, AVCodecContext **decoder_context)
+{
+    AVCodec *decoder = avcodec_find_decoder((AVCodecID)packets->codec_id);
+    if (!decoder) {
+        fprintf(stderr, "Failed to find a decoder for the cached packets :<\n");
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    AVCodecContext *params = avcodec_alloc_context3(nullptr);
+    if (!params) {
+        return AVERROR(ENOMEM);
+    }
+
+    params->codec_type = AVMEDIA_TYPE_VIDEO;
+    params->codec_id   = (AVCodecID)packets->codec_id;
+    params->codec_tag  = packets->codec_tag;
+    params->width      = packets->width;
+    params->height     = packets->height;
+    params->pix_fmt    = (AVPixelFormat)packets->pix_fmt;
+
+    params->sample_aspect_ratio.num = packets->sar_num;
+    params->sample_aspect_ratio.den = packets->sar_den;
+
+    int ret = 0;
+
+    if (!packets->extradata.empty()) {
+        params->extradata = (uint8_t *)av_mallocz(packets->extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!params->extradata) {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+
+        memcpy(params->extradata, packets->extradata.data(), packets->extradata.size());
+        params->extradata_size = (int)packets->extradata.size();
+    }
+
+    *decoder_context = decoder_pool_acquire(params, decoder);
+    if (!*decoder_context) {
+        fprintf(stderr, "Failed to get a video decoder\n");
+        ret = AVERROR(ENOMEM);
+    }
+
+cleanup:
+    av_freep(&params->extradata);
+    av_free(params);
+
+    return ret;
+}
+
+// Feeds the kept packets to the decoder and drains it if the picture hasn't
+// come out by then
+static int decode_cached_packets(AVCodecContext *decoder_context, const CachedPackets *packets,
+                                 AVFrame *frame)
+{
+    AVPacket packet;
+    int can_has_picture = 0;
+
+    for (size_t i = 0; i < packets->packets.size() && !can_has_picture; i++) {
+        const CachedPacket &cached = packets->packets[i];
+
+        // Decoders read a little past the end, so it goes into a padded buffer
+        int ret = av_new_packet(&packet, (int)cached.data.size());
+        if (ret < 0) {
+            return ret;
+        }
+
+        memcpy(packet.data, cached.data.data(), cached.data.size());
+        packet.pts   = cached.pts;
+        packet.dts   = cached.dts;
+        packet.flags = cached.flags;
+
+        ret = avcodec_decode_video2(decoder_context, frame, &can_has_picture, &packet);
+        av_free_packet(&packet);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to decode video :<\n");
+            return ret;
+        }
+    }
+
+    if (!can_has_picture) {
+        av_init_packet(&packet);
+        packet.data = nullptr;
+        packet.size = 0;
+
+        int ret = avcodec_decode_video2(decoder_context, frame, &can_has_picture, &packet);
+        if (ret < 0 || !can_has_picture) {
+            fprintf(stderr, "Failed to get a picture out of the cached packets :<\n");
+            return ret < 0 ? ret : AVERROR_INVALIDDATA;
+        }
+    }
+
+    return 0;
+}
+
+// Fills in the rest of a record once the picture made from its packets is known
+static void finish_cached_packets(CachedPackets *record, const AVCodecContext *codec,
+                                  AVRational sar, const ThumbnailResult *result)
+{
+    if (record->packets.empty()) {
+        return;
+    }
+
+    try {
+        record->extradata.assign((const char *)codec->extradata, codec->extradata ? codec->extradata_size : 0);
+    } catch (const std::bad_alloc &) {
+        return;
+    }
+
+    record->codec_id    = codec->codec_id;
+    record->codec_tag   = codec->codec_tag;
+    record->width       = codec->width;
+    record->height      = codec->height;
+    record->pix_fmt     = codec->pix_fmt;
+    record->sar_num     = sar.num;
+    record->sar_den     = sar.den;
+    record->policy_used = result->policy_used;
+    record->target_us   = result->target_us;
+    record->valid       = true;
+}
+
+// Cuts the black bars off the picture, so the scaler only works on what's
+// left. They're taken from the probe index if an earlier visit found them,
+// and put there otherwise. Streaming mode goes by what the keyframes it
+// looked at agreed on.
+static void crop_borders(const ThumbnailRequest *request, AVFrame *frame,
+                         BorderCrop *crop, int crop_votes, ThumbnailResult *result)
+{
+    ProbeIndex *index = request->probe_index && request->probe_index->valid ? request->probe_index : nullptr;
+    bool known;
+
+    if (request->streaming) {
+        known = crop_votes > 0;
+    } else if (index && index->crop_known) {
+        crop->left   = index->crop_left;
+        crop->top    = index->crop_top;
+        crop->right  = index->crop_right;
+        crop->bottom = index->crop_bottom;
+        known = true;
+    } else {
+        known = border_detect(frame, crop);
+    }
+
+    if (!known || !border_crop_apply(frame, crop)) {
+        return;
+    }
+
+    if (index && !index->crop_known) {
+        index->dirty       = true;
+        index->crop_known  = true;
+        index->crop_left   = crop->left;
+        index->crop_top    = crop->top;
+        index->crop_right  = crop->right;
+        index->crop_bottom = crop->bottom;
+    }
+
+    result->crop_left   = crop->left;
+    result->crop_top    = crop->top;
+    result->crop_right  = crop->right;
+    result->crop_bottom = crop->bottom;
+}
+
+// How much is going on in a picture, going by the spread of the luma values
+static double luma_variance(const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        return 0.0;
+    }
+
+    int    depth = desc->comp[0].depth_minus1 + 1;
+    double sum   = 0.0;
+    double sum2  = 0.0;
+    int    count = 0;
+
+    // Every 8th pixel on every 8th line is plenty for telling a black frame from a real one
+    for (int y = 0; y < frame->height; y += 8) {
+        const uint8_t *line = frame->data[0] + y * frame->linesize[0];
+
+        for (int x = 0; x < frame->width; x += 8) {
+            int value = depth > 8 ? ((const uint16_t *)line)[x] >> (depth - 8) : line[x];
+            sum  += value;
+            sum2 += value * value;
+            count++;
+        }
+    }
+
+    if (!count) {
+        return 0.0;
+    }
+
+    double mean = sum / count;
+    return sum2 / count - mean * mean;
+}
+
+// Keeps the candidate if it beats what we have so far
+static void consider_keyframe(AVFrame *best, double *best_score, AVFrame *candidate)
+{
+    double score = luma_variance(candidate);
+
+    if (score > *best_score) {
+        av_frame_unref(best);
+        av_frame_move_ref(best, candidate);
+        *best_score = score;
+    } else {
+        av_frame_unref(candidate);
+    }
+}
+
+// Narrows the crop down to what's black on this picture as well. Pictures
+// that can't tell (dark ones) are left out.
+static void vote_crop(const AVFrame *candidate, BorderCrop *crop, int *crop_votes)
+{
+    BorderCrop found;
+    if (!border_detect(candidate, &found)) {
+        return;
+    }
+
+    if (!(*crop_votes)++) {
+        *crop = found;
+    } else {
+        border_crop_intersect(crop, &found);
+    }
+}
+
+// Streaming mode: goes through the keyframes until the input window ends
+// and keeps the one with the most going on in it. If crop isn't null, it's
+// set to the black bars all of them had.
+static int decode_best_keyframe(AVFormatContext *lavf_context, AVCodecContext *decoder_context,
+                                int stream_index, AVFrame *frame, int *keyframes_seen,
+                                BorderCrop *crop, int *crop_votes)
+{
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    double best_score = -1.0;
+    int    got_picture = 0;
+    int    ret = 0;
+
+    AVFrame *candidate = av_frame_alloc();
+    if (!candidate) {
+        return AVERROR(ENOMEM);
+    }
+
+    // Nothing but keyframes get fed in anyway
+    decoder_context->skip_frame = AVDISCARD_NONKEY;
+
+    while (*keyframes_seen < THUMBNAIL_STREAM_MAX_KEYFRAMES) {
+        ret = av_read_frame(lavf_context, &packet);
+        if (ret < 0) {
+            // The end of the window is the expected way out of here
+            break;
+        }
+
+        if (packet.stream_index != stream_index || !(packet.flags & AV_PKT_FLAG_KEY)) {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        ret = avcodec_decode_video2(decoder_context, candidate, &got_picture, &packet);
+        av_free_packet(&packet);
+        if (ret < 0) {
+            // One broken keyframe doesn't mean the next one is broken too
+            continue;
+        }
+
+        if (got_picture) {
+            (*keyframes_seen)++;
+            if (crop) {
+                vote_crop(candidate, crop, crop_votes);
+            }
+            consider_keyframe(frame, &best_score, candidate);
+        }
+    }
+
+    // Get the pictures the decoder is still holding on to
+    do {
+        packet.data = nullptr;
+        packet.size = 0;
+
+        got_picture = 0;
+        if (avcodec_decode_video2(decoder_context, candidate, &got_picture, &packet) < 0) {
+            break;
+        }
+
+        if (got_picture) {
+            (*keyframes_seen)++;
+            if (crop) {
+                vote_crop(candidate, crop, crop_votes);
+            }
+            consider_keyframe(frame, &best_score, candidate);
+        }
+    } while (got_picture);
+
+    decoder_context->skip_frame = AVDISCARD_DEFAULT;
+    av_frame_free(&candidate);
+
+    if (best_score < 0.0) {
+        fprintf(stderr, "Failed to find a keyframe inside the streaming window :<\n");
+        return ret < 0 ? ret : AVERROR_INVALIDDATA;
+    }
+
+    return 0;
+}
+
+// Calculates the output size from the display aspect ratio and the size limit
+static void fit_to_size(int width, int height, AVRational sar, int size_limit,
+                        int *dst_width, int *dst_height)
+{
+    // If the guessed SAR somehow ends up zero somewhere, we reset to 1:1
+    if (sar.den == 0 || sar.num == 0) {
+        sar.den = 1;
+        sar.num = 1;
+    }
+
+    // Calculate the aspect ratio'ized size for the output picture
+    if (sar.num > sar.den) {
+        *dst_width  = (width * sar.num) / sar.den;
+        *dst_height = height;
+    } else {
+        *dst_height = (height * sar.den) / sar.num;
+        *dst_width  = width;
+    }
+
+    // Fit the thing into size_limit
+    if (*dst_width > *dst_height) {
+        double ratio = (double)*dst_height / (double)*dst_width;
+        *dst_width  = size_limit;
+        *dst_height = (int)((ratio * (double)size_limit) + 0.5);
+    } else {
+        double ratio = (double)*dst_width / (double)*dst_height;
+        *dst_height = size_limit;
+        *dst_width  = (int)((ratio * (double)size_limit) + 0.5);
+    }
+
+    // Extremely thin sources could otherwise end up with nothing at all
+    if (*dst_width < 1) {
+        *dst_width = 1;
+    }
+    if (*dst_height < 1) {
+        *dst_height = 1;
+    }
+}
+
+static int sws_scale_pooled(const uint8_t *const src_data[4], const int src_linesize[4],
+                            int src_width, int src_height, AVPixelFormat src_format,
+                            uint8_t *const dst_data[4], const int dst_linesize[4],
+                            int dst_width, int dst_height, AVPixelFormat dst_format)
+{
+    // Reuse a swscale context from an earlier picture with the same geometry if possible
+    SwsContext *swscale_context = scaler_pool_acquire(src_width, src_height, src_format,
+                                                      dst_width, dst_height, dst_format,
+                                                      SWS_BICUBIC);
+    if (!swscale_context) {
+        fprintf(stderr, "Failed to create the swscale context for the %s->%s conversion\n",
+                av_get_pix_fmt_name(src_format), av_get_pix_fmt_name(dst_format));
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = sws_scale(swscale_context, src_data, src_linesize, 0, src_height,
+                        dst_data, dst_linesize);
+
+    scaler_pool_release(swscale_context);
+
+    if (ret != dst_height) {
+        fprintf(stderr, "Failed to gain as much height as with the input when scaling\n");
+        return AVERROR_BUG;
+    }
+
+    return 0;
+}
+
+// Big frames go through in stripes, so scaling doesn't need memory
+// that grows with the input on top of the decoded frame
+static int scale_frame(const AVFrame *frame,
+                       uint8_t *const dst_data[4], const int dst_linesize[4],
+                       int dst_width, int dst_height, AVPixelFormat dst_format)
+{
+    if (stripe_scale_supported(frame, dst_width, dst_height)) {
+        return stripe_scale(frame, dst_data, dst_linesize, dst_width, dst_height, dst_format, nullptr);
+    }
+
+    return sws_scale_pooled(frame->data, frame->linesize, frame->width, frame->height,
+                            (AVPixelFormat)frame->format,
+                            dst_data, dst_linesize, dst_width, dst_height, dst_format);
+}
+
+// Scales the decoded frame into the destination picture
+static int scale_picture(const AVFrame *frame,
+                         uint8_t *const dst_data[4], const int dst_linesize[4],
+                         int dst_width, int dst_height, AVPixelFormat dst_format)
+{
+    if (!hdr_convert_supported(frame)) {
+        return scale_frame(frame, dst_data, dst_linesize, dst_width, dst_height, dst_format);
+    }
+
+    // 10-bit -> RGB is one of the slowest swscale paths, so only let it downscale
+    // and do the conversion and tone mapping ourselves on the output-size picture
+    uint8_t *hdr_data[4]      = { nullptr };
+    int      hdr_linesize[4]  = { 0 };
+    uint8_t *bgra_data[4]     = { nullptr };
+    int      bgra_linesize[4] = { 0 };
+
+    int ret = av_image_alloc(hdr_data, hdr_linesize, dst_width, dst_height, AV_PIX_FMT_YUV420P10, 16);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to allocate the high bit depth intermediate picture :<\n");
+        goto cleanup;
+    }
+
+    ret = scale_frame(frame, hdr_data, hdr_linesize, dst_width, dst_height, AV_PIX_FMT_YUV420P10);
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    if (dst_format == AV_PIX_FMT_BGRA) {
+        hdr_convert_to_bgra(hdr_data, hdr_linesize, dst_width, dst_height, frame,
+                            dst_data[0], dst_linesize[0]);
+        goto cleanup;
+    }
+
+    // Encoders want something else, go through an output-size BGRA picture
+    ret = av_image_alloc(bgra_data, bgra_linesize, dst_width, dst_height, AV_PIX_FMT_BGRA, 16);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to allocate the tone mapped intermediate picture :<\n");
+        goto cleanup;
+    }
+
+    hdr_convert_to_bgra(hdr_data, hdr_linesize, dst_width, dst_height, frame,
+                        bgra_data[0], bgra_linesize[0]);
+
+    ret = sws_scale_pooled(bgra_data, bgra_linesize, dst_width, dst_height, AV_PIX_FMT_BGRA,
+                           dst_data, dst_linesize, dst_width, dst_height, dst_format);
+
+cleanup:
+    av_freep(&hdr_data[0]);
+    av_freep(&bgra_data[0]);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int encode_picture(AVCodec *encoder, const AVFrame *picture, ThumbnailResult *result)
+{
+    AVCodecContext *encoder_context = encoder_pool_acquire(encoder, picture->width, picture->height,
+                                                           (AVPixelFormat)picture->format);
+    if (!encoder_context) {
+        return AVERROR(ENOMEM);
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    int got_packet = 0;
+    int ret = avcodec_encode_video2(encoder_context, &packet, picture, &got_packet);
+    if (ret < 0 || !got_packet) {
+        fprintf(stderr, "Failed to encode the thumbnail :<\n");
+        ret = ret < 0 ? ret : AVERROR_BUG;
+        goto cleanup;
+    }
+
+    result->data = (uint8_t *)av_malloc(packet.size);
+    if (!result->data) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    memcpy(result->data, packet.data, packet.size);
+    result->size = packet.size;
+
+cleanup:
+    av_free_packet(&packet);
+    encoder_pool_release(encoder_context);
+
+    return ret;
+}
+
+// Writes the frames of an animated preview into an in-memory file
+struct ClipWriter {
+    AVCodecContext  *encoder_context;
+    AVFormatContext *mux_context;
+    AVStream        *stream;
+    AVFrame         *picture;
+    int              frames;
+};
+
+static void clip_writer_free(ClipWriter *writer)
+{
+    if (writer->mux_context) {
+        if (writer->mux_context->pb) {
+            uint8_t *data = nullptr;
+            avio_close_dyn_buf(writer->mux_context->pb, &data);
+            av_free(data);
+        }
+        avformat_free_context(writer->mux_context);
+        writer->mux_context = nullptr;
+    }
+
+    if (writer->encoder_context) {
+        avcodec_close(writer->encoder_context);
+        av_freep(&writer->encoder_context);
+    }
+
+    av_frame_free(&writer->picture);
+}
+
+// Animation encoders keep state between frames, so these don't come from the pool
+static int clip_writer_open(ClipWriter *writer, const ClipEncoderInfo *info, AVCodec *encoder,
+                            int width, int height, int fps)
+{
+    writer->encoder_context = avcodec_alloc_context3(encoder);
+    if (!writer->encoder_context) {
+        return AVERROR(ENOMEM);
+    }
+
+    writer->encoder_context->width         = width;
+    writer->encoder_context->height        = height;
+    writer->encoder_context->pix_fmt       = info->pix_fmt;
+    writer->encoder_context->time_base.num = 1;
+    writer->encoder_context->time_base.den = fps;
+
+    int ret = avformat_alloc_output_context2(&writer->mux_context, nullptr, info->muxer, nullptr);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create the %s muxer :<\n", info->muxer);
+        return ret;
+    }
+
+    if (writer->mux_context->oformat->flags & AVFMT_GLOBALHEADER) {
+        writer->encoder_context->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    ret = avcodec_open2(writer->encoder_context, encoder, nullptr);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to open the %s encoder :<\n", encoder->name);
+        return ret;
+    }
+
+    writer->stream = avformat_new_stream(writer->mux_context, nullptr);
+    if (!writer->stream) {
+        return AVERROR(ENOMEM);
+    }
+
+    ret = avcodec_copy_context(writer->stream->codec, writer->encoder_context);
+    if (ret < 0) {
+        return ret;
+    }
+    writer->stream->time_base = writer->encoder_context->time_base;
+
+    ret = avio_open_dyn_buf(&writer->mux_context->pb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Loop forever, if the muxer doesn't know the option it plays once
+    av_opt_set_int(writer->mux_context->priv_data, info->loop_option, 0, 0);
+
+    ret = avformat_write_header(writer->mux_context, nullptr);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write the %s header :<\n", info->muxer);
+        return ret;
+    }
+
+    writer->picture = av_frame_alloc();
+    if (!writer->picture) {
+        return AVERROR(ENOMEM);
+    }
+
+    writer->picture->format = info->pix_fmt;
+    writer->picture->width  = width;
+    writer->picture->height = height;
+
+    return av_frame_get_buffer(writer->picture, 32);
+}
+
+// Encodes a picture (nullptr to flush) and muxes what comes out. Returns
+// 1 if a packet was written, 0 if not and < 0 on failure.
+static int clip_writer_encode(ClipWriter *writer, const AVFrame *picture)
+{
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    int got_packet = 0;
+    int ret = avcodec_encode_video2(writer->encoder_context, &packet, picture, &got_packet);
+    if (ret < 0 || !got_packet) {
+        return ret;
+    }
+
+    av_packet_rescale_ts(&packet, writer->encoder_context->time_base, writer->stream->time_base);
+    packet.stream_index = writer->stream->index;
+
+    ret = av_write_frame(writer->mux_context, &packet);
+    av_free_packet(&packet);
+
+    return ret < 0 ? ret : 1;
+}
+
+static int clip_writer_finish(ClipWriter *writer, ThumbnailResult *result)
+{
+    int ret;
+
+    while ((ret = clip_writer_encode(writer, nullptr)) > 0) {
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = av_write_trailer(writer->mux_context);
+    if (ret < 0) {
+        return ret;
+    }
+
+    result->size = avio_close_dyn_buf(writer->mux_context->pb, &result->data);
+    writer->mux_context->pb = nullptr;
+
+    return result->data ? 0 : AVERROR(ENOMEM);
+}
+
+// Whether the preview is as big as it's allowed to get
+static bool clip_full(const ClipWriter *writer)
+{
+    return writer->frames >= THUMBNAIL_CLIP_MAX_FRAMES ||
+           (writer->mux_context && avio_tell(writer->mux_context->pb) >= THUMBNAIL_CLIP_MAX_BYTES);
+}
+
+// Everything the segments share
+struct ClipContext {
+    const ThumbnailRequest *request;
+    const ClipEncoderInfo  *info;
+    AVCodec                *encoder;
+    AVFormatContext        *lavf_context;
+    AVCodecContext         *decoder_context;
+    AVStream               *stream;
+    AVFrame                *frame;
+    int                     fps;
+    int64_t                 frame_step;   // in the stream time base
+    ClipWriter              writer;
+};
+
+// Scales a kept frame into the preview, opening the writer on the first one
+static int clip_add_frame(ClipContext *clip, ThumbnailResult *result)
+{
+    ClipWriter *writer = &clip->writer;
+    AVFrame    *frame  = clip->frame;
+
+    int64_t stage_time = av_gettime();
+    int ret;
+
+    if (!writer->encoder_context) {
+        AVRational guessed_sar = av_guess_sample_aspect_ratio(clip->lavf_context, clip->stream, frame);
+        fit_to_size(frame->width, frame->height, guessed_sar, clip->request->size_limit,
+                    &result->width, &result->height);
+
+        ret = clip_writer_open(writer, clip->info, clip->encoder, result->width, result->height, clip->fps);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = scale_picture(frame, writer->picture->data, writer->picture->linesize,
+                        result->width, result->height, clip->info->pix_fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    result->stats.scale_us += av_gettime() - stage_time;
+    stage_time = av_gettime();
+
+    writer->picture->pts = writer->frames++;
+
+    ret = clip_writer_encode(writer, writer->picture);
+
+    result->stats.encode_us += av_gettime() - stage_time;
+
+    return ret < 0 ? ret : 0;
+}
+
+// Decodes length worth of frames from where the demuxer is, timed from the
+// first one, keeping one per frame_step. The rest are dropped before scaling.
+static int decode_clip_segment(ClipContext *clip, int64_t length, ThumbnailResult *result)
+{
+    int64_t end_ts   = AV_NOPTS_VALUE;
+    int64_t next_ts  = AV_NOPTS_VALUE;
+    bool    draining = false;
+
+    while (!clip_full(&clip->writer)) {
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = nullptr;
+        packet.size = 0;
+
+        int64_t stage_time = av_gettime();
+
+        if (!draining) {
+            int ret = av_read_frame(clip->lavf_context, &packet);
+            if (ret == AVERROR_EOF) {
+                draining = true;
+            } else if (ret < 0) {
+                fprintf(stderr, "Failed to read a frame of data from the input :<\n");
+                return ret;
+            } else if (packet.stream_index != clip->stream->index) {
+                av_free_packet(&packet);
+                continue;
+            } else if (end_ts != AV_NOPTS_VALUE && packet.dts != AV_NOPTS_VALUE && packet.dts >= end_ts) {
+                // Only the frames still in the decoder can be before the end
+                av_free_packet(&packet);
+                draining = true;
+            }
+        }
+
+        int got_picture = 0;
+        int ret = avcodec_decode_video2(clip->decoder_context, clip->frame, &got_picture, &packet);
+        av_free_packet(&packet);
+
+        result->stats.decode_us += av_gettime() - stage_time;
+
+        // Broken packets right after a seek aren't worth giving up over
+        if (ret < 0 || !got_picture) {
+            if (draining) {
+                break;
+            }
+            continue;
+        }
+
+        int64_t ts = av_frame_get_best_effort_timestamp(clip->frame);
+
+        if (end_ts == AV_NOPTS_VALUE && ts != AV_NOPTS_VALUE) {
+            end_ts = ts + length;
+        }
+
+        if (ts != AV_NOPTS_VALUE && end_ts != AV_NOPTS_VALUE && ts >= end_ts) {
+            av_frame_unref(clip->frame);
+            break;
+        }
+
+        if (ts != AV_NOPTS_VALUE && next_ts != AV_NOPTS_VALUE && ts < next_ts) {
+            av_frame_unref(clip->frame);
+            continue;
+        }
+        next_ts = ts != AV_NOPTS_VALUE ? ts + clip->frame_step : AV_NOPTS_VALUE;
+
+        ret = clip_add_frame(clip, result);
+        av_frame_unref(clip->frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Keyframes to start the segments from, spread evenly over the duration and
+// looked up in the index lavf built from the Cues. Nothing is returned when
+// there's no index.
+static void pick_clip_segments(AVFormatContext *lavf_context, AVStream *stream, int count,
+                               std::vector<int> *entries)
+{
+    if (stream->nb_index_entries <= 0) {
+        return;
+    }
+
+    int64_t start    = stream->start_time != AV_NOPTS_VALUE ? stream->start_time
+                                                            : stream->index_entries[0].timestamp;
+    int64_t duration = stream->duration;
+
+    if (duration == AV_NOPTS_VALUE && lavf_context->duration != AV_NOPTS_VALUE) {
+        AVRational time_base_q = { 1, AV_TIME_BASE };
+        duration = av_rescale_q(lavf_context->duration, time_base_q, stream->time_base);
+    }
+    if (duration == AV_NOPTS_VALUE || duration <= 0) {
+        duration = stream->index_entries[stream->nb_index_entries - 1].timestamp - start;
+    }
+
+    for (int i = 0; i < count; i++) {
+        // Leaves out the very start and end, which tend to be logos and credits
+        int64_t target = start + duration * (i + 1) / (count + 1);
+
+        int entry = av_index_search_timestamp(stream, target, AVSEEK_FLAG_BACKWARD);
+        if (entry < 0) {
+            entry = 0;
+        }
+
+        // Short files with few keyframes can land on the same one twice
+        if (entries->empty() || stream->index_entries[entry].timestamp >
+                                stream->index_entries[entries->back()].timestamp) {
+            entries->push_back(entry);
+        }
+    }
+}
+
+// Byte offset of the cluster the picture is going to come from: the one of
+// the keyframe at or before target_ts, or the first one without a target.
+// Returns -1 if there's nothing to go by.
+static int64_t picture_cluster_pos(const ProbeIndex *probe_index, AVStream *stream, int64_t target_ts)
+{
+    if (probe_index && !probe_index->keyframes.empty()) {
+        const std::vector<ProbeKeyframe> &keyframes = probe_index->keyframes;
+
+        size_t i = 0;
+        while (target_ts != AV_NOPTS_VALUE && i + 1 < keyframes.size() &&
+               keyframes[i + 1].timestamp <= target_ts) {
+            i++;
+        }
+
+        return keyframes[i].pos;
+    }
+
+    if (stream->nb_index_entries > 0) {
+        int entry = target_ts != AV_NOPTS_VALUE ?
+                    av_index_search_timestamp(stream, target_ts, AVSEEK_FLAG_BACKWARD) : 0;
+
+        return stream->index_entries[entry < 0 ? 0 : entry].pos;
+    }
+
+    return -1;
+}
+
+static int generate_clip(const ThumbnailRequest *request, const ClipEncoderInfo *info,
+                         AVCodec *encoder, AVFormatContext *lavf_context,
+                         AVCodecContext *decoder_context, int stream_index, AVFrame *frame,
+                         ThumbnailResult *result)
+{
+    ClipContext clip;
+    memset(&clip, 0, sizeof(clip));
+
+    clip.request         = request;
+    clip.info            = info;
+    clip.encoder         = encoder;
+    clip.lavf_context    = lavf_context;
+    clip.decoder_context = decoder_context;
+    clip.stream          = lavf_context->streams[stream_index];
+    clip.frame           = frame;
+    clip.fps             = request->clip_fps > 0 ? request->clip_fps : THUMBNAIL_CLIP_FPS;
+
+    int segment_ms = request->clip_segment_ms > 0 ? request->clip_segment_ms : THUMBNAIL_CLIP_SEGMENT_MS;
+
+    AVRational ms_time_base  = { 1, 1000 };
+    AVRational fps_time_base = { 1, clip.fps };
+    int64_t segment_length   = av_rescale_q(segment_ms, ms_time_base, clip.stream->time_base);
+    clip.frame_step          = av_rescale_q(1, fps_time_base, clip.stream->time_base);
+
+    std::vector<int> entries;
+    if (!request->streaming) {
+        pick_clip_segments(lavf_context, clip.stream, request->clip_segments, &entries);
+    }
+
+    int saved_skip_frame = decoder_context->skip_frame;
+    int ret = 0;
+
+    // Frames nothing else refers to can go undecoded when most of them
+    // would be dropped anyway
+    AVRational frame_rate = clip.stream->avg_frame_rate;
+    if (frame_rate.num > 0 && frame_rate.den > 0 && av_q2d(frame_rate) >= 2.0 * clip.fps) {
+        decoder_context->skip_frame = AVDISCARD_NONREF;
+    }
+
+    // Have the clusters of the later segments come in while decoding the first ones
+    if (request->input.prefetch) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            request->input.prefetch(request->input.opaque, clip.stream->index_entries[entries[i]].pos,
+                                    THUMBNAIL_PREFETCH_CLUSTER);
+        }
+    }
+
+    // No index or no seeking, one long segment from wherever the demuxer is
+    if (entries.empty()) {
+        ret = decode_clip_segment(&clip, segment_length * request->clip_segments, result);
+    }
+
+    for (size_t i = 0; i < entries.size() && ret >= 0 && !clip_full(&clip.writer); i++) {
+        ret = av_seek_frame(lavf_context, stream_index, clip.stream->index_entries[entries[i]].timestamp,
+                            AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to seek to the start of a preview segment :<\n");
+            break;
+        }
+        avcodec_flush_buffers(decoder_context);
+
+        TRACE_BEGIN("clip_segment");
+        ret = decode_clip_segment(&clip, segment_length, result);
+        TRACE_END("clip_segment");
+    }
+
+    // The pooled decoder goes back the way it came
+    decoder_context->skip_frame = saved_skip_frame;
+    avcodec_flush_buffers(decoder_context);
+
+    if (ret >= 0 && !clip.writer.frames) {
+        fprintf(stderr, "Failed to decode any frames for the preview :<\n");
+        ret = AVERROR_INVALIDDATA;
+    }
+
+    if (ret >= 0) {
+        int64_t stage_time = av_gettime();
+        ret = clip_writer_finish(&clip.writer, result);
+        result->stats.encode_us += av_gettime() - stage_time;
+        result->clip_frames = clip.writer.frames;
+    }
+
+    clip_writer_free(&clip.writer);
+
+    return ret < 0 ? ret : 0;
+}
+
+int thumbnail_generate(const ThumbnailRequest *request, ThumbnailResult *result)
+{
+    AVIOContext     *avio_context    = nullptr;
+    AVFormatContext *lavf_context    = nullptr;
+    AVCodecContext  *decoder_context = nullptr;
+    AVCodec         *decoder         = nullptr;
+    AVCodec         *encoder         = nullptr;
+    AVFrame         *frame           = nullptr;
+    AVFrame         *picture         = nullptr;
+    AVStream        *stream          = nullptr;
+
+    const EncoderInfo     *encoder_info = nullptr;
+    const ClipEncoderInfo *clip_info    = nullptr;
+
+    uint8_t *dst_data[4]     = { nullptr };
+    int      dst_linesize[4] = { 0 };
+    int      dst_width       = 0;
+    int      dst_height      = 0;
+    int      stream_index    = -1;
+    int      ret             = 0;
+    int64_t  target_ts       = AV_NOPTS_VALUE;
+    int64_t  cluster_pos     = -1;
+
+    // Packets to decode instead of reading the input, or to keep for next time
+    const CachedPackets *cached_packets = nullptr;
+    CachedPackets       *record         = nullptr;
+
+    // Black bars, and how many of the keyframes looked at in streaming mode could tell
+    BorderCrop crop;
+    int        crop_votes = 0;
+
+    AVRational guessed_sar;
+
+    StreamingInput streaming;
+
+#ifdef MT_ENABLE_TRACE
+    ThumbnailRequest traced_request;
+    TraceIO          trace_io;
+#endif
+
+    memset(result, 0, sizeof(*result));
+    result->policy_used = THUMBNAIL_POLICY_FIRST;
+    result->target_us   = AV_NOPTS_VALUE;
+
+    int64_t start_time = av_gettime();
+    int64_t stage_time = start_time;
+
+    if (request->size_limit <= 0) {
+        return AVERROR(EINVAL);
+    }
+
+    if (request->clip_segments > 0) {
+        clip_info = find_clip_encoder_info(request->format);
+        if (!clip_info) {
+            fprintf(stderr, "Animated previews are only done as APNG or WebP :<\n");
+            return AVERROR(EINVAL);
+        }
+
+        encoder = avcodec_find_encoder_by_name(clip_info->name);
+        if (!encoder) {
+            fprintf(stderr, "No encoder available for animated previews in the requested format :<\n");
+            return AVERROR_ENCODER_NOT_FOUND;
+        }
+    } else if (request->format == THUMBNAIL_FORMAT_BGRA) {
+        if (!request->alloc_bgra) {
+            return AVERROR(EINVAL);
+        }
+    } else {
+        encoder_info = find_encoder_info(request->format);
+        encoder = encoder_info ? avcodec_find_encoder_by_name(encoder_info->name) : nullptr;
+        if (!encoder) {
+            fprintf(stderr, "No encoder available for the requested output format :<\n");
+            return AVERROR_ENCODER_NOT_FOUND;
+        }
+    }
+
+    // Register all formats etc. (only does the work once per process)
+    pipeline_global_init();
+
+#ifdef MT_ENABLE_TRACE
+    // Put the tracing decorator in front of the input so every call into it shows up
+    if (trace_enabled()) {
+        trace_io.opaque      = request->input.opaque;
+        trace_io.read_packet = request->input.read_packet;
+        trace_io.seek        = request->input.seek;
+        trace_io.prefetch    = request->input.prefetch;
+        trace_io.pos         = 0;
+
+        traced_request = *request;
+        traced_request.input.opaque      = &trace_io;
+        traced_request.input.read_packet = trace_read_packet;
+        traced_request.input.seek        = request->input.seek ? trace_seek : nullptr;
+        traced_request.input.prefetch    = request->input.prefetch ? trace_prefetch : nullptr;
+
+        request = &traced_request;
+    }
+#endif
+
+    TRACE_BEGIN("thumbnail_generate");
+
+    if (request->keyframe_packets && !request->streaming && !clip_info) {
+        if (request->keyframe_packets->valid) {
+            cached_packets = request->keyframe_packets;
+        } else {
+            record = request->keyframe_packets;
+        }
+    }
+
+    // Everything the picture needs is in the packets, the input isn't touched
+    if (cached_packets) {
+        TRACE_BEGIN("open_cached_decoder");
+        ret = open_cached_decoder(cached_packets, &decoder_context);
+        TRACE_END("open_cached_decoder");
+        if (ret < 0) {
+            goto cleanup;
+        }
+
+        result->used_keyframe_packets = 1;
+        result->policy_used           = cached_packets->policy_used;
+        result->target_us             = cached_packets->target_us;
+
+        goto decode;
+    }
+
+    TRACE_BEGIN("open_input");
+    ret = open_input(request, &streaming, &avio_context, &lavf_context, &result->used_probe_index);
+    TRACE_END("open_input");
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    if (result->used_probe_index) {
+        // The stored parameters are what find_stream_info would have come up with
+        ret = request->probe_index->stream_index;
+        decoder = avcodec_find_decoder((AVCodecID)request->probe_index->codec_id);
+
+        if (probe_index_to_codec_context(request->probe_index, lavf_context->streams[ret]->codec) < 0) {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+    } else {
+        // Try looking for the "best" video stream in file
+        TRACE_BEGIN("av_find_best_stream");
+        ret = av_find_best_stream(lavf_context, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+        TRACE_END("av_find_best_stream");
+        if (ret < 0) {
+            fprintf(stderr, "Failed to find the best video stream :<\n");
+            goto cleanup;
+        }
+
+        if (request->probe_index) {
+            probe_index_from_stream(request->probe_index, lavf_context, ret);
+        }
+    }
+
+    // If no decoder was found, error out
+    if (!decoder) {
+        fprintf(stderr, "Failed to find a decoder for the best video stream :<\n");
+        ret = AVERROR_DECODER_NOT_FOUND;
+        goto cleanup;
+    }
+
+    // Gather information on the found stream
+    stream_index = ret;
+    stream = lavf_context->streams[stream_index];
+
+    // Where to take the picture from only needs the header, so it's known
+    // before anything is decoded. Streaming mode never seeks and previews
+    // pick their own segments.
+    if (request->policy != THUMBNAIL_POLICY_FIRST && !request->streaming && !clip_info) {
+        result->policy_used = frame_policy_choose(lavf_context, stream_index, request->policy,
+                                                  request->policy_value, &result->target_us);
+        if (result->target_us != AV_NOPTS_VALUE) {
+            AVRational time_base_q = { 1, AV_TIME_BASE };
+            target_ts = av_rescale_q(result->target_us, time_base_q, stream->time_base);
+        }
+    }
+
+    // The cluster of the keyframe we're going to decode is where the picture is coming from
+    cluster_pos = picture_cluster_pos(result->used_probe_index ? request->probe_index : nullptr,
+                                      stream, target_ts);
+    if (request->input.prefetch && cluster_pos >= 0) {
+        request->input.prefetch(request->input.opaque, cluster_pos, THUMBNAIL_PREFETCH_CLUSTER);
+    }
+
+    // Grab an already opened decoder for these parameters if we have one lying around
+    decoder_context = decoder_pool_acquire(stream->codec, decoder);
+    if (!decoder_context) {
+        fprintf(stderr, "Failed to get a video decoder\n");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+decode:
+    result->stats.open_us = av_gettime() - stage_time;
+    stage_time = av_gettime();
+
+    // Create an AVFrame
+    frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Failed to allocate AVFrame :<\n");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if (clip_info) {
+        TRACE_BEGIN("clip");
+        ret = generate_clip(request, clip_info, encoder, lavf_context, decoder_context,
+                            stream_index, frame, result);
+        TRACE_END("clip");
+        goto cleanup;
+    }
+
+    // Going back to the keyframe at or before the target, that's the
+    // picture then. A failed seek leaves us with whatever comes next.
+    if (target_ts != AV_NOPTS_VALUE) {
+        TRACE_BEGIN("seek");
+        ret = av_seek_frame(lavf_context, stream_index, target_ts, AVSEEK_FLAG_BACKWARD);
+        TRACE_END("seek");
+        if (ret < 0) {
+            fprintf(stderr, "Failed to seek to the picked position, using the first picture :<\n");
+            result->policy_used = THUMBNAIL_POLICY_FIRST;
+            result->target_us   = AV_NOPTS_VALUE;
+        }
+    }
+
+    TRACE_BEGIN("decode");
+    if (cached_packets) {
+        ret = decode_cached_packets(decoder_context, cached_packets, frame);
+    } else if (request->streaming) {
+        ret = decode_best_keyframe(lavf_context, decoder_context, stream_index, frame,
+                                   &result->keyframes_seen,
+                                   request->keep_borders ? nullptr : &crop, &crop_votes);
+
+        result->streamed   = 1;
+        result->bytes_read = streaming.bytes_read;
+    } else {
+        ret = decode_picture(lavf_context, decoder_context, stream_index, frame, record);
+    }
+    TRACE_END("decode");
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    result->stats.decode_us = av_gettime() - stage_time;
+    stage_time = av_gettime();
+
+    if (cached_packets) {
+        guessed_sar.num = cached_packets->sar_num;
+        guessed_sar.den = cached_packets->sar_den;
+    } else {
+        guessed_sar = av_guess_sample_aspect_ratio(lavf_context, stream, frame);
+    }
+
+    if (record) {
+        finish_cached_packets(record, stream->codec, guessed_sar, result);
+    }
+
+    if (!request->keep_borders) {
+        TRACE_BEGIN("crop");
+        crop_borders(request, frame, &crop, crop_votes, result);
+        TRACE_END("crop");
+    }
+    fit_to_size(frame->width, frame->height, guessed_sar, request->size_limit,
+                &dst_width, &dst_height);
+
+    result->width  = dst_width;
+    result->height = dst_height;
+
+    if (encoder_info) {
+        // Scale straight into the picture we hand to the encoder
+        picture = av_frame_alloc();
+        if (!picture) {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+
+        picture->format = encoder_info->pix_fmt;
+        picture->width  = dst_width;
+        picture->height = dst_height;
+
+        ret = av_frame_get_buffer(picture, 32);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to allocate the output picture :<\n");
+            goto cleanup;
+        }
+
+        TRACE_BEGIN("scale");
+        ret = scale_picture(frame, picture->data, picture->linesize,
+                            dst_width, dst_height, encoder_info->pix_fmt);
+        TRACE_END("scale");
+    } else {
+        ret = request->alloc_bgra(request->alloc_opaque, dst_width, dst_height,
+                                  &dst_data[0], &dst_linesize[0]);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to allocate the output picture :<\n");
+            goto cleanup;
+        }
+
+        TRACE_BEGIN("scale");
+        ret = scale_picture(frame, dst_data, dst_linesize,
+                            dst_width, dst_height, AV_PIX_FMT_BGRA);
+        TRACE_END("scale");
+    }
+
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    result->stats.scale_us = av_gettime() - stage_time;
+    stage_time = av_gettime();
+
+    if (encoder_info) {
+        TRACE_BEGIN("encode");
+        ret = encode_picture(encoder, picture, result);
+        TRACE_END("encode");
+        if (ret < 0) {
+            goto cleanup;
+        }
+
+        result->stats.encode_us = av_gettime() - stage_time;
+    }
+
+    ret = 0;
+
+cleanup:
+    // Clean it all up, boys!
+    av_frame_free(&picture);
+    av_frame_free(&frame);
+    decoder_pool_release(decoder_context);
+    close_input(&avio_context, &lavf_context);
+
+    TRACE_END("thumbnail_generate");
+
+    result->stats.total_us = av_gettime() - start_time;
+
+    return ret;
+}
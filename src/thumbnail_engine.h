@@ -0,0 +1,169 @@
+#ifndef MT_THUMBNAIL_ENGINE_H
+#define MT_THUMBNAIL_ENGINE_H
+
+#include <stdint.h>
+
+struct ProbeIndex;
+struct CachedPackets;
+
+enum ThumbnailFormat {
+    // Raw pixels scaled straight into a buffer given by the caller
+    THUMBNAIL_FORMAT_BGRA,
+    THUMBNAIL_FORMAT_JPEG,
+    THUMBNAIL_FORMAT_PNG,
+    THUMBNAIL_FORMAT_WEBP,
+};
+
+// Where in the file the picture is taken from. Everything but FIRST works
+// from what the demuxer read from the header (the duration, Chapters and
+// Tags) and seeks to the keyframe at or before the chosen time, so picking
+// costs nothing extra to decode.
+enum ThumbnailPolicy {
+    // The first picture in the file
+    THUMBNAIL_POLICY_FIRST,
+
+    // policy_value percent into the duration (10 if 0)
+    THUMBNAIL_POLICY_PERCENT,
+
+    // A little way into chapter number policy_value, counting from 1. The
+    // default of 2 skips an intro chapter.
+    THUMBNAIL_POLICY_CHAPTER,
+
+    // The time in a THUMBNAIL_TIME tag of the file or the video track
+    THUMBNAIL_POLICY_TAG,
+
+    // The tag if there is one, then the second chapter, then 10 percent
+    THUMBNAIL_POLICY_AUTO,
+};
+
+// Where the input is read from, same signatures as the avio callbacks
+struct ThumbnailInput {
+    void    *opaque;
+    int     (*read_packet)(void *opaque, uint8_t *buf, int buf_size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+
+    // Optional, told about byte ranges that are going to be read soon so
+    // they can be fetched in the background
+    void    (*prefetch)(void *opaque, int64_t offset, int64_t size);
+};
+
+// Called in BGRA mode once the output size is known. Has to point *data at a
+// buffer of at least *linesize * height bytes. Returns < 0 on failure.
+typedef int (*ThumbnailAllocBGRA)(void *opaque, int width, int height,
+                                  uint8_t **data, int *linesize);
+
+struct ThumbnailRequest {
+    ThumbnailInput      input;
+
+    // The longer side of the thumbnail
+    int                 size_limit;
+
+    ThumbnailFormat     format;
+
+    // BGRA mode only
+    ThumbnailAllocBGRA  alloc_bgra;
+    void               *alloc_opaque;
+
+    // Forward-only mode for pipes and inputs where seeking is expensive. The
+    // input is never seeked, only the first max_prefix_bytes of it are read
+    // (0 for the default) and the best keyframe found in there is used.
+    int                 streaming;
+    int64_t             max_prefix_bytes;
+
+    // Optional. If it's valid, the stream layout stored in it is used and
+    // avformat_find_stream_info and av_find_best_stream are skipped. If not,
+    // it's filled in after probing so the caller can store it for next time.
+    ProbeIndex         *probe_index;
+
+    // Optional, stills only and not in streaming mode. If it's valid, the
+    // picture is decoded from the packets in it and the input isn't read at
+    // all, whatever the size and format. If not, the packets that went into
+    // the picture are put in it so the caller can keep them around.
+    CachedPackets      *keyframe_packets;
+
+    // Size of the reads lavf makes from the input, 0 for the default
+    int                 io_buffer_size;
+
+    // An animated preview instead of a still, made of clip_segments short
+    // segments spread over the file. Each one is decoded from the keyframe
+    // at its start, for clip_segment_ms, and thinned out to clip_fps. Needs
+    // the PNG (APNG) or WebP format. 0 for the defaults, except clip_segments.
+    int                 clip_segments;
+    int                 clip_segment_ms;
+    int                 clip_fps;
+
+    // Stills only. Black bars around the picture are cut off before scaling,
+    // so they don't take up thumbnail space, unless this is set. In streaming mode
+    // only what's black on every keyframe looked at is cut. The crop found
+    // is kept in probe_index.
+    int                 keep_borders;
+
+    // Stills only, ignored in streaming mode. When the metadata the policy
+    // needs isn't there, the first picture is used.
+    ThumbnailPolicy     policy;
+    int                 policy_value;
+};
+
+// Wall clock time spent in each stage, in microseconds
+struct ThumbnailStats {
+    int64_t open_us;
+    int64_t decode_us;
+    int64_t scale_us;
+    int64_t encode_us;
+    int64_t total_us;
+};
+
+struct ThumbnailResult {
+    int             width;
+    int             height;
+
+    // Encoded formats only. Allocated with av_malloc, freed by the caller with av_free.
+    uint8_t        *data;
+    int             size;
+
+    ThumbnailStats  stats;
+
+    // Streaming mode only: how many keyframes were looked at to pick the
+    // picture, and how much of the input was read to find them
+    int             streamed;
+    int             keyframes_seen;
+    int64_t         bytes_read;
+
+    // Set when probing was skipped thanks to request.probe_index
+    int             used_probe_index;
+
+    // Set when the picture came from request.keyframe_packets
+    int             used_keyframe_packets;
+
+    // How much was cut off the decoded picture on each side, in its pixels
+    int             crop_left;
+    int             crop_top;
+    int             crop_right;
+    int             crop_bottom;
+
+    // Animated previews only, how many frames ended up in it
+    int             clip_frames;
+
+    // The policy that ended up picking the picture (FIRST if the requested
+    // one had nothing to go on) and the time it picked, in AV_TIME_BASE
+    // units. The picture is the keyframe at or before target_us.
+    ThumbnailPolicy policy_used;
+    int64_t         target_us;
+};
+
+// Sets up a request with the defaults (BGRA, 256 pixels)
+void thumbnail_request_init(ThumbnailRequest *request);
+
+// Decodes a picture from the input and scales it (and encodes it) as requested.
+// Returns 0 on success and a negative AVERROR code on failure.
+int thumbnail_generate(const ThumbnailRequest *request, ThumbnailResult *result);
+
+// Hints the parts of the input lavf reads while opening it (the header and
+// the Cues) to input.prefetch. thumbnail_generate does this on its own, batch
+// callers can do it early for the inputs coming up next.
+void thumbnail_prefetch_header(const ThumbnailInput *input);
+
+// File extension (without the dot) for an encoded format, nullptr for BGRA
+const char *thumbnail_format_extension(ThumbnailFormat format);
+
+#endif /* MT_THUMBNAIL_ENGINE_H */
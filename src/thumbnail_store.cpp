@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "thumbnail_store.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#include <windows.h>
+#define getpid _getpid
+#define utime  _utime
+#define rmdir  _rmdir
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/murmur3.h>
+}
+
+static const char thumbnail_store_magic[4] = { 'M', 'T', 'T', 'S' };
+
+// Anything bigger than a 4096x4096 BGRA picture isn't one of ours
+#define THUMBNAIL_STORE_MAX_DATA (64 * 1024 * 1024)
+
+// Pruning goes this far under the limit, so it isn't needed again on the
+// very next save
+#define THUMBNAIL_STORE_PRUNE_PERCENT 90
+
+struct StoredFile {
+    std::string path;
+    uint64_t    size;
+    int64_t     mtime;
+};
+
+static std::string             store_dir;
+static std::atomic<unsigned>   temp_counter;
+
+// What's on disk is counted once when the limit is set and kept up to date
+// by the saves after that
+static std::mutex              store_lock;
+static uint64_t                store_limit;
+static uint64_t                store_bytes;
+static ThumbnailStoreStats     store_stats;
+
+void thumbnail_store_set_dir(const std::string &dir)
+{
+    store_dir = dir;
+}
+
+bool thumbnail_store_enabled(void)
+{
+    return !store_dir.empty();
+}
+
+static std::string hash_hex(const std::string &data)
+{
+    uint8_t hash[16];
+
+    struct AVMurMur3 *murmur = av_murmur3_alloc();
+    if (!murmur) {
+        return std::string();
+    }
+
+    av_murmur3_init(murmur);
+    av_murmur3_update(murmur, (const uint8_t *)data.data(), (int)data.size());
+    av_murmur3_final(murmur, hash);
+    av_free(murmur);
+
+    char hex[33];
+    for (int i = 0; i < 16; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    }
+
+    return hex;
+}
+
+// Versioned keys go into their group's directory, with the version's hash
+// in front of the name. group_dir is left empty for the others.
+static std::string store_path(const std::string &key, std::string *group_dir,
+                              std::string *version_prefix)
+{
+    std::string key_hash = hash_hex(key);
+    if (key_hash.empty()) {
+        return std::string();
+    }
+
+    size_t end = key.find('|');
+    size_t at  = key.rfind('@', end);
+    if (at == std::string::npos) {
+        group_dir->clear();
+        return store_dir + "/" + key_hash + ".thumb";
+    }
+
+    std::string group_hash   = hash_hex(key.substr(0, at));
+    std::string version_hash = hash_hex(key.substr(at + 1, end == std::string::npos ? end : end - at - 1));
+    if (group_hash.empty() || version_hash.empty()) {
+        return std::string();
+    }
+
+    *group_dir      = store_dir + "/" + group_hash;
+    *version_prefix = version_hash.substr(0, 8) + "-";
+
+    return *group_dir + "/" + *version_prefix + key_hash + ".thumb";
+}
+
+static bool is_thumb_name(const std::string &name)
+{
+    return name.size() > 6 && !name.compare(name.size() - 6, 6, ".thumb");
+}
+
+// Thumbnails in dir, and in the group directories under it if recurse is
+// set. Temporary files are left out, they're about to be renamed.
+static void list_files(const std::string &dir, bool recurse, std::vector<StoredFile> *files)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    do {
+        std::string name = find_data.cFileName;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (recurse) {
+                list_files(dir + "/" + name, false, files);
+            }
+        } else if (is_thumb_name(name)) {
+            StoredFile file;
+            file.path  = dir + "/" + name;
+            file.size  = (uint64_t)find_data.nFileSizeHigh << 32 | find_data.nFileSizeLow;
+            file.mtime = (int64_t)find_data.ftLastWriteTime.dwHighDateTime << 32 |
+                         find_data.ftLastWriteTime.dwLowDateTime;
+            files->push_back(file);
+        }
+    } while (FindNextFileA(find, &find_data));
+
+    FindClose(find);
+#else
+    DIR *listing = opendir(dir.c_str());
+    if (!listing) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(listing))) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (recurse) {
+                list_files(path, false, files);
+            }
+        } else if (is_thumb_name(name)) {
+            StoredFile file;
+            file.path  = path;
+            file.size  = (uint64_t)st.st_size;
+            file.mtime = (int64_t)st.st_mtime;
+            files->push_back(file);
+        }
+    }
+
+    closedir(listing);
+#endif
+}
+
+// Creates the directory if it isn't there. Failures show up when the file
+// in it is created.
+static void make_dir(const std::string &dir)
+{
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+}
+
+static bool by_mtime(const StoredFile &a, const StoredFile &b)
+{
+    return a.mtime < b.mtime;
+}
+
+// Must be called with store_lock held. Counts what's on disk and removes the
+// oldest files if that's over the limit. Loading bumps the modification
+// time, so oldest means least recently used.
+static void prune_to_limit(void)
+{
+    std::vector<StoredFile> files;
+    list_files(store_dir, true, &files);
+
+    store_bytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        store_bytes += files[i].size;
+    }
+
+    if (store_bytes <= store_limit) {
+        return;
+    }
+
+    std::sort(files.begin(), files.end(), by_mtime);
+
+    uint64_t target = store_limit / 100 * THUMBNAIL_STORE_PRUNE_PERCENT;
+    for (size_t i = 0; i < files.size() && store_bytes > target; i++) {
+        if (remove(files[i].path.c_str())) {
+            continue;
+        }
+
+        store_bytes -= files[i].size;
+        store_stats.pruned++;
+
+        // Takes the group's directory along once it's empty, fails otherwise
+        size_t slash = files[i].path.rfind('/');
+        if (slash > store_dir.size()) {
+            rmdir(files[i].path.substr(0, slash).c_str());
+        }
+    }
+}
+
+// Must be called with store_lock held. Returns how many bytes were removed.
+static uint64_t remove_superseded(const std::string &group_dir, const std::string &version_prefix)
+{
+    std::vector<StoredFile> files;
+    list_files(group_dir, false, &files);
+
+    uint64_t removed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t name = files[i].path.rfind('/') + 1;
+        if (!files[i].path.compare(name, version_prefix.size(), version_prefix)) {
+            continue;
+        }
+
+        if (!remove(files[i].path.c_str())) {
+            removed += files[i].size;
+            store_stats.superseded++;
+        }
+    }
+
+    return removed;
+}
+
+void thumbnail_store_set_limit(uint64_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(store_lock);
+    store_limit = max_bytes;
+
+    if (store_limit && !store_dir.empty()) {
+        prune_to_limit();
+    }
+}
+
+void thumbnail_store_get_stats(ThumbnailStoreStats *stats)
+{
+    std::lock_guard<std::mutex> lock(store_lock);
+    *stats = store_stats;
+    stats->bytes = store_bytes;
+}
+
+// Little endian like the probe index
+static void put_u32(std::string *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out->push_back((char)(value >> (8 * i)));
+    }
+}
+
+static bool get_u32(const std::string &data, size_t *pos, uint32_t *value)
+{
+    if (data.size() - *pos < 4) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        *value |= (uint32_t)(uint8_t)data[(*pos)++] << (8 * i);
+    }
+
+    return true;
+}
+
+bool thumbnail_store_load(const std::string &key, CachedThumbnail *thumbnail)
+{
+    if (store_dir.empty()) {
+        return false;
+    }
+
+    std::string group_dir, version_prefix;
+    std::string path = store_path(key, &group_dir, &version_prefix);
+    if (path.empty()) {
+        return false;
+    }
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    std::string data;
+    char buf[16384];
+    size_t read_bytes;
+    while ((read_bytes = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.append(buf, read_bytes);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    if (!ok || data.size() < 8 || memcmp(data.data(), thumbnail_store_magic, 4)) {
+        return false;
+    }
+
+    size_t   pos = 4;
+    uint32_t version, key_size, width, height, data_size;
+
+    if (!get_u32(data, &pos, &version) || version != THUMBNAIL_STORE_VERSION ||
+        !get_u32(data, &pos, &key_size) || key_size > data.size() - pos) {
+        return false;
+    }
+
+    // A different key that happens to hash the same
+    if (data.compare(pos, key_size, key)) {
+        return false;
+    }
+    pos += key_size;
+
+    if (!get_u32(data, &pos, &width) || !get_u32(data, &pos, &height) ||
+        !get_u32(data, &pos, &data_size) || data_size > THUMBNAIL_STORE_MAX_DATA ||
+        data_size != data.size() - pos) {
+        return false;
+    }
+
+    thumbnail->width  = (int)width;
+    thumbnail->height = (int)height;
+    thumbnail->data.assign(data, pos, data_size);
+
+    // Pruning goes by the modification time, so this one is recent again
+    if (store_limit) {
+        utime(path.c_str(), NULL);
+    }
+
+    return true;
+}
+
+int thumbnail_store_save(const std::string &key, const CachedThumbnail &thumbnail)
+{
+    if (store_dir.empty()) {
+        return 0;
+    }
+
+    std::string group_dir, version_prefix;
+    std::string path = store_path(key, &group_dir, &version_prefix);
+    if (path.empty()) {
+        return -1;
+    }
+
+    if (!group_dir.empty()) {
+        make_dir(group_dir);
+    }
+
+    std::string header(thumbnail_store_magic, sizeof(thumbnail_store_magic));
+    put_u32(&header, THUMBNAIL_STORE_VERSION);
+    put_u32(&header, (uint32_t)key.size());
+    header += key;
+    put_u32(&header, (uint32_t)thumbnail.width);
+    put_u32(&header, (uint32_t)thumbnail.height);
+    put_u32(&header, (uint32_t)thumbnail.data.size());
+
+    // Readers never see a half written thumbnail
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), (unsigned)temp_counter++);
+    std::string temp_path = path + suffix;
+
+    FILE *fp = fopen(temp_path.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to create %s :<\n", temp_path.c_str());
+        return -1;
+    }
+
+    bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size() &&
+              fwrite(thumbnail.data.data(), 1, thumbnail.data.size(), fp) == thumbnail.data.size();
+    ok = !fclose(fp) && ok;
+
+    // What the rename replaces, for keeping count
+    uint64_t replaced = 0;
+    if (store_limit) {
+        FILE *old_fp = fopen(path.c_str(), "rb");
+        if (old_fp) {
+            fseek(old_fp, 0, SEEK_END);
+            replaced = (uint64_t)ftell(old_fp);
+            fclose(old_fp);
+        }
+    }
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && !rename(temp_path.c_str(), path.c_str());
+#endif
+
+    if (!ok) {
+        remove(temp_path.c_str());
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(store_lock);
+
+    if (!group_dir.empty()) {
+        replaced += remove_superseded(group_dir, version_prefix);
+    }
+
+    if (store_limit) {
+        store_bytes += header.size() + thumbnail.data.size();
+        store_bytes -= std::min(store_bytes, replaced);
+
+        if (store_bytes > store_limit) {
+            prune_to_limit();
+        }
+    }
+
+    return 0;
+}
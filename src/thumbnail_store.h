@@ -0,0 +1,48 @@
+#ifndef MT_THUMBNAIL_STORE_H
+#define MT_THUMBNAIL_STORE_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "result_cache.h"
+
+#define THUMBNAIL_STORE_VERSION 2
+
+struct ThumbnailStoreStats {
+    uint64_t bytes;       // on disk, only kept count of with a limit
+    uint64_t pruned;      // removed to get under the limit
+    uint64_t superseded;  // removed because a newer version was saved
+};
+
+// Finished thumbnails kept on disk under the same keys as the result cache,
+// so they survive restarts and whatever the watcher made ahead of time is
+// there when it's asked for. Files are named after a hash of the key and
+// the key is checked when loading.
+//
+// A key that starts with group@version, up to the first '|', is one version
+// of the group: the daemon uses the file's device and inode as the group and
+// its size and mtime as the version. Saving it removes what's stored for
+// other versions of the group, which would never be asked for again. Such
+// entries go into a directory per group so that's cheap to find out.
+//
+// An empty directory turns the whole thing off.
+void thumbnail_store_set_dir(const std::string &dir);
+
+// 0, the default, for no limit. Over it, the least recently saved or loaded
+// thumbnails are removed. The directory is checked right away, so call it
+// after thumbnail_store_set_dir and before the store is used from other
+// threads.
+void thumbnail_store_set_limit(uint64_t max_bytes);
+
+bool thumbnail_store_enabled(void);
+
+// Returns false if there's nothing stored for the key or it's broken
+bool thumbnail_store_load(const std::string &key, CachedThumbnail *thumbnail);
+
+// Written to a temporary file and renamed over the old one. Returns < 0 on failure.
+int thumbnail_store_save(const std::string &key, const CachedThumbnail &thumbnail);
+
+void thumbnail_store_get_stats(ThumbnailStoreStats *stats);
+
+#endif /* MT_THUMBNAIL_STORE_H */
@@ -0,0 +1,292 @@
+#include <stdio.h>
+
+#include "trace.h"
+
+#ifdef MT_ENABLE_TRACE
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <libavutil/time.h>
+#include <libavformat/avio.h>
+}
+
+// Past this a thread's events are counted but not kept
+#define TRACE_MAX_EVENTS_PER_THREAD (1024 * 1024)
+
+// Plain TLS, there's no thread_local in VS2012. Not safe in a DLL that gets
+// LoadLibrary'd on XP, but only the command line tools start tracing.
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+enum TraceArgs {
+    TRACE_ARGS_NONE,
+    TRACE_ARGS_RANGE,   // offset and size
+    TRACE_ARGS_SEEK,    // offset and whence
+    TRACE_ARGS_RESULT,
+};
+
+struct TraceEvent {
+    const char *name;
+    int64_t     timestamp;
+    char        phase;
+    char        args;
+    int64_t     arg0;
+    int64_t     arg1;
+};
+
+struct TraceBuffer {
+    int                     tid;
+    std::vector<TraceEvent> events;
+    int64_t                 dropped;
+};
+
+static std::atomic<bool> trace_on;
+static int64_t           trace_start_time;
+
+// Every thread's buffer, kept until the process exits so that trace_write
+// can still get at the ones from threads that are gone
+static std::mutex                 buffers_lock;
+static std::vector<TraceBuffer *> buffers;
+
+static TRACE_THREAD_LOCAL TraceBuffer *thread_buffer;
+
+static TraceBuffer *get_thread_buffer(void)
+{
+    if (thread_buffer) {
+        return thread_buffer;
+    }
+
+    TraceBuffer *buffer = new TraceBuffer;
+    buffer->dropped = 0;
+    buffer->events.reserve(4096);
+
+    {
+        std::lock_guard<std::mutex> lock(buffers_lock);
+        buffers.push_back(buffer);
+        buffer->tid = (int)buffers.size();
+    }
+
+    thread_buffer = buffer;
+
+    return buffer;
+}
+
+static void add_event(const char *name, char phase, char args, int64_t arg0, int64_t arg1)
+{
+    if (!trace_on.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    TraceBuffer *buffer = get_thread_buffer();
+    if (buffer->events.size() >= TRACE_MAX_EVENTS_PER_THREAD) {
+        buffer->dropped++;
+        return;
+    }
+
+    TraceEvent event;
+    event.name      = name;
+    event.timestamp = av_gettime() - trace_start_time;
+    event.phase     = phase;
+    event.args      = args;
+    event.arg0      = arg0;
+    event.arg1      = arg1;
+
+    buffer->events.push_back(event);
+}
+
+int trace_start(void)
+{
+    trace_start_time = av_gettime();
+    trace_on.store(true);
+
+    return 0;
+}
+
+bool trace_enabled(void)
+{
+    return trace_on.load(std::memory_order_relaxed);
+}
+
+void trace_begin(const char *name)
+{
+    add_event(name, 'B', TRACE_ARGS_NONE, 0, 0);
+}
+
+void trace_end(const char *name)
+{
+    add_event(name, 'E', TRACE_ARGS_NONE, 0, 0);
+}
+
+void trace_begin_io(const char *name, int64_t offset, int64_t size)
+{
+    add_event(name, 'B', TRACE_ARGS_RANGE, offset, size);
+}
+
+void trace_end_io(const char *name, int64_t result)
+{
+    add_event(name, 'E', TRACE_ARGS_RESULT, result, 0);
+}
+
+int trace_write(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing the trace :<\n", path);
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(buffers_lock);
+
+    const char *separator = "\n";
+    int64_t dropped = 0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (size_t i = 0; i < buffers.size(); i++) {
+        const TraceBuffer *buffer = buffers[i];
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", separator, buffer->tid, buffer->tid);
+        separator = ",\n";
+
+        for (size_t j = 0; j < buffer->events.size(); j++) {
+            const TraceEvent *event = &buffer->events[j];
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d",
+                    event->name, event->phase, (long long)event->timestamp, buffer->tid);
+
+            if (event->args == TRACE_ARGS_RANGE) {
+                fprintf(fp, ",\"args\":{\"offset\":%lld,\"size\":%lld}",
+                        (long long)event->arg0, (long long)event->arg1);
+            } else if (event->args == TRACE_ARGS_SEEK) {
+                fprintf(fp, ",\"args\":{\"offset\":%lld,\"whence\":%lld}",
+                        (long long)event->arg0, (long long)event->arg1);
+            } else if (event->args == TRACE_ARGS_RESULT) {
+                fprintf(fp, ",\"args\":{\"result\":%lld}", (long long)event->arg0);
+            }
+
+            fprintf(fp, "}");
+        }
+
+        dropped += buffer->dropped;
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    bool ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+
+    if (dropped) {
+        fprintf(stderr, "The trace is missing %lld events that didn't fit in the buffers\n", (long long)dropped);
+    }
+
+    return ok ? 0 : -1;
+}
+
+int trace_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    TraceIO *io = (TraceIO *)opaque;
+
+    trace_begin_io("read", io->pos, buf_size);
+    int ret = io->read_packet(io->opaque, buf, buf_size);
+    trace_end_io("read", ret);
+
+    if (ret > 0) {
+        io->pos += ret;
+    }
+
+    return ret;
+}
+
+int64_t trace_seek(void *opaque, int64_t offset, int whence)
+{
+    TraceIO *io = (TraceIO *)opaque;
+
+    add_event("seek", 'B', TRACE_ARGS_SEEK, offset, whence);
+    int64_t ret = io->seek(io->opaque, offset, whence);
+    trace_end_io("seek", ret);
+
+    // AVSEEK_SIZE doesn't move anything
+    if (ret >= 0 && (whence & ~AVSEEK_FORCE) != AVSEEK_SIZE) {
+        io->pos = ret;
+    }
+
+    return ret;
+}
+
+void trace_prefetch(void *opaque, int64_t offset, int64_t size)
+{
+    TraceIO *io = (TraceIO *)opaque;
+
+    trace_begin_io("prefetch", offset, size);
+    io->prefetch(io->opaque, offset, size);
+    trace_end("prefetch");
+}
+
+#else
+
+int trace_start(void)
+{
+    fprintf(stderr, "This build doesn't have tracing, it needs MT_ENABLE_TRACE :<\n");
+    return -1;
+}
+
+bool trace_enabled(void)
+{
+    return false;
+}
+
+int trace_write(const char *path)
+{
+    (void)path;
+    return -1;
+}
+
+void trace_begin(const char *name)
+{
+    (void)name;
+}
+
+void trace_end(const char *name)
+{
+    (void)name;
+}
+
+void trace_begin_io(const char *name, int64_t offset, int64_t size)
+{
+    (void)name;
+    (void)offset;
+    (void)size;
+}
+
+void trace_end_io(const char *name, int64_t result)
+{
+    (void)name;
+    (void)result;
+}
+
+int trace_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    TraceIO *io = (TraceIO *)opaque;
+    return io->read_packet(io->opaque, buf, buf_size);
+}
+
+int64_t trace_seek(void *opaque, int64_t offset, int whence)
+{
+    TraceIO *io = (TraceIO *)opaque;
+    return io->seek(io->opaque, offset, whence);
+}
+
+void trace_prefetch(void *opaque, int64_t offset, int64_t size)
+{
+    TraceIO *io = (TraceIO *)opaque;
+    io->prefetch(io->opaque, offset, size);
+}
+
+#endif
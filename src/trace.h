@@ -0,0 +1,65 @@
+#ifndef MT_TRACE_H
+#define MT_TRACE_H
+
+#include <stdint.h>
+
+// Begin/end events for the pipeline stages and the I/O callbacks, kept per
+// thread and written out as Chrome trace JSON, which Perfetto and
+// chrome://tracing open as is.
+//
+// Only built in with MT_ENABLE_TRACE, without it the macros are empty and
+// trace_start fails. Built in but not started, an event costs a relaxed
+// atomic load. Event names aren't copied or escaped, use string literals.
+
+// Starts recording, returns < 0 if tracing isn't built in
+int  trace_start(void);
+
+bool trace_enabled(void);
+
+// Writes out everything recorded so far. The threads that recorded events
+// have to be done by then, their buffers are read without locking.
+int  trace_write(const char *path);
+
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+// For I/O calls, offset and size go into the begin event and what the
+// call returned into the end event
+void trace_begin_io(const char *name, int64_t offset, int64_t size);
+void trace_end_io(const char *name, int64_t result);
+
+// Not for functions that use goto cleanup, jumping past one doesn't compile
+struct TraceScope {
+    const char *name;
+
+    TraceScope(const char *scope_name) : name(scope_name) { trace_begin(name); }
+    ~TraceScope() { trace_end(name); }
+};
+
+// Sits between the engine and the real input callbacks and records every
+// read, seek and prefetch with where in the file it happened
+struct TraceIO {
+    void    *opaque;
+    int     (*read_packet)(void *opaque, uint8_t *buf, int buf_size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+    void    (*prefetch)(void *opaque, int64_t offset, int64_t size);
+
+    // Where the next read starts, as far as we can tell
+    int64_t  pos;
+};
+
+int     trace_read_packet(void *opaque, uint8_t *buf, int buf_size);
+int64_t trace_seek(void *opaque, int64_t offset, int whence);
+void    trace_prefetch(void *opaque, int64_t offset, int64_t size);
+
+#ifdef MT_ENABLE_TRACE
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END(name)   trace_end(name)
+#define TRACE_SCOPE(name) TraceScope trace_scope(name)
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_SCOPE(name)
+#endif
+
+#endif /* MT_TRACE_H */
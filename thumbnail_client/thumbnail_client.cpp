@@ -0,0 +1,460 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "../src/daemon_protocol.h"
+#include "../src/shm_ring.h"
+
+struct Response {
+    enum { OK, SHM, BUSY, ERROR } status;
+    int         width;
+    int         height;
+    std::string data;
+    std::string message;
+
+    // SHM only, where in the daemon's ring the pixels are
+    std::string ring;
+    int         slot;
+    uint32_t    generation;
+    int         stride;
+};
+
+static int read_response(DaemonReader *reader, Response *response)
+{
+    std::string line;
+    if (daemon_reader_line(reader, &line) < 0) {
+        return -1;
+    }
+
+    if (line == "BUSY") {
+        response->status = Response::BUSY;
+        return 0;
+    }
+
+    if (!line.compare(0, 3, "OK ")) {
+        unsigned size = 0;
+        if (sscanf(line.c_str(), "OK %d %d %u", &response->width, &response->height, &size) != 3) {
+            return -1;
+        }
+
+        response->status = Response::OK;
+        response->data.resize(size);
+        return size ? daemon_reader_exact(reader, &response->data[0], size) : 0;
+    }
+
+    if (!line.compare(0, 4, "SHM ")) {
+        char     ring[256];
+        unsigned generation = 0;
+        if (sscanf(line.c_str(), "SHM %255s %d %u %d %d %d", ring, &response->slot, &generation,
+                   &response->width, &response->height, &response->stride) != 6) {
+            return -1;
+        }
+
+        response->status     = Response::SHM;
+        response->ring       = ring;
+        response->generation = generation;
+        return 0;
+    }
+
+    response->status  = Response::ERROR;
+    response->message = line;
+    return 0;
+}
+
+// Pins the slot and copies the rows out of it into data, for writing out.
+// Returns < 0 if the daemon has reused the slot in the meantime.
+static int read_slot(ShmRing *ring, const Response &response, std::string *data)
+{
+    ShmSlotInfo info;
+    const uint8_t *pixels = shm_ring_pin(ring, response.slot, response.generation, &info);
+    if (!pixels) {
+        return -1;
+    }
+
+    size_t row_size = (size_t)info.width * 4;
+    data->resize(row_size * info.height);
+    for (int y = 0; y < info.height; y++) {
+        memcpy(&(*data)[row_size * y], pixels + (size_t)info.stride * y, row_size);
+    }
+
+    shm_ring_unpin(ring, response.slot);
+
+    return 0;
+}
+
+static int send_request(daemon_socket sock, const DaemonRequest &request)
+{
+    std::string line = daemon_format_request(request);
+
+#ifndef _WIN32
+    if (request.has_fd) {
+        int fd = open(request.path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s :<\n", request.path.c_str());
+            return -1;
+        }
+
+        // The daemon gets its own copy of the descriptor, ours can go
+        int ret = daemon_socket_send_fd(sock, line, fd);
+        close(fd);
+        return ret;
+    }
+#endif
+
+    line += "\n";
+    return daemon_socket_send_all(sock, line.data(), line.size());
+}
+
+static int write_file(const char *filename, const std::string &data)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing :<\n", filename);
+        return -1;
+    }
+
+    size_t written = fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+
+    return written == data.size() ? 0 : -1;
+}
+
+// Parses the options shared by get and bench, returns the index of the first non-option
+static int parse_options(int argc, char **argv, int start, DaemonRequest *request,
+                         int *concurrency, int *count)
+{
+    int i = start;
+    for (; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--fd")) {
+            request->has_fd = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--shm")) {
+            request->shm = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return -1;
+        }
+
+        if (!strcmp(argv[i], "--size")) {
+            request->size_limit = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--format")) {
+            if (!daemon_parse_format(argv[++i], &request->format)) {
+                fprintf(stderr, "Unknown format %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--stream")) {
+            request->stream_prefix = (int64_t)atoi(argv[++i]) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--policy")) {
+            request->policy = argv[++i];
+        } else if (!strcmp(argv[i], "--concurrency")) {
+            *concurrency = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--requests")) {
+            *count = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    return i;
+}
+
+static int do_get(const char *socket_path, const DaemonRequest &request, const char *output)
+{
+    daemon_socket sock = daemon_socket_connect(socket_path);
+    if (sock == DAEMON_INVALID_SOCKET) {
+        fprintf(stderr, "Failed to connect to %s :<\n", socket_path);
+        return 1;
+    }
+
+    DaemonReader reader;
+    daemon_reader_init(&reader, sock);
+
+    Response response;
+    int ret = send_request(sock, request);
+    if (ret >= 0) {
+        ret = read_response(&reader, &response);
+    }
+    daemon_socket_close(sock);
+
+    if (ret < 0) {
+        fprintf(stderr, "Lost the connection to the daemon :<\n");
+        return 1;
+    }
+
+    if (response.status == Response::BUSY) {
+        fprintf(stderr, "The daemon is busy, try again later\n");
+        return 2;
+    }
+
+    // STATS lines come through as plain messages
+    if (request.stats && !response.message.compare(0, 6, "STATS ")) {
+        printf("%s\n", response.message.c_str());
+        return 0;
+    }
+
+    if (response.status == Response::ERROR) {
+        fprintf(stderr, "%s\n", response.message.c_str());
+        return 1;
+    }
+
+    // The file gets the same packed rows as over the socket
+    if (response.status == Response::SHM) {
+        ShmRing *ring = shm_ring_open(response.ring.c_str());
+        if (!ring) {
+            return 1;
+        }
+
+        ret = read_slot(ring, response, &response.data);
+        shm_ring_close(ring);
+
+        if (ret < 0) {
+            fprintf(stderr, "The daemon reused the slot before we got to it, try again\n");
+            return 2;
+        }
+
+        fprintf(stderr, "Slot %d of %s, stride %d\n", response.slot, response.ring.c_str(), response.stride);
+    }
+
+    fprintf(stderr, "Got a %dx%d thumbnail, %u bytes\n",
+            response.width, response.height, (unsigned)response.data.size());
+
+    return write_file(output, response.data) < 0 ? 1 : 0;
+}
+
+struct BenchState {
+    const char                      *socket_path;
+    DaemonRequest                    request;
+    std::vector<std::string>         files;
+    int                              count;
+
+    std::atomic<int>                 next;
+    std::atomic<int>                 busy;
+    std::atomic<int>                 errors;
+    std::atomic<int>                 stale;
+
+    std::mutex                       latency_lock;
+    std::vector<int64_t>             latencies_us;
+};
+
+static int64_t now_us(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench_thread(BenchState *state)
+{
+    daemon_socket sock = daemon_socket_connect(state->socket_path);
+    if (sock == DAEMON_INVALID_SOCKET) {
+        state->errors++;
+        return;
+    }
+
+    DaemonReader reader;
+    daemon_reader_init(&reader, sock);
+
+    std::vector<int64_t> latencies;
+
+    // Mapped on the first SHM response and kept
+    ShmRing *ring = nullptr;
+
+    for (;;) {
+        int index = state->next++;
+        if (index >= state->count) {
+            break;
+        }
+
+        DaemonRequest request = state->request;
+        request.path = state->files[index % state->files.size()];
+
+        // Back off while the daemon pushes back, it counts as one request
+        int64_t start = now_us();
+        int backoff_ms = 1;
+        Response response;
+
+        for (;;) {
+            if (send_request(sock, request) < 0 || read_response(&reader, &response) < 0) {
+                state->errors++;
+                daemon_socket_close(sock);
+                return;
+            }
+
+            if (response.status != Response::BUSY) {
+                break;
+            }
+
+            state->busy++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+            backoff_ms = std::min(backoff_ms * 2, 50);
+        }
+
+        if (response.status == Response::ERROR) {
+            state->errors++;
+            continue;
+        }
+
+        // Pinning and letting go is what a real client would do around
+        // using the pixels
+        if (response.status == Response::SHM) {
+            if (!ring) {
+                ring = shm_ring_open(response.ring.c_str());
+            }
+
+            ShmSlotInfo info;
+            if (!ring || !shm_ring_pin(ring, response.slot, response.generation, &info)) {
+                state->stale++;
+                continue;
+            }
+            shm_ring_unpin(ring, response.slot);
+        }
+
+        latencies.push_back(now_us() - start);
+    }
+
+    shm_ring_close(ring);
+    daemon_socket_close(sock);
+
+    std::lock_guard<std::mutex> lock(state->latency_lock);
+    state->latencies_us.insert(state->latencies_us.end(), latencies.begin(), latencies.end());
+}
+
+static double percentile_ms(const std::vector<int64_t> &sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.0;
+    }
+
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static int do_bench(const char *socket_path, const DaemonRequest &request,
+                    int concurrency, int count, char **files, int file_count)
+{
+    BenchState state;
+    state.socket_path = socket_path;
+    state.request     = request;
+    state.count       = count;
+    state.next        = 0;
+    state.busy        = 0;
+    state.errors      = 0;
+    state.stale       = 0;
+
+    for (int i = 0; i < file_count; i++) {
+        state.files.push_back(files[i]);
+    }
+
+    int64_t start = now_us();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < concurrency; i++) {
+        threads.push_back(std::thread(bench_thread, &state));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    double elapsed_s = (now_us() - start) / 1000000.0;
+
+    std::sort(state.latencies_us.begin(), state.latencies_us.end());
+
+    printf("requests: %u ok, %d errors, %d busy responses, %d stale slots, %d connections\n",
+           (unsigned)state.latencies_us.size(), (int)state.errors, (int)state.busy,
+           (int)state.stale, concurrency);
+    printf("throughput: %.1f thumbnails/s over %.2f s\n",
+           state.latencies_us.size() / elapsed_s, elapsed_s);
+    printf("latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           percentile_ms(state.latencies_us, 0.50), percentile_ms(state.latencies_us, 0.90),
+           percentile_ms(state.latencies_us, 0.99), percentile_ms(state.latencies_us, 1.0));
+
+    // Let the daemon tell its side of the story
+    DaemonRequest stats_request;
+    daemon_request_init(&stats_request);
+    stats_request.stats = true;
+
+    return do_get(socket_path, stats_request, nullptr);
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s socket_path get [options] input_file output_file\n"
+            "       %s socket_path bench [options] [--concurrency N] [--requests N] input_file...\n"
+            "       %s socket_path stats\n"
+            "Options: --size N --format bgra|jpg|png|webp --policy NAME --stream MB --fd --shm\n",
+            name, name, name);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *socket_path = argv[1];
+    const char *command     = argv[2];
+
+    if (daemon_socket_startup() < 0) {
+        return 1;
+    }
+
+    DaemonRequest request;
+    daemon_request_init(&request);
+
+    int concurrency = 8;
+    int count       = 1000;
+
+    if (!strcmp(command, "stats")) {
+        request.stats = true;
+        return do_get(socket_path, request, nullptr);
+    }
+
+    int first = parse_options(argc, argv, 3, &request, &concurrency, &count);
+    if (first < 0) {
+        return 1;
+    }
+
+#ifdef _WIN32
+    if (request.has_fd) {
+        fprintf(stderr, "Passing descriptors is not supported on Windows\n");
+        return 1;
+    }
+#endif
+
+    if (!strcmp(command, "get") && argc - first == 2) {
+        request.path = argv[first];
+        return do_get(socket_path, request, argv[first + 1]);
+    }
+
+    if (!strcmp(command, "bench") && argc - first >= 1 && concurrency > 0) {
+        return do_bench(socket_path, request, concurrency, count, argv + first, argc - first);
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,1178 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include "../src/file_reader.h"
+}
+
+#include "../src/block_cache.h"
+#include "../src/content_fingerprint.h"
+#include "../src/daemon_protocol.h"
+#include "../src/file_watcher.h"
+#include "../src/frame_policy.h"
+#include "../src/packet_cache.h"
+#include "../src/pipeline_pool.h"
+#include "../src/prefetch_reader.h"
+#include "../src/probe_index.h"
+#include "../src/result_cache.h"
+#include "../src/shm_ring.h"
+#include "../src/thumbnail_engine.h"
+#include "../src/thumbnail_store.h"
+
+#define DAEMON_DEFAULT_WORKERS  4
+#define DAEMON_DEFAULT_QUEUE    64
+#define DAEMON_DEFAULT_CACHE_MB 64
+#define DAEMON_DEFAULT_PACKET_CACHE_MB 32
+#define DAEMON_DEFAULT_BLOCK_CACHE_MB 32
+
+// A slot fits a 512x512 BGRA picture unless told otherwise
+#define DAEMON_DEFAULT_SHM_SLOT_KB 1024
+
+// How many queued jobs a worker takes at once. Jobs in a batch are sorted
+// so requests for the same file run back to back on the same worker.
+#define DAEMON_BATCH_SIZE       8
+
+// Quiet time before a file in a watched directory is considered written
+#define DAEMON_DEFAULT_SETTLE_MS 2000
+
+struct Job {
+    DaemonRequest            request;
+    std::string              key;
+
+    // The result goes into the cache under both. The fingerprint one is
+    // filled in by run_job, see fingerprint_lookup.
+    std::string              identity_key;
+    std::string              fingerprint_key;
+
+    // The keyframe packets are kept under this one, it leaves out the
+    // output size and format. Empty for streaming inputs.
+    std::string              packet_key;
+
+    // request.policy parsed
+    ThumbnailPolicy          policy;
+    int                      policy_value;
+
+    // The ring slot the engine scaled into for shm=1, -1 if none
+    int                      shm_slot;
+    uint32_t                 shm_generation;
+    ShmSlotInfo              shm_info;
+
+    FileReader              *reader;
+
+    std::mutex               lock;
+    std::condition_variable  done_cond;
+    bool                     done;
+    int                      error;
+    CachedThumbnail          result;
+};
+
+typedef std::shared_ptr<Job> JobPtr;
+
+struct DaemonStats {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<uint64_t> coalesced;
+    std::atomic<uint64_t> busy;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> batches;
+    std::atomic<int64_t>  engine_us;
+    std::atomic<uint64_t> io_reads;
+    std::atomic<uint64_t> io_bytes;
+    std::atomic<uint64_t> io_waits;
+    std::atomic<uint64_t> fingerprint_hits;
+    std::atomic<uint64_t> fingerprint_bytes;
+    std::atomic<uint64_t> index_hits;
+    std::atomic<uint64_t> shm_deliveries;
+    std::atomic<uint64_t> shm_fallbacks;
+    std::atomic<uint64_t> store_hits;
+    std::atomic<uint64_t> pregen_done;
+    std::atomic<uint64_t> pregen_skipped;
+    std::atomic<uint64_t> pregen_yields;
+    std::atomic<uint64_t> pregen_failed;
+
+    // From the first event for a file to its thumbnail being cached
+    std::atomic<int64_t>  pregen_latency_us;
+    std::atomic<int64_t>  pregen_latency_max_us;
+};
+
+static std::mutex                     queue_lock;
+static std::condition_variable        queue_cond;
+static std::deque<JobPtr>             job_queue;
+static std::map<std::string, JobPtr>  inflight_jobs;
+
+// Running jobs by fingerprint key, so copies of a file being decoded at the
+// same time wait for one decode
+static std::map<std::string, JobPtr>  fingerprint_jobs;
+static size_t                         max_queue = DAEMON_DEFAULT_QUEUE;
+
+// Plain stdio reads if false
+static bool                           use_prefetch = true;
+static PrefetchBackend                prefetch_backend = PREFETCH_BACKEND_AUTO;
+
+// Reads go through the shared block cache if true
+static bool                           use_block_cache = true;
+
+// For shm=1 requests, nullptr unless --shm-slots was given
+static ShmRing                       *shm_ring = nullptr;
+
+// Pre-generation for files showing up under --watch directories. It only
+// runs while no client request is being handled.
+static FileWatcher                   *file_watcher = nullptr;
+static DaemonRequest                  pregen_request;
+static std::atomic<int>               ondemand_active;
+static std::mutex                     pregen_lock;
+static std::condition_variable        pregen_cond;
+static std::deque<WatchedFile>        pregen_queue;
+
+// Files the watcher has seen that haven't settled yet
+static std::atomic<uint64_t>          pregen_settling;
+
+static DaemonStats daemon_stats;
+
+// The same file and the same output parameters give the same key, whatever
+// name or descriptor the file came in through. The size and mtime are the
+// version in the thumbnail store's sense, a changed file's new thumbnails
+// replace its old ones on disk.
+static std::string make_identity_source(const FileIdentity &identity)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "id:%" PRIx64 ":%" PRIx64 "@%" PRId64 ":%" PRId64,
+             identity.device, identity.inode, identity.size, identity.mtime);
+
+    return buf;
+}
+
+static std::string make_job_key(const std::string &source, const DaemonRequest &request)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "|%d|%s|%" PRId64 "|",
+             request.size_limit, daemon_format_name(request.format), request.stream_prefix);
+
+    return source + buf + request.policy;
+}
+
+// Every size and format of the picture comes from the same packets
+static std::string make_packet_key(const std::string &source, const DaemonRequest &request)
+{
+    return source + "|" + request.policy;
+}
+
+// The memory cache first, then whatever is on disk
+static bool cache_lookup(const std::string &key, CachedThumbnail *thumbnail)
+{
+    if (result_cache_get(key, thumbnail)) {
+        return true;
+    }
+
+    if (!thumbnail_store_load(key, thumbnail)) {
+        return false;
+    }
+
+    daemon_stats.store_hits++;
+    result_cache_put(key, *thumbnail);
+
+    return true;
+}
+
+static int alloc_bgra_in_result(void *opaque, int width, int height, uint8_t **data, int *linesize)
+{
+    CachedThumbnail *result = (CachedThumbnail *)opaque;
+
+    try {
+        result->data.resize((size_t)width * height * 4);
+    } catch (const std::bad_alloc &) {
+        return AVERROR(ENOMEM);
+    }
+
+    *data     = (uint8_t *)&result->data[0];
+    *linesize = width * 4;
+
+    return 0;
+}
+
+// The scaler writes straight into a ring slot, the pixels never get copied
+// on their way to the client
+static int alloc_bgra_in_slot(void *opaque, int width, int height, uint8_t **data, int *linesize)
+{
+    Job *job = (Job *)opaque;
+    int stride = (width * 4 + SHM_RING_ROW_ALIGN - 1) / SHM_RING_ROW_ALIGN * SHM_RING_ROW_ALIGN;
+
+    if ((size_t)stride * height <= shm_ring_slot_size(shm_ring)) {
+        job->shm_slot = shm_ring_claim(shm_ring);
+    }
+
+    // Too big for a slot or all of them pinned, the usual way then
+    if (job->shm_slot < 0) {
+        return alloc_bgra_in_result(&job->result, width, height, data, linesize);
+    }
+
+    job->shm_info.width  = width;
+    job->shm_info.height = height;
+    job->shm_info.stride = stride;
+
+    *data     = shm_ring_slot_data(shm_ring, job->shm_slot);
+    *linesize = stride;
+
+    return 0;
+}
+
+// Copies and renamed files miss the identity key but have the same contents.
+// The fingerprint is read through the input the decode is about to use, and
+// the blocks it hashes are ones the demuxer reads anyway, so the prefetch
+// and block cache readers fetch them once for both. Returns true if
+// job->result was filled in, from the cache or from a job for a copy that
+// was running at the same time.
+static bool fingerprint_lookup(const JobPtr &job, const ThumbnailInput *input)
+{
+    ContentFingerprint fingerprint;
+    if (content_fingerprint_compute(input, &fingerprint) < 0) {
+        return false;
+    }
+
+    daemon_stats.fingerprint_bytes += fingerprint.bytes_read;
+    job->fingerprint_key = make_job_key("fp:" + content_fingerprint_key(&fingerprint), job->request);
+
+    CachedThumbnail cached;
+    if (cache_lookup(job->fingerprint_key, &cached)) {
+        job->result = cached;
+        daemon_stats.cache_hits++;
+        daemon_stats.fingerprint_hits++;
+        return true;
+    }
+
+    JobPtr running;
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+
+        std::map<std::string, JobPtr>::iterator it = fingerprint_jobs.find(job->fingerprint_key);
+        if (it == fingerprint_jobs.end()) {
+            fingerprint_jobs[job->fingerprint_key] = job;
+            return false;
+        }
+        running = it->second;
+    }
+
+    // It's past this point already and never waits for anyone, so this can't deadlock
+    std::unique_lock<std::mutex> lock(running->lock);
+    while (!running->done) {
+        running->done_cond.wait(lock);
+    }
+
+    // Our own decode might fare better
+    if (running->error < 0) {
+        return false;
+    }
+
+    job->result = running->result;
+    daemon_stats.coalesced++;
+    daemon_stats.fingerprint_hits++;
+
+    return true;
+}
+
+static void run_job(const JobPtr &job)
+{
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
+
+    // Streaming inputs may well be pipes, read them front to back with stdio
+    bool streaming = job->request.stream_prefix > 0;
+
+    // Another size or format of the same picture was made not long ago, so
+    // one decode of the packets it came from does it and the file isn't read
+    CachedPackets packets;
+    cached_packets_init(&packets);
+
+    bool have_packets = !job->packet_key.empty() && packet_cache_get(job->packet_key, &packets);
+    if (!job->packet_key.empty()) {
+        request.keyframe_packets = &packets;
+    }
+
+    PrefetchReader *prefetch = use_prefetch && !streaming && !have_packets ?
+                               prefetch_reader_create(job->reader, prefetch_backend) : nullptr;
+    if (prefetch) {
+        request.input.opaque      = prefetch;
+        request.input.read_packet = prefetch_read_packet;
+        request.input.seek        = prefetch_seek;
+        request.input.prefetch    = prefetch_hint;
+    } else {
+        request.input.opaque      = job->reader;
+        request.input.read_packet = file_read_packet;
+        request.input.seek        = file_seek;
+    }
+
+    request.size_limit        = job->request.size_limit;
+    request.format            = job->request.format;
+    request.alloc_bgra        = alloc_bgra_in_result;
+    request.alloc_opaque      = &job->result;
+
+    if (job->request.shm && shm_ring) {
+        request.alloc_bgra    = alloc_bgra_in_slot;
+        request.alloc_opaque  = job.get();
+    }
+    request.streaming         = streaming;
+    request.max_prefix_bytes  = job->request.stream_prefix;
+    request.policy            = job->policy;
+    request.policy_value      = job->policy_value;
+
+    // Pipes have no stable identity to keep an index under
+    FileIdentity identity;
+    ProbeIndex   probe_index;
+    bool         have_identity = !streaming && !have_packets &&
+                                 file_reader_identity(job->reader, &identity) >= 0;
+
+    if (have_identity) {
+        probe_index_load(&identity, &probe_index);
+        request.probe_index = &probe_index;
+    }
+
+    // Other requests for the same file running alongside this one read the
+    // header and the Cues once between them
+    BlockCacheReader block_reader;
+    if (use_block_cache && have_identity) {
+        block_cache_reader_init(&block_reader, &request.input, &identity);
+        block_cache_reader_input(&block_reader, &request.input);
+    }
+
+    ThumbnailResult result;
+    memset(&result, 0, sizeof(result));
+    int ret = 0;
+
+    // Streaming inputs can't be read twice, so they go without
+    bool copy_done = have_identity && fingerprint_lookup(job, &request.input);
+    if (!copy_done) {
+        ret = thumbnail_generate(&request, &result);
+    }
+
+    if (result.used_probe_index) {
+        daemon_stats.index_hits++;
+    }
+
+    // A loaded index is stored again if the decode found the crop for it
+    if (ret >= 0 && have_identity && !copy_done && (!result.used_probe_index || probe_index.dirty)) {
+        probe_index.identity = identity;
+        probe_index_store(&probe_index);
+    }
+
+    if (ret >= 0 && !have_packets && packets.valid) {
+        packet_cache_put(job->packet_key, packets);
+    }
+
+    if (prefetch) {
+        PrefetchStats io_stats;
+        prefetch_reader_get_stats(prefetch, &io_stats);
+        prefetch_reader_close(prefetch);
+
+        daemon_stats.io_reads += io_stats.reads;
+        daemon_stats.io_bytes += io_stats.bytes;
+        daemon_stats.io_waits += io_stats.waits;
+    }
+
+    file_reader_close(job->reader);
+    job->reader = nullptr;
+
+    daemon_stats.engine_us += result.stats.total_us;
+
+    if (copy_done) {
+        // The next request for this name doesn't have to read anything
+        result_cache_put(job->identity_key, job->result);
+        thumbnail_store_save(job->identity_key, job->result);
+    } else if (ret >= 0) {
+        job->result.width  = result.width;
+        job->result.height = result.height;
+
+        if (result.data) {
+            job->result.data.assign((const char *)result.data, result.size);
+            av_free(result.data);
+        }
+
+        // The cache and anyone who coalesced without shm=1 still want the
+        // bytes. Copied while the slot is still ours, once it's published
+        // another worker could take it.
+        if (job->shm_slot >= 0) {
+            const uint8_t *pixels = shm_ring_slot_data(shm_ring, job->shm_slot);
+            size_t row_size = (size_t)result.width * 4;
+
+            job->result.data.resize(row_size * result.height);
+            for (int y = 0; y < result.height; y++) {
+                memcpy(&job->result.data[row_size * y], pixels + (size_t)job->shm_info.stride * y, row_size);
+            }
+        }
+
+        result_cache_put(job->identity_key, job->result);
+        thumbnail_store_save(job->identity_key, job->result);
+        if (!job->fingerprint_key.empty()) {
+            result_cache_put(job->fingerprint_key, job->result);
+            thumbnail_store_save(job->fingerprint_key, job->result);
+        }
+        daemon_stats.completed++;
+    } else {
+        daemon_stats.failed++;
+    }
+
+    // Clients can have it now. A failed one goes back empty.
+    if (job->shm_slot >= 0) {
+        if (ret < 0) {
+            memset(&job->shm_info, 0, sizeof(job->shm_info));
+        }
+        job->shm_generation = shm_ring_publish(shm_ring, job->shm_slot, &job->shm_info);
+        if (ret < 0) {
+            job->shm_slot = -1;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        inflight_jobs.erase(job->key);
+
+        std::map<std::string, JobPtr>::iterator it = fingerprint_jobs.find(job->fingerprint_key);
+        if (it != fingerprint_jobs.end() && it->second == job) {
+            fingerprint_jobs.erase(it);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(job->lock);
+    job->error = ret;
+    job->done  = true;
+    job->done_cond.notify_all();
+}
+
+static void worker_thread(void)
+{
+    for (;;) {
+        std::vector<JobPtr> batch;
+
+        {
+            std::unique_lock<std::mutex> lock(queue_lock);
+            while (job_queue.empty()) {
+                queue_cond.wait(lock);
+            }
+
+            while (!job_queue.empty() && batch.size() < DAEMON_BATCH_SIZE) {
+                batch.push_back(job_queue.front());
+                job_queue.pop_front();
+            }
+        }
+
+        daemon_stats.batches++;
+
+        std::stable_sort(batch.begin(), batch.end(), [](const JobPtr &a, const JobPtr &b) {
+            return a->key < b->key;
+        });
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            run_job(batch[i]);
+        }
+    }
+}
+
+// Pre-generation only gets the CPU and disk time nobody else wants
+static void lower_priority(void)
+{
+#ifdef __linux__
+    // Both are per thread on Linux
+    int tid = (int)syscall(SYS_gettid);
+
+    if (setpriority(PRIO_PROCESS, tid, 19) < 0) {
+        fprintf(stderr, "Failed to lower the pre-generation CPU priority\n");
+    }
+
+    // IOPRIO_WHO_PROCESS and the idle class, glibc has no wrapper for it
+    if (syscall(SYS_ioprio_set, 1, tid, 3 << 13) < 0) {
+        fprintf(stderr, "Failed to lower the pre-generation IO priority\n");
+    }
+#endif
+}
+
+struct PregenInput {
+    FileReader *reader;
+    bool        yielded;
+};
+
+// Gives up on the file as soon as a client wants something, it gets
+// another go once they're all served
+static int pregen_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    PregenInput *input = (PregenInput *)opaque;
+
+    if (ondemand_active > 0) {
+        input->yielded = true;
+        return AVERROR_EXIT;
+    }
+
+    return file_read_packet(input->reader, buf, buf_size);
+}
+
+static int64_t pregen_seek(void *opaque, int64_t offset, int whence)
+{
+    return file_seek(((PregenInput *)opaque)->reader, offset, whence);
+}
+
+// Returns 1 if it was cached already, AVERROR_EXIT if it should be tried again later
+static int pregen_file(const WatchedFile &file)
+{
+    FileReader *reader = file_reader_open(file.path.c_str());
+    if (!reader) {
+        return AVERROR(ENOENT);
+    }
+
+    FileIdentity identity;
+    if (file_reader_identity(reader, &identity) < 0) {
+        file_reader_close(reader);
+        return AVERROR(EIO);
+    }
+
+    // Under the key a request for it with the pre-generation settings gets
+    std::string source = make_identity_source(identity);
+    std::string key    = make_job_key(source, pregen_request);
+
+    CachedThumbnail thumbnail;
+    if (result_cache_get(key, &thumbnail) || thumbnail_store_load(key, &thumbnail)) {
+        file_reader_close(reader);
+        return 1;
+    }
+
+    ThumbnailPolicy policy;
+    int             policy_value;
+    frame_policy_parse(pregen_request.policy.c_str(), &policy, &policy_value);
+
+    PregenInput input;
+    input.reader  = reader;
+    input.yielded = false;
+
+    ProbeIndex probe_index;
+    probe_index_load(&identity, &probe_index);
+
+    // Requests for other sizes get away with a decode of these
+    CachedPackets packets;
+    cached_packets_init(&packets);
+
+    ThumbnailRequest request;
+    thumbnail_request_init(&request);
+    request.input.opaque      = &input;
+    request.input.read_packet = pregen_read_packet;
+    request.input.seek        = pregen_seek;
+    request.size_limit        = pregen_request.size_limit;
+    request.format            = pregen_request.format;
+    request.alloc_bgra        = alloc_bgra_in_result;
+    request.alloc_opaque      = &thumbnail;
+    request.policy            = policy;
+    request.policy_value      = policy_value;
+    request.probe_index       = &probe_index;
+    request.keyframe_packets  = &packets;
+
+    ThumbnailResult result;
+    int ret = thumbnail_generate(&request, &result);
+
+    file_reader_close(reader);
+
+    if (input.yielded) {
+        av_free(result.data);
+        return AVERROR_EXIT;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!result.used_probe_index || probe_index.dirty) {
+        probe_index.identity = identity;
+        probe_index_store(&probe_index);
+    }
+
+    thumbnail.width  = result.width;
+    thumbnail.height = result.height;
+    if (result.data) {
+        thumbnail.data.assign((const char *)result.data, result.size);
+        av_free(result.data);
+    }
+
+    result_cache_put(key, thumbnail);
+    thumbnail_store_save(key, thumbnail);
+    packet_cache_put(make_packet_key(source, pregen_request), packets);
+
+    return 0;
+}
+
+static void pregen_thread(void)
+{
+    lower_priority();
+
+    std::vector<WatchedFile> ready;
+
+    for (;;) {
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(pregen_lock);
+            idle = pregen_queue.empty();
+        }
+
+        // Events are read even while clients keep us from doing anything,
+        // the kernel's queue for them is only so long
+        if (file_watcher_poll(file_watcher, idle ? 1000 : 0, &ready) < 0) {
+            fprintf(stderr, "The file watcher broke, no more pre-generation :<\n");
+            return;
+        }
+        pregen_settling = file_watcher_pending(file_watcher);
+
+        WatchedFile file;
+        {
+            std::unique_lock<std::mutex> lock(pregen_lock);
+            pregen_queue.insert(pregen_queue.end(), ready.begin(), ready.end());
+            ready.clear();
+
+            if (pregen_queue.empty()) {
+                continue;
+            }
+
+            if (ondemand_active > 0) {
+                pregen_cond.wait_for(lock, std::chrono::milliseconds(500));
+                continue;
+            }
+
+            file = pregen_queue.front();
+            pregen_queue.pop_front();
+        }
+
+        int ret = pregen_file(file);
+
+        if (ret == AVERROR_EXIT) {
+            daemon_stats.pregen_yields++;
+
+            std::lock_guard<std::mutex> lock(pregen_lock);
+            pregen_queue.push_front(file);
+        } else if (ret == 1) {
+            daemon_stats.pregen_skipped++;
+        } else if (ret < 0) {
+            daemon_stats.pregen_failed++;
+        } else {
+            int64_t latency = av_gettime() - file.arrived_us;
+
+            daemon_stats.pregen_done++;
+            daemon_stats.pregen_latency_us += latency;
+            if (latency > daemon_stats.pregen_latency_max_us) {
+                daemon_stats.pregen_latency_max_us = latency;
+            }
+        }
+    }
+}
+
+// Held while a client request is being handled, pre-generation waits until
+// there are none
+struct OnDemandScope {
+    OnDemandScope()
+    {
+        ondemand_active++;
+    }
+
+    ~OnDemandScope()
+    {
+        if (--ondemand_active == 0) {
+            std::lock_guard<std::mutex> lock(pregen_lock);
+            pregen_cond.notify_all();
+        }
+    }
+};
+
+static int send_error(daemon_socket sock, int code, const std::string &message)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf), "ERR %d %s\n", code, message.c_str());
+    return daemon_socket_send_all(sock, buf, strlen(buf));
+}
+
+static int send_thumbnail(daemon_socket sock, const CachedThumbnail &thumbnail)
+{
+    char header[128];
+    snprintf(header, sizeof(header), "OK %d %d %u\n",
+             thumbnail.width, thumbnail.height, (unsigned)thumbnail.data.size());
+
+    if (daemon_socket_send_all(sock, header, strlen(header)) < 0) {
+        return -1;
+    }
+
+    return daemon_socket_send_all(sock, thumbnail.data.data(), thumbnail.data.size());
+}
+
+static int send_shm(daemon_socket sock, int slot, uint32_t generation, const ShmSlotInfo &info)
+{
+    char header[256];
+    snprintf(header, sizeof(header), "SHM %s %d %u %d %d %d\n", shm_ring_name(shm_ring),
+             slot, (unsigned)generation, info.width, info.height, info.stride);
+
+    daemon_stats.shm_deliveries++;
+
+    return daemon_socket_send_all(sock, header, strlen(header));
+}
+
+// Cached results and ones made for a client that didn't ask for shm=1 are
+// copied into a free slot, which is still cheaper than the socket
+static int copy_to_slot(const CachedThumbnail &thumbnail, uint32_t *generation, ShmSlotInfo *info)
+{
+    info->width  = thumbnail.width;
+    info->height = thumbnail.height;
+    info->stride = (thumbnail.width * 4 + SHM_RING_ROW_ALIGN - 1) / SHM_RING_ROW_ALIGN * SHM_RING_ROW_ALIGN;
+
+    size_t row_size = (size_t)thumbnail.width * 4;
+    if ((size_t)info->stride * info->height > shm_ring_slot_size(shm_ring) ||
+        row_size * thumbnail.height != thumbnail.data.size()) {
+        return -1;
+    }
+
+    int slot = shm_ring_claim(shm_ring);
+    if (slot < 0) {
+        return -1;
+    }
+
+    uint8_t *pixels = shm_ring_slot_data(shm_ring, slot);
+    for (int y = 0; y < thumbnail.height; y++) {
+        memcpy(pixels + (size_t)info->stride * y, thumbnail.data.data() + row_size * y, row_size);
+    }
+
+    *generation = shm_ring_publish(shm_ring, slot, info);
+
+    return slot;
+}
+
+// job is the one that made the thumbnail, if it was made for this request
+static int send_result(daemon_socket sock, const DaemonRequest &request,
+                       const CachedThumbnail &thumbnail, const Job *job)
+{
+    if (request.shm && shm_ring) {
+        // Still where the engine put it, unless it's been reused already
+        if (job && job->shm_slot >= 0 && shm_ring_current(shm_ring, job->shm_slot, job->shm_generation)) {
+            return send_shm(sock, job->shm_slot, job->shm_generation, job->shm_info);
+        }
+
+        uint32_t    generation;
+        ShmSlotInfo info;
+        int slot = copy_to_slot(thumbnail, &generation, &info);
+        if (slot >= 0) {
+            return send_shm(sock, slot, generation, info);
+        }
+
+        daemon_stats.shm_fallbacks++;
+    }
+
+    return send_thumbnail(sock, thumbnail);
+}
+
+static int send_stats(daemon_socket sock)
+{
+    ResultCacheStats cache_stats;
+    result_cache_get_stats(&cache_stats);
+
+    PacketCacheStats packet_stats;
+    packet_cache_get_stats(&packet_stats);
+
+    BlockCacheStats block_stats;
+    block_cache_get_stats(&block_stats);
+
+    ThumbnailStoreStats store_stats;
+    thumbnail_store_get_stats(&store_stats);
+
+    size_t queued = 0;
+    size_t inflight = 0;
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        queued   = job_queue.size();
+        inflight = inflight_jobs.size();
+    }
+
+    size_t pregen_queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(pregen_lock);
+        pregen_queued = pregen_queue.size();
+    }
+
+    uint64_t pregen_done = daemon_stats.pregen_done;
+    int64_t  pregen_latency_avg = pregen_done ? daemon_stats.pregen_latency_us / (int64_t)pregen_done : 0;
+
+    char buf[2048];
+    snprintf(buf, sizeof(buf),
+             "STATS requests=%" PRIu64 " cache_hits=%" PRIu64 " coalesced=%" PRIu64
+             " busy=%" PRIu64 " completed=%" PRIu64 " failed=%" PRIu64 " batches=%" PRIu64
+             " engine_ms=%" PRId64 " queued=%u inflight=%u cache_entries=%" PRIu64
+             " cache_bytes=%" PRIu64 " io_reads=%" PRIu64 " io_bytes=%" PRIu64
+             " io_waits=%" PRIu64 " fingerprint_hits=%" PRIu64 " fingerprint_bytes=%" PRIu64
+             " index_hits=%" PRIu64 " shm_deliveries=%" PRIu64 " shm_fallbacks=%" PRIu64
+             " store_hits=%" PRIu64 " store_bytes=%" PRIu64 " store_pruned=%" PRIu64
+             " store_superseded=%" PRIu64 " pregen_queued=%u pregen_settling=%" PRIu64
+             " pregen_done=%" PRIu64 " pregen_skipped=%" PRIu64 " pregen_yields=%" PRIu64
+             " pregen_failed=%" PRIu64 " pregen_latency_avg_ms=%" PRId64
+             " pregen_latency_max_ms=%" PRId64 " packet_lookups=%" PRIu64
+             " packet_hits=%" PRIu64 " packet_entries=%" PRIu64 " packet_bytes=%" PRIu64
+             " block_lookups=%" PRIu64 " block_hits=%" PRIu64 " block_waits=%" PRIu64
+             " block_loads=%" PRIu64 " block_load_bytes=%" PRIu64 " block_entries=%" PRIu64
+             " block_bytes=%" PRIu64 "\n",
+             (uint64_t)daemon_stats.requests, (uint64_t)daemon_stats.cache_hits,
+             (uint64_t)daemon_stats.coalesced, (uint64_t)daemon_stats.busy,
+             (uint64_t)daemon_stats.completed, (uint64_t)daemon_stats.failed,
+             (uint64_t)daemon_stats.batches, (int64_t)daemon_stats.engine_us / 1000,
+             (unsigned)queued, (unsigned)inflight, cache_stats.entries, cache_stats.bytes,
+             (uint64_t)daemon_stats.io_reads, (uint64_t)daemon_stats.io_bytes,
+             (uint64_t)daemon_stats.io_waits, (uint64_t)daemon_stats.fingerprint_hits,
+             (uint64_t)daemon_stats.fingerprint_bytes, (uint64_t)daemon_stats.index_hits,
+             (uint64_t)daemon_stats.shm_deliveries, (uint64_t)daemon_stats.shm_fallbacks,
+             (uint64_t)daemon_stats.store_hits, store_stats.bytes, store_stats.pruned,
+             store_stats.superseded, (unsigned)pregen_queued, (uint64_t)pregen_settling,
+             pregen_done, (uint64_t)daemon_stats.pregen_skipped, (uint64_t)daemon_stats.pregen_yields,
+             (uint64_t)daemon_stats.pregen_failed, pregen_latency_avg / 1000,
+             (int64_t)daemon_stats.pregen_latency_max_us / 1000, packet_stats.lookups,
+             packet_stats.hits, packet_stats.entries, packet_stats.bytes, block_stats.lookups,
+             block_stats.hits, block_stats.waits, block_stats.loads, block_stats.load_bytes,
+             block_stats.entries, block_stats.bytes);
+
+    return daemon_socket_send_all(sock, buf, strlen(buf));
+}
+
+// Returns < 0 if the connection should be dropped
+static int handle_request(daemon_socket sock, DaemonReader *reader, const std::string &line)
+{
+    DaemonRequest request;
+    std::string   error;
+
+    if (!daemon_parse_request(line, &request, &error)) {
+        return send_error(sock, AVERROR(EINVAL), error);
+    }
+
+    if (request.stats) {
+        return send_stats(sock);
+    }
+
+    daemon_stats.requests++;
+
+    OnDemandScope ondemand;
+
+    ThumbnailPolicy policy;
+    int             policy_value;
+    if (!frame_policy_parse(request.policy.c_str(), &policy, &policy_value)) {
+        return send_error(sock, AVERROR(EINVAL), "unknown frame policy");
+    }
+
+    FileReader *file = nullptr;
+    if (request.has_fd) {
+        int fd = daemon_reader_take_fd(reader);
+        if (fd < 0) {
+            return send_error(sock, AVERROR(EINVAL), "fd=1 but no descriptor was passed");
+        }
+        file = file_reader_open_fd(fd);
+    } else {
+        file = file_reader_open(request.path.c_str());
+    }
+
+    if (!file) {
+        return send_error(sock, AVERROR(ENOENT), "failed to open the input");
+    }
+
+    FileIdentity identity;
+    if (file_reader_identity(file, &identity) < 0) {
+        file_reader_close(file);
+        return send_error(sock, AVERROR(EIO), "failed to stat the input");
+    }
+
+    std::string identity_key = make_job_key(make_identity_source(identity), request);
+    std::string packet_key   = request.stream_prefix ? std::string()
+                                                     : make_packet_key(make_identity_source(identity), request);
+
+    CachedThumbnail cached;
+    if (cache_lookup(identity_key, &cached)) {
+        file_reader_close(file);
+        daemon_stats.cache_hits++;
+        return send_result(sock, request, cached, nullptr);
+    }
+
+    // Copies under other names are looked up by their contents once the job
+    // runs, see fingerprint_lookup
+    std::string key = identity_key;
+
+    JobPtr job;
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+
+        std::map<std::string, JobPtr>::iterator it = inflight_jobs.find(key);
+        if (it != inflight_jobs.end()) {
+            // Someone already asked for exactly this, wait for their result
+            job = it->second;
+            daemon_stats.coalesced++;
+        } else if (job_queue.size() >= max_queue) {
+            job.reset();
+        } else {
+            job = std::make_shared<Job>();
+            job->request         = request;
+            job->key             = key;
+            job->identity_key    = identity_key;
+            job->packet_key      = packet_key;
+            job->policy          = policy;
+            job->policy_value    = policy_value;
+            job->shm_slot        = -1;
+            job->shm_generation  = 0;
+            job->reader          = file;
+            job->done            = false;
+            job->error           = 0;
+            file = nullptr;
+
+            job_queue.push_back(job);
+            inflight_jobs[key] = job;
+            queue_cond.notify_one();
+        }
+    }
+
+    // Either coalesced or rejected, we don't need our own handle then
+    file_reader_close(file);
+
+    if (!job) {
+        daemon_stats.busy++;
+        return daemon_socket_send_all(sock, "BUSY\n", 5);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(job->lock);
+        while (!job->done) {
+            job->done_cond.wait(lock);
+        }
+    }
+
+    if (job->error < 0) {
+        char message[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+        av_strerror(job->error, message, sizeof(message));
+        return send_error(sock, job->error, message);
+    }
+
+    return send_result(sock, request, job->result, job.get());
+}
+
+#ifndef _WIN32
+// The ring's name would stay around in /dev/shm otherwise
+static void exit_on_signal(int sig)
+{
+    if (shm_ring) {
+        shm_ring_unlink(shm_ring);
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+#endif
+
+static void connection_thread(daemon_socket sock)
+{
+    DaemonReader reader;
+    daemon_reader_init(&reader, sock);
+
+    std::string line;
+    while (daemon_reader_line(&reader, &line) >= 0) {
+        if (line.empty()) {
+            continue;
+        }
+
+        if (handle_request(sock, &reader, line) < 0) {
+            break;
+        }
+    }
+
+#ifndef _WIN32
+    int leftover_fd = daemon_reader_take_fd(&reader);
+    if (leftover_fd >= 0) {
+        close(leftover_fd);
+    }
+#endif
+
+    daemon_socket_close(sock);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s socket_path [--workers N] [--queue N] [--cache-mb N]"
+                " [--packet-cache-mb N] [--block-cache-mb N] [--io auto|uring|threads|stdio]"
+                " [--index-dir DIR]"
+                " [--shm-slots N] [--shm-slot-kb N]"
+                " [--store-dir DIR] [--store-max-mb N] [--watch DIR]... [--settle-ms N] [--pregen-size N]"
+                " [--pregen-format F] [--pregen-policy P]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const char *socket_path = argv[1];
+    int workers = DAEMON_DEFAULT_WORKERS;
+    int cache_mb = DAEMON_DEFAULT_CACHE_MB;
+    int packet_cache_mb = DAEMON_DEFAULT_PACKET_CACHE_MB;
+    int block_cache_mb = DAEMON_DEFAULT_BLOCK_CACHE_MB;
+    int shm_slots = 0;
+    int shm_slot_kb = DAEMON_DEFAULT_SHM_SLOT_KB;
+    int settle_ms = DAEMON_DEFAULT_SETTLE_MS;
+    int store_max_mb = 0;
+    std::vector<std::string> watch_dirs;
+
+    daemon_request_init(&pregen_request);
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--workers")) {
+            workers = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--queue")) {
+            max_queue = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--cache-mb")) {
+            cache_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--packet-cache-mb")) {
+            packet_cache_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--block-cache-mb")) {
+            block_cache_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--shm-slots")) {
+            shm_slots = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--shm-slot-kb")) {
+            shm_slot_kb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--index-dir")) {
+            probe_index_set_dir(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--store-dir")) {
+            thumbnail_store_set_dir(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--store-max-mb")) {
+            store_max_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--watch")) {
+            watch_dirs.push_back(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--settle-ms")) {
+            settle_ms = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--pregen-size")) {
+            pregen_request.size_limit = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--pregen-format")) {
+            if (!daemon_parse_format(argv[i + 1], &pregen_request.format)) {
+                fprintf(stderr, "Unknown format %s\n", argv[i + 1]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--pregen-policy")) {
+            ThumbnailPolicy policy;
+            int             policy_value;
+            if (!frame_policy_parse(argv[i + 1], &policy, &policy_value)) {
+                fprintf(stderr, "Unknown frame policy %s\n", argv[i + 1]);
+                return 1;
+            }
+            pregen_request.policy = argv[i + 1];
+        } else if (!strcmp(argv[i], "--io")) {
+            if (!strcmp(argv[i + 1], "stdio")) {
+                use_prefetch = false;
+            } else if (!strcmp(argv[i + 1], "uring")) {
+                prefetch_backend = PREFETCH_BACKEND_URING;
+            } else if (!strcmp(argv[i + 1], "threads")) {
+                prefetch_backend = PREFETCH_BACKEND_THREADS;
+            } else if (strcmp(argv[i + 1], "auto")) {
+                fprintf(stderr, "Unknown IO backend %s\n", argv[i + 1]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (workers < 1) {
+        workers = 1;
+    }
+
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // Everything that can be warmed up once is done here and stays warm
+    pipeline_global_init();
+    result_cache_set_limit((size_t)cache_mb * 1024 * 1024);
+    packet_cache_set_limit((size_t)packet_cache_mb * 1024 * 1024);
+
+    // 0 turns it off
+    use_block_cache = block_cache_mb > 0;
+    block_cache_set_limit((size_t)(block_cache_mb > 0 ? block_cache_mb : 0) * 1024 * 1024);
+
+    // 0 for no limit
+    thumbnail_store_set_limit((uint64_t)(store_max_mb > 0 ? store_max_mb : 0) * 1024 * 1024);
+
+    if (daemon_socket_startup() < 0) {
+        return 1;
+    }
+
+    // Clients that can't map it still get everything over the socket
+    if (shm_slots > 0 && shm_slot_kb > 0) {
+        shm_ring = shm_ring_create(shm_slots, (size_t)shm_slot_kb * 1024);
+        if (shm_ring) {
+            fprintf(stderr, "Shared memory ring %s with %d slots of %d KiB\n",
+                    shm_ring_name(shm_ring), shm_slots, shm_slot_kb);
+#ifndef _WIN32
+            signal(SIGINT, exit_on_signal);
+            signal(SIGTERM, exit_on_signal);
+#endif
+        }
+    }
+
+    daemon_socket listen_socket = daemon_socket_listen(socket_path, 64);
+    if (listen_socket == DAEMON_INVALID_SOCKET) {
+        return 1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        std::thread(worker_thread).detach();
+    }
+
+    // Thumbnails for new files are made ahead of time, in the background
+    if (!watch_dirs.empty()) {
+        file_watcher = file_watcher_create(settle_ms);
+        if (!file_watcher) {
+            return 1;
+        }
+
+        for (size_t i = 0; i < watch_dirs.size(); i++) {
+            if (file_watcher_add_root(file_watcher, watch_dirs[i]) < 0) {
+                return 1;
+            }
+        }
+
+        if (!thumbnail_store_enabled()) {
+            fprintf(stderr, "No --store-dir, pre-generated thumbnails only go into memory\n");
+        }
+
+        std::thread(pregen_thread).detach();
+    }
+
+    fprintf(stderr, "Listening on %s with %d workers, queue limit %u\n",
+            socket_path, workers, (unsigned)max_queue);
+
+    for (;;) {
+        daemon_socket client = accept(listen_socket, NULL, NULL);
+        if (client == DAEMON_INVALID_SOCKET) {
+            continue;
+        }
+
+        std::thread(connection_thread, client).detach();
+    }
+
+    return 0;
+}